@@ -0,0 +1,606 @@
+/**
+ * IceNet-Init Synthetic Boot Benchmark
+ *
+ * Boots icenet-init as PID 1 of a fresh PID and mount namespace against
+ * a generated service graph, and reports how long it took for every
+ * service to become ready, how much CPU init itself used, and how quickly
+ * crashed services were restarted.
+ *
+ * Usage:
+ *   icenet-bench [-n services[,services...]] [-f fan-out] [-d max-delay-ms]
+ *                [-c crash-percent] [-r runs] [-s seed] [-m notify|started] [-P]
+ *                [-i init-binary]
+ *
+ * The same binary is the service: each one sleeps for its start delay,
+ * then either crashes once or reports READY=1 and waits to be stopped.
+ * Without root, a user namespace is created as well.
+ *
+ * Copyright (c) 2025 IceNet-01
+ * Licensed under MIT
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+/* Must match icenet-init.c */
+#define TRACE_PATH "/run/icenet-init/boot.trace"
+#define TRACE_MAGIC "ICETRACE"
+#define MAX_DEPS 16
+
+enum {
+    TRACE_PHASE_BEGIN = 1,
+    TRACE_PHASE_END,
+    TRACE_SERVICE,
+    TRACE_DEPENDS,
+    TRACE_FORK,
+    TRACE_EXEC,
+    TRACE_READY,
+    TRACE_EXIT
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} trace_header_t;
+
+typedef struct {
+    uint64_t time_ns;
+    uint16_t type;
+    uint16_t service;
+    uint16_t length;
+    uint16_t reserved;
+    int32_t arg;
+    int32_t pid;
+} trace_record_t;
+
+#define MAX_SERVICES 2000
+#define BOOT_TIMEOUT_MS 120000
+#define POLL_MS 2
+
+typedef struct {
+    int services;
+    int fanout;
+    int max_delay_ms;
+    int crash_percent;
+    unsigned int seed;
+    const char *init_path;
+    const char *ready;          /* ready= mode of the generated services */
+    int no_psi;                 /* Boot init as if /proc/pressure were missing */
+} bench_config_t;
+
+/* What one boot measured */
+typedef struct {
+    uint64_t boot_ns;           /* Start of init to the last first READY */
+    uint64_t cpu_ns;            /* init's own CPU time at that point */
+    int forks;
+    int restarts;
+    uint64_t restart_total_ns;  /* Crash to respawned fork, summed */
+    uint64_t restart_max_ns;
+    uint64_t stop_ns;           /* SIGTERM to init exiting */
+} bench_result_t;
+
+/* Per generated service, indexed by its number */
+typedef struct {
+    int crashes;
+    uint64_t ready_ns;          /* First READY, 0 until then */
+    int forks;
+    uint64_t respawn_ns;        /* Second fork, i.e. the restart */
+} bench_service_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+/**
+ * Service mode: start up, then crash once or report ready
+ *
+ * A crashing service leaves the time of its crash in its marker file, so
+ * the respawned instance knows not to crash again and the harness can
+ * measure the restart.
+ */
+static int run_service(int argc, char *argv[]) {
+    sleep_ms(atol(argv[2]));
+
+    if (argc > 3 && access(argv[3], F_OK) < 0) {
+        FILE *f = fopen(argv[3], "w");
+        if (f) {
+            fprintf(f, "%llu\n", (unsigned long long)now_ns());
+            fclose(f);
+        }
+        _exit(1);
+    }
+
+    const char *fd = getenv("NOTIFY_FD");
+    if (fd && send(atoi(fd), "READY=1", 7, 0) < 0)
+        perror("READY");
+
+    for (;;)
+        pause();
+}
+
+/**
+ * Write the service graph into dir/services
+ *
+ * Every service names up to `fanout` later services as dependents, so the
+ * graph is acyclic and a larger fan-out gives longer dependency chains.
+ */
+static int generate_services(const char *dir, const bench_config_t *cfg, const char *self,
+                             bench_service_t *svcs) {
+    int (*deps)[MAX_DEPS] = calloc((size_t)cfg->services, sizeof(*deps));
+    int *dep_count = calloc((size_t)cfg->services, sizeof(int));
+    char path[4096];
+
+    if (!deps || !dep_count) {
+        free(deps);
+        free(dep_count);
+        return -1;
+    }
+
+    srand(cfg->seed);
+    for (int i = 0; i < cfg->services - 1; i++) {
+        for (int k = 0; k < cfg->fanout; k++) {
+            int j = i + 1 + rand() % (cfg->services - i - 1);
+            if (dep_count[j] < MAX_DEPS)
+                deps[j][dep_count[j]++] = i;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/services", dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/crash", dir);
+    mkdir(path, 0755);
+
+    for (int i = 0; i < cfg->services; i++) {
+        int delay = cfg->max_delay_ms > 0 ? rand() % (cfg->max_delay_ms + 1) : 0;
+        svcs[i].crashes = rand() % 100 < cfg->crash_percent;
+
+        snprintf(path, sizeof(path), "%s/services/b%04d", dir, i);
+        FILE *f = fopen(path, "w");
+        if (!f) {
+            perror(path);
+            free(deps);
+            free(dep_count);
+            return -1;
+        }
+
+        fprintf(f, "exec=%s --service %d", self, delay);
+        if (svcs[i].crashes)
+            fprintf(f, " %s/crash/b%04d", dir, i);
+        fprintf(f, "\nready=%s\nrespawn=yes\nrespawn-delay=1\nrespawn-jitter=0\n",
+                cfg->ready);
+
+        /* Duplicates from the random draw are harmless but pointless */
+        for (int k = 0; k < dep_count[i]; k++) {
+            int seen = 0;
+            for (int m = 0; m < k; m++)
+                seen |= deps[i][m] == deps[i][k];
+            if (!seen)
+                fprintf(f, "depends=b%04d\n", deps[i][k]);
+        }
+        fclose(f);
+    }
+
+    free(deps);
+    free(dep_count);
+    return 0;
+}
+
+/**
+ * Become root of a new user namespace mapping only our own IDs
+ */
+static int map_user(uid_t uid, gid_t gid) {
+    char map[64];
+    int fd;
+
+    fd = open("/proc/self/setgroups", O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (write(fd, "deny", 4) < 0) {
+            /* Older kernels have no setgroups file to write */
+        }
+        close(fd);
+    }
+
+    snprintf(map, sizeof(map), "0 %u 1", (unsigned)uid);
+    fd = open("/proc/self/uid_map", O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, map, strlen(map)) < 0) {
+        perror("uid_map");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+
+    snprintf(map, sizeof(map), "0 %u 1", (unsigned)gid);
+    fd = open("/proc/self/gid_map", O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, map, strlen(map)) < 0) {
+        perror("gid_map");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * CPU time used by PID 1 so far, in nanoseconds
+ *
+ * /proc is init's own, mounted in the namespace we share with it.
+ * schedstat counts in nanoseconds; stat only in clock ticks, which is too
+ * coarse for small graphs but still works without schedstats.
+ */
+static uint64_t init_cpu_ns(void) {
+    char buf[1024];
+    unsigned long long runtime = 0, utime = 0, stime = 0;
+
+    FILE *f = fopen("/proc/1/schedstat", "r");
+    if (f) {
+        int ok = fscanf(f, "%llu", &runtime) == 1;
+        fclose(f);
+        if (ok)
+            return runtime;
+    }
+
+    int fd = open("/proc/1/stat", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    /* Fields after the command name, which may contain spaces */
+    char *p = strrchr(buf, ')');
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                     &utime, &stime) != 2)
+        return 0;
+
+    long hz = sysconf(_SC_CLK_TCK);
+    return (utime + stime) * 1000000000ULL / (uint64_t)(hz > 0 ? hz : 100);
+}
+
+/**
+ * Follow init's boot trace until every service has been ready once
+ *
+ * Returns 0 once they have, -1 on timeout or if init died.
+ */
+static int follow_trace(pid_t init_pid, const bench_config_t *cfg, bench_service_t *svcs,
+                        bench_result_t *res) {
+    int *map = malloc(65536 * sizeof(int));
+    size_t cap = 1 << 20;
+    char *buf = malloc(cap);
+    size_t len = 0, pos = 0;
+    int header = 0;
+    int ready = 0;
+    int fd = -1;
+    uint64_t start = now_ns();
+
+    if (!map || !buf) {
+        free(map);
+        free(buf);
+        return -1;
+    }
+    for (int i = 0; i < 65536; i++)
+        map[i] = -1;
+
+    while (ready < cfg->services) {
+        if (now_ns() - start > (uint64_t)BOOT_TIMEOUT_MS * 1000000ULL ||
+            waitpid(init_pid, NULL, WNOHANG) != 0)
+            break;
+
+        if (fd < 0)
+            fd = open(TRACE_PATH, O_RDONLY | O_CLOEXEC);
+
+        ssize_t n = 0;
+        if (fd >= 0 && len < cap)
+            n = read(fd, buf + len, cap - len);
+        if (n <= 0) {
+            sleep_ms(POLL_MS);
+            continue;
+        }
+        len += (size_t)n;
+
+        if (!header) {
+            if (len < sizeof(trace_header_t))
+                continue;
+            if (memcmp(buf, TRACE_MAGIC, 8) != 0) {
+                fprintf(stderr, "%s is not an icenet-init trace\n", TRACE_PATH);
+                break;
+            }
+            pos = sizeof(trace_header_t);
+            header = 1;
+        }
+
+        while (len - pos >= sizeof(trace_record_t)) {
+            trace_record_t rec;
+            memcpy(&rec, buf + pos, sizeof(rec));
+            if (len - pos < sizeof(rec) + rec.length)
+                break;
+
+            const char *text = buf + pos + sizeof(rec);
+            int id = rec.service != 0xffff ? map[rec.service] : -1;
+            pos += sizeof(rec) + rec.length;
+
+            if (rec.type == TRACE_SERVICE && rec.service != 0xffff && rec.length > 0 &&
+                text[0] == 'b') {
+                int i = atoi(text + 1);
+                if (i >= 0 && i < cfg->services)
+                    map[rec.service] = i;
+            } else if (rec.type == TRACE_FORK && id >= 0) {
+                res->forks++;
+                if (++svcs[id].forks == 2)
+                    svcs[id].respawn_ns = rec.time_ns;
+            } else if (rec.type == TRACE_READY && id >= 0 && svcs[id].ready_ns == 0) {
+                svcs[id].ready_ns = rec.time_ns;
+                ready++;
+            }
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+    free(map);
+    free(buf);
+    return ready == cfg->services ? 0 : -1;
+}
+
+/**
+ * Crash to respawn time of every service that crashed
+ */
+static void measure_restarts(const char *dir, const bench_config_t *cfg,
+                             const bench_service_t *svcs, bench_result_t *res) {
+    char path[4096];
+
+    for (int i = 0; i < cfg->services; i++) {
+        if (!svcs[i].crashes || svcs[i].respawn_ns == 0)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/crash/b%04d", dir, i);
+        FILE *f = fopen(path, "r");
+        unsigned long long crashed = 0;
+        if (!f)
+            continue;
+        if (fscanf(f, "%llu", &crashed) != 1 || crashed > svcs[i].respawn_ns)
+            crashed = 0;
+        fclose(f);
+        if (crashed == 0)
+            continue;
+
+        uint64_t latency = svcs[i].respawn_ns - crashed;
+        res->restarts++;
+        res->restart_total_ns += latency;
+        if (latency > res->restart_max_ns)
+            res->restart_max_ns = latency;
+    }
+}
+
+/**
+ * One boot, run in a child that owns the namespaces
+ *
+ * Prints the result row and exits with 0 on success.
+ */
+static int run_boot(const char *dir, const bench_config_t *cfg, const char *self) {
+    bench_service_t *svcs = calloc((size_t)cfg->services, sizeof(*svcs));
+    bench_result_t res;
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+    int flags = CLONE_NEWPID | CLONE_NEWNS;
+
+    memset(&res, 0, sizeof(res));
+    if (!svcs || generate_services(dir, cfg, self, svcs) < 0)
+        return 1;
+
+    if (geteuid() != 0)
+        flags |= CLONE_NEWUSER;
+    if (unshare(flags) < 0) {
+        perror("unshare");
+        return 1;
+    }
+    if ((flags & CLONE_NEWUSER) && map_user(uid, gid) < 0)
+        return 1;
+
+    /* init mounts /proc and /run; keep them out of the host's namespace */
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0) {
+        perror("Failed to make / private");
+        return 1;
+    }
+
+    char log[4096], services[4096];
+    snprintf(log, sizeof(log), "%s/init.log", dir);
+    snprintf(services, sizeof(services), "%s/services", dir);
+
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        /* Take the namespace down with us if the harness dies */
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        if (cfg->no_psi)
+            setenv("ICENET_NO_PSI", "1", 1);
+        execl(cfg->init_path, cfg->init_path, "--test", services, (char *)NULL);
+        perror(cfg->init_path);
+        _exit(127);
+    }
+
+    int booted = follow_trace(pid, cfg, svcs, &res) == 0;
+    if (booted) {
+        res.cpu_ns = init_cpu_ns();
+        for (int i = 0; i < cfg->services; i++) {
+            if (svcs[i].ready_ns > start && svcs[i].ready_ns - start > res.boot_ns)
+                res.boot_ns = svcs[i].ready_ns - start;
+        }
+        measure_restarts(dir, cfg, svcs, &res);
+    }
+
+    uint64_t stop = now_ns();
+    kill(pid, booted ? SIGTERM : SIGKILL);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+    res.stop_ns = now_ns() - stop;
+    free(svcs);
+
+    if (!booted) {
+        fprintf(stderr, "Boot of %d services did not finish; see %s\n", cfg->services, log);
+        return 1;
+    }
+
+    double boot_ms = res.boot_ns / 1e6;
+    double cpu_ms = res.cpu_ns / 1e6;
+    printf("%8d %6d %6d %5d%% %9.1f %8.1f %5.1f%% %8.1f %8d %8.2f %8.2f %8.1f\n",
+           cfg->services, cfg->fanout, cfg->max_delay_ms, cfg->crash_percent, boot_ms,
+           cpu_ms, boot_ms > 0 ? cpu_ms * 100.0 / boot_ms : 0.0,
+           res.forks > 0 ? cpu_ms * 1000.0 / res.forks : 0.0, res.restarts,
+           res.restarts > 0 ? res.restart_total_ns / 1e6 / res.restarts : 0.0,
+           res.restart_max_ns / 1e6, res.stop_ns / 1e6);
+    fflush(stdout);
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -n N[,N...]  Services per boot, 1 to %d (default 10,100,500,2000)\n",
+            MAX_SERVICES);
+    fprintf(stderr, "  -f N         Dependents drawn for each service (default 3)\n");
+    fprintf(stderr, "  -d MS        Maximum start delay of a service (default 20)\n");
+    fprintf(stderr, "  -c PERCENT   Services that crash once before becoming ready (default 5)\n");
+    fprintf(stderr, "  -r N         Boots per size (default 1)\n");
+    fprintf(stderr, "  -s SEED      Seed for the generated graph (default 1)\n");
+    fprintf(stderr, "  -m MODE      ready= mode of the services: notify (default) or started\n");
+    fprintf(stderr, "  -P           Boot init with PSI disabled, as on kernels without it\n");
+    fprintf(stderr, "  -i PATH      init binary to boot (default ./icenet-init)\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2 && strcmp(argv[1], "--service") == 0)
+        return run_service(argc, argv);
+
+    bench_config_t cfg = { 0, 3, 20, 5, 1, "./icenet-init", "notify", 0 };
+    const char *sizes = "10,100,500,2000";
+    int runs = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:f:d:c:r:s:m:Pi:h")) != -1) {
+        switch (opt) {
+            case 'n': sizes = optarg; break;
+            case 'f': cfg.fanout = atoi(optarg); break;
+            case 'd': cfg.max_delay_ms = atoi(optarg); break;
+            case 'c': cfg.crash_percent = atoi(optarg); break;
+            case 'r': runs = atoi(optarg); break;
+            case 's': cfg.seed = (unsigned int)strtoul(optarg, NULL, 10); break;
+            case 'm': cfg.ready = optarg; break;
+            case 'P': cfg.no_psi = 1; break;
+            case 'i': cfg.init_path = optarg; break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (cfg.fanout < 0 || cfg.max_delay_ms < 0 || cfg.crash_percent < 0 ||
+        cfg.crash_percent > 100 || runs < 1 ||
+        (strcmp(cfg.ready, "notify") != 0 && strcmp(cfg.ready, "started") != 0)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* Services are started by absolute path from inside the namespace */
+    char self[4096], init_path[4096];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (n < 0) {
+        perror("/proc/self/exe");
+        return 1;
+    }
+    self[n] = '\0';
+    if (!realpath(cfg.init_path, init_path)) {
+        perror(cfg.init_path);
+        return 1;
+    }
+    cfg.init_path = init_path;
+
+    printf("%8s %6s %6s %6s %9s %8s %6s %8s %8s %8s %8s %8s\n", "SERVICES", "FANOUT",
+           "DELAY", "CRASH", "BOOT-MS", "CPU-MS", "CPU", "US/START", "RESTARTS", "RST-AVG",
+           "RST-MAX", "STOP-MS");
+    fflush(stdout);
+
+    int failed = 0;
+    for (const char *p = sizes; *p; p += strcspn(p, ","), p += *p == ',') {
+        cfg.services = atoi(p);
+        if (cfg.services < 1 || cfg.services > MAX_SERVICES) {
+            fprintf(stderr, "Service count must be 1 to %d\n", MAX_SERVICES);
+            return 1;
+        }
+
+        for (int run = 0; run < runs; run++) {
+            const char *tmp = getenv("TMPDIR");
+            char dir[1024];
+            snprintf(dir, sizeof(dir), "%s/icenet-bench.XXXXXX", tmp ? tmp : "/tmp");
+            if (!mkdtemp(dir)) {
+                perror("mkdtemp");
+                return 1;
+            }
+
+            pid_t pid = fork();
+            if (pid == 0)
+                _exit(run_boot(dir, &cfg, self));
+
+            int status = 1;
+            if (pid < 0)
+                perror("fork");
+            else
+                waitpid(pid, &status, 0);
+            /* Keep a failed run's services and init log for a look */
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                failed = 1;
+            else
+                nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+            cfg.seed++;
+        }
+    }
+
+    return failed;
+}
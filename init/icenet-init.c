@@ -12,6 +12,8 @@
  * Licensed under MIT
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,49 +27,571 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <dirent.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/statvfs.h>
+#include <poll.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <spawn.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/fiemap.h>
+#include <linux/kexec.h>
+#include <sys/utsname.h>
+#include <arpa/inet.h>
 
 #define VERSION "0.1.0"
 #define SERVICE_DIR "/etc/icenet/services"
-#define MAX_SERVICES 128
+#define SERVICE_DB "/etc/icenet/services.db"
+#define INIT_PATH "/sbin/icenet-init"
+#define SERVICE_CHUNK 64
 #define MAX_DEPS 16
+#define MAX_ARGS 32
+#define MAX_ENV 16
+#define SPAWN_STACK_SIZE (64 * 1024)
+#define MAX_EVENTS 32
+#define RESPAWN_DELAY_MS 1000
+#define RESPAWN_MAX_DELAY_MS 30000
+#define RESPAWN_JITTER_PCT 10
+#define RESPAWN_LIMIT 5
+#define RESPAWN_WINDOW_S 60
+#define MAX_RESPAWN_LIMIT 32
+#define MAX_LISTEN 8
+#define LISTEN_FDS_START 3
+#define RUN_DIR "/run/icenet-init"
+#define TRACE_PATH RUN_DIR "/boot.trace"
+#define CONTROL_PATH RUN_DIR "/control"
+#define FSTAB_PATH "/etc/fstab"
+#define MAX_MOUNTS 64
+#define MAX_MOUNT_REQS 4
+#define DEVICE_TIMEOUT_MS 30000
+#define MAX_DEVICE_REQS 4
+#define MODPROBE_BATCH 16
+#define UEVENT_BUFFER_SIZE (8 * 1024 * 1024)
+#define READAHEAD_DIR "/var/lib/icenet-init"
+#define READAHEAD_LIST READAHEAD_DIR "/readahead"
+#define READAHEAD_MAGIC "icenet-readahead 1"
+#define READAHEAD_RECORD_MS 20000
+#define READAHEAD_MAX_FILES 4096
+#define PACKAGE_DB_DIR "/var/lib/ice-pkg"
+
+#ifndef FS_IOC_FIEMAP
+#define FS_IOC_FIEMAP _IOWR('f', 11, struct fiemap)
+#endif
+#define STOP_TIMEOUT_MS 5000
+#define KILL_TIMEOUT_MS 5000
+#define REMAINING_TIMEOUT_MS 3000
+#define ADMIT_SLOT_MS 500
+#define ADMIT_SAMPLE_MS 100
+#define ADMIT_MAX_PER_CPU 16
+#define ADMIT_PRESSURE_HIGH 40
+#define ADMIT_PRESSURE_LOW 10
+#define KEXEC_BOOT_DIR "/boot"
+#define LOG_DIR "/var/log/icenet"
+#define LOG_INITIAL_SIZE 4096
+#define LOG_BUFFER_SIZE (64 * 1024)
+#define LOG_READ_MAX (64 * 1024)
+#define LOG_FLUSH_MS 5000
+#define RELOAD_DELAY_MS 100
+#define TRACE_MAX_BYTES (1024 * 1024)
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_SERVICES CGROUP_ROOT "/icenet"
+#define CGROUP2_MAGIC 0x63677270
+#define MAX_CGROUP_SETTINGS 8
 
 typedef enum {
     SERVICE_STOPPED,
     SERVICE_STARTING,
     SERVICE_RUNNING,
+    SERVICE_EXITED,
     SERVICE_FAILED
 } service_state_t;
 
+/* When a service counts as up for its dependents */
+typedef enum {
+    READY_STARTED,      /* As soon as it has been forked (default) */
+    READY_NOTIFY,       /* When it writes READY=1 to $NOTIFY_FD */
+    READY_EXIT          /* When it exits with status 0 (oneshot) */
+} ready_mode_t;
+
+/* Where a service's stdout and stderr go */
+typedef enum {
+    LOG_MEMORY,         /* Ring buffer in init, read with icenet-initctl log (default) */
+    LOG_FILE,           /* Ring buffer, also appended to LOG_DIR/<name>.log in batches */
+    LOG_CONSOLE         /* init's console, written synchronously by the service */
+} log_mode_t;
+
+/*
+ * Every file descriptor registered with the event loop is wrapped in a
+ * watch. The epoll user data points at the watch, so dispatch is a single
+ * indirect call with no lookup. A watch closed or unpolled while a batch
+ * is being dispatched is marked with the batch number, so events already
+ * fetched for it are dropped instead of reaching its handler.
+ */
+typedef struct watch watch_t;
+typedef void (*watch_fn)(watch_t *w, uint32_t events);
+
+struct watch {
+    int fd;
+    watch_fn fn;
+    void *data;
+    uint32_t retired;           /* Batch in which it was closed or unpolled */
+};
+
+/* A cgroup interface file written when the service's cgroup is created */
+typedef struct {
+    char key[32];               /* e.g. memory.max */
+    char value[64];
+} cgroup_setting_t;
+
+/* Resource usage read back from a service's cgroup */
+typedef struct {
+    uint64_t cpu_usec;
+    uint64_t memory_peak;
+    double cpu_pressure;        /* PSI "some" avg10, percent */
+    double memory_pressure;
+    double io_pressure;
+} cgroup_stats_t;
+
+/* A listening socket created by init on behalf of a service */
+typedef struct {
+    char spec[128];             /* tcp:[addr:]port, udp:[addr:]port, unix:path */
+    watch_t watch;              /* fd, polled only while the service is idle */
+    int polled;
+} listen_t;
+
+/*
+ * Boot trace
+ *
+ * A flat binary log of timestamped events, written to TRACE_PATH and read
+ * back by --analyze. Each record may be followed by `length` bytes of
+ * text (service or phase name), padded to 8 bytes.
+ */
+enum {
+    TRACE_PHASE_BEGIN = 1,      /* text: phase name */
+    TRACE_PHASE_END,            /* text: phase name */
+    TRACE_SERVICE,              /* text: service name */
+    TRACE_DEPENDS,              /* arg: index of the dependency */
+    TRACE_FORK,
+    TRACE_EXEC,                 /* Written by the child just before exec */
+    TRACE_READY,
+    TRACE_EXIT                  /* arg: wait status */
+};
+
+#define TRACE_MAGIC "ICETRACE"
+#define TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} trace_header_t;
+
+typedef struct {
+    uint64_t time_ns;           /* CLOCK_MONOTONIC, i.e. since boot */
+    uint16_t type;
+    uint16_t service;           /* Index into services[], 0xffff if none */
+    uint16_t length;
+    uint16_t reserved;
+    int32_t arg;
+    int32_t pid;
+} trace_record_t;
+
+/*
+ * Compiled service database
+ *
+ * Produced by --compile and mapped read-only at boot. All offsets are
+ * relative to the start of the file. The word pool holds argv string
+ * offsets, dependency and dependent indices, and (key, value) string
+ * offset pairs for every other service key, which are replayed through
+ * the normal key parser.
+ */
+#define SVCDB_MAGIC "ICESVCDB"
+#define SVCDB_VERSION 2
+
+/* What a stat pass over the source directory sees; any difference means stale */
+typedef struct {
+    int64_t dir_mtime_sec;      /* mtime of the directory itself */
+    int64_t dir_mtime_nsec;
+    int64_t file_mtime_sec;     /* Newest mtime of any service file */
+    int64_t file_mtime_nsec;
+    uint64_t total_size;        /* Sum of the service file sizes */
+    uint32_t file_count;
+    uint32_t reserved;
+} svcdb_stamp_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t service_count;
+    svcdb_stamp_t stamp;
+    uint32_t records;           /* svcdb_record_t[service_count] */
+    uint32_t words;             /* uint32_t[word_count] */
+    uint32_t word_count;
+    uint32_t strings;           /* NUL terminated strings */
+    uint32_t strings_size;
+    uint32_t file_size;
+} svcdb_header_t;
+
+typedef struct {
+    uint32_t name;              /* String offsets */
+    uint32_t exec;
+    uint32_t argv;              /* Word pool indices */
+    uint32_t deps;
+    uint32_t dependents;
+    uint32_t keys;
+    uint16_t argc;
+    uint16_t dep_count;
+    uint16_t dependent_count;
+    uint16_t key_count;
+} svcdb_record_t;
+
+/*
+ * Re-exec state
+ *
+ * Written to a memfd by the running init and read back by the new binary
+ * started with --deserialize. Service definitions are not included; the
+ * new binary loads them itself and this runtime state is matched to them
+ * by name. The file descriptors listed stay open across exec. Any change
+ * to these structures must bump STATE_VERSION, and a binary given state
+ * of another version keeps its services running but unsupervised.
+ */
+#define STATE_MAGIC "ICESTATE"
+#define STATE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t service_count;     /* state_service_t records follow */
+    int32_t control_fd;         /* -1 if none */
+    int32_t uevent_fd;
+} state_header_t;
+
+typedef struct {
+    char name[64];
+    int32_t pid;
+    int32_t pidfd;
+    int32_t notify_fd;
+    int32_t log_fd;
+    int32_t listen_count;
+    int32_t listen_fds[MAX_LISTEN];
+    char listen_specs[MAX_LISTEN][128];
+    int32_t state;
+    int32_t released;
+    int32_t activated;
+    int32_t killed;
+    int32_t stop_requested;
+    int32_t restart_requested;
+    int32_t had_cgroup;
+    int32_t respawn_count;
+    int32_t backoff_level;
+    int32_t failure_next;
+    int32_t log_midline;
+    int64_t respawn_ms;         /* Time left on the respawn timer, 0 if disarmed */
+    int64_t stop_ms;            /* Time left on the stop timer, 0 if disarmed */
+    uint64_t started_ms;
+    uint64_t failures[MAX_RESPAWN_LIMIT];
+    uint64_t log_written;
+    uint64_t log_flushed;
+    uint32_t log_length;        /* Bytes of output following this record */
+    uint32_t padding;
+} state_service_t;
+
 typedef struct {
+    int index;                  /* Position in services[] */
     char name[64];
     char exec[256];
-    char *args[32];
+    char argbuf[256];           /* exec split in place when parsed from text */
+    char *args[MAX_ARGS];       /* Pre-split argv, NULL terminated */
+    char env[MAX_ENV][128];     /* NAME=value pairs added to the environment */
+    int env_count;
+    char workdir[128];
+    char mount_reqs[MAX_MOUNT_REQS][128];   /* requires-mount= paths */
+    int mount_req_count;
+    char device_reqs[MAX_DEVICE_REQS][64];  /* requires-device= nodes */
+    int device_req_count;
+    int pending_waits;          /* Mounts and devices not yet there, part of pending_deps */
     char deps[MAX_DEPS][64];
     int dep_count;
+    int dep_idx[MAX_DEPS];      /* Resolved deps, -1 if not found */
+    int first_dependent;        /* Slice of dependent_edges[] */
+    int dependent_count;
+    int pending_deps;           /* Dependencies not yet up (in-degree) */
+    int released;               /* Dependents already released */
+    int priority;               /* Higher starts first when start slots are scarce */
+    int queued;                 /* In ready_queue */
+    uint32_t ready_seq;         /* Queueing order, for ties */
+    int admitted;               /* Holds a start slot */
     pid_t pid;
+    int pidfd;                  /* Refers to pid, -1 if unavailable */
     service_state_t state;
     int respawn;
-    int respawn_count;
+    int respawn_count;          /* Total restarts, for status */
+    long respawn_delay;         /* Backoff base, ms */
+    long respawn_max_delay;     /* Backoff cap, ms */
+    int respawn_jitter;         /* +/- percent applied to each delay */
+    int respawn_limit;          /* Failures allowed per window */
+    int respawn_window;         /* Seconds; also the stable-run threshold */
+    int backoff_level;          /* Consecutive quick failures */
+    uint64_t started_ms;
+    uint64_t failures[MAX_RESPAWN_LIMIT];   /* Ring of recent failure times */
+    int failure_next;
+    ready_mode_t ready;
+    watch_t respawn_timer;
+    watch_t notify_watch;
+    listen_t listens[MAX_LISTEN];
+    int listen_count;
+    int lazy;                   /* Start on first connection only */
+    int activated;              /* A connection arrived for a lazy service */
+    long stop_timeout;          /* SIGTERM to SIGKILL, ms */
+    int running_dependents;     /* Shutdown: dependents still to exit */
+    int stop_done;              /* Shutdown: exited or given up on */
+    int killed;                 /* SIGKILL already sent */
+    int stop_requested;         /* Stopped by an operator; do not respawn */
+    int restart_requested;      /* Start again once it has exited */
+    watch_t stop_timer;         /* Escalates to SIGKILL */
+    int cgroup_fd;              /* Directory of the service's cgroup, -1 if none */
+    cgroup_setting_t cgroup_settings[MAX_CGROUP_SETTINGS];
+    int cgroup_setting_count;
+    log_mode_t log_mode;
+    watch_t log_watch;          /* Read end of the stdout/stderr pipe */
+    char *log_buf;              /* Ring of timestamped lines, allocated on first output */
+    size_t log_size;            /* Grows up to LOG_BUFFER_SIZE, then wraps */
+    uint64_t log_written;       /* Bytes ever stored; the ring position is this % log_size */
+    uint64_t log_flushed;       /* Bytes already appended to the log file */
+    int log_midline;            /* The last output did not end with a newline */
+    int removed;                /* Its file is gone; the slot stays so indices remain valid */
+    int reloading;              /* Stopped by a reload; start again once its deps are up */
+    int reload_mark;            /* Reload: changed, or depends on something that did */
 } service_t;
 
-static service_t services[MAX_SERVICES];
+typedef enum {
+    MOUNT_PENDING,
+    MOUNT_RUNNING,
+    MOUNT_DONE,
+    MOUNT_FAILED
+} mount_state_t;
+
+/* An /etc/fstab entry, mounted by a forked worker */
+typedef struct {
+    char spec[128];
+    char dir[128];
+    char type[32];
+    char data[128];             /* Options the filesystem interprets itself */
+    unsigned long flags;        /* MS_* options */
+    int passno;
+    int parent;                 /* Entry this one is mounted inside, -1 if none */
+    pid_t pid;                  /* Worker, 0 if none */
+    mount_state_t state;
+    int *waiters;               /* Services waiting for it (requires-mount) */
+    int waiter_count;
+} mount_entry_t;
+
+static mount_entry_t mounts[MAX_MOUNTS];
+static int mount_count = 0;
+static int mounts_settled = 0;
+
+/* Services are allocated in chunks and never move; services[] maps index to service */
+static service_t **services = NULL;
 static int service_count = 0;
-static volatile sig_atomic_t shutdown_requested = 0;
+static int service_capacity = 0;
+
+/* Open-addressing indexes by name and by PID; slots hold index + 1, 0 if empty */
+static uint32_t *name_index = NULL;
+static uint32_t *pid_index = NULL;
+static uint32_t index_mask = 0;
+
+/* Reverse dependency edges, grouped per service (CSR layout) */
+static int *dependent_edges = NULL;
+static int edge_capacity = 0;
+
+/* Services whose dependencies are all up, waiting to be launched; a binary heap */
+static int *ready_queue = NULL;
+static int ready_count = 0;
+static uint32_t ready_seq = 0;
+
+/* Start slots: services launched from the queue that are not up yet */
+static int admit_running = 0;
+static int admit_budget = 0;            /* Slots available, 0 until first used */
+static int admit_limit = 0;
+static int admit_psi = 0;               /* /proc/pressure can be read */
+static uint64_t admit_sampled_ms = 0;
+static uint64_t admit_stall_us[2];      /* CPU and I/O "some" totals at that time */
+static watch_t admit_timer = { .fd = -1 };
+static int admit_timer_armed = 0;
+
+/* What to do once services have stopped */
+typedef enum {
+    SHUTDOWN_POWEROFF,
+    SHUTDOWN_REBOOT,
+    SHUTDOWN_KEXEC      /* Boot the kernel loaded by kexec_load_kernel() */
+} shutdown_action_t;
+
+static int shutdown_requested = 0;
+static shutdown_action_t shutdown_action = SHUTDOWN_POWEROFF;
+static int reexec_requested = 0;
+
+/*
+ * --test: run as PID 1 of a PID and mount namespace, e.g. under the bench
+ * harness.  Only services are supervised; fstab, devices, cgroups,
+ * readahead, unmounting and the final reboot are left to the host.
+ */
+static int test_mode = 0;
+static const char *service_dir = SERVICE_DIR;
+
+/* Shutdown in progress, and how many services have yet to exit */
+static int stopping = 0;
+static int services_stopping = 0;
+
+/* Mapped service database, if boot used one */
+static const char *svcdb = NULL;
+static size_t svcdb_size = 0;
+
+static uint64_t jitter_state = 0;
+
+/* Parent of all service cgroups, -1 without cgroup v2 */
+static int cgroup_services_fd = -1;
+
+static int trace_fd = -1;
+static size_t trace_bytes = 0;
+
+/* Records emitted before /run is mounted */
+static char trace_early[4096];
+static size_t trace_early_len = 0;
+
+static int epoll_fd = -1;
+static watch_t signal_watch = { .fd = -1 };
+static watch_t control_watch = { .fd = -1 };
+static watch_t log_flush_timer = { .fd = -1 };
+static int log_flush_armed = 0;
+
+/* Service files changed since the last reload, applied once the directory is quiet */
+static watch_t service_dir_watch = { .fd = -1 };
+static watch_t reload_timer = { .fd = -1 };
+static char (*reload_names)[64] = NULL;
+static int reload_name_count = 0;
+static int reload_name_capacity = 0;
+static int reload_rescan = 0;           /* Events were lost; compare every file */
+static sigset_t init_sigmask;
 
 /* Forward declarations */
+static int shutdown_system(void);
+static int kexec_load_kernel(const char *release, char *err, size_t errlen);
+static void kill_remaining(void);
+static void unmount_all(void);
 static void setup_signals(void);
+static void setup_event_loop(void);
+static void run_event_loop(void);
+static int dispatch_events(void);
+static int watch_add(watch_t *w, int fd, uint32_t events, watch_fn fn, void *data);
+static void watch_retire(watch_t *w);
+static void watch_close(watch_t *w);
+static void watch_flush_closed(void);
+static int timer_arm(watch_t *w, long ms, watch_fn fn, void *data);
+static void timer_disarm(watch_t *w);
+static void handle_signals(watch_t *w, uint32_t events);
+static void reap_children(void);
+static void service_exited(service_t *svc, int status);
+static void shutdown_service_done(service_t *svc);
+static void respawn_timer_fired(watch_t *w, uint32_t events);
+static void schedule_respawn(service_t *svc);
+static void handle_log(watch_t *w, uint32_t events);
+static void log_flush_all(void);
 static void mount_filesystems(void);
+static void load_fstab(void);
+static void resolve_mount_requirements(int first);
+static void resolve_service_mounts(service_t *svc);
+static void drop_service_waits(service_t *svc);
+static void start_mounts(void);
+static int mount_worker_exited(pid_t pid, int status);
+static void setup_uevents(void);
+static void readahead_start(void);
+static void resolve_device_requirements(int first);
+static void resolve_service_devices(service_t *svc);
+static void start_coldplug(void);
+static void coldplug_worker_exited(pid_t pid);
+static void mount_settled(mount_entry_t *m, int ok);
 static void load_services(void);
+static int load_service_dir(const char *dir_path);
+static int load_service_db(const char *path, const char *dir_path);
+static int compile_service_db(const char *dir_path, const char *out_path);
 static void start_service(service_t *svc);
 static void stop_all_services(void);
-static void signal_handler(int sig);
-static int check_dependencies(service_t *svc);
+static int find_service(const char *name);
+static int edges_reserve(int n);
+static uint32_t hash_name(const char *name);
+static void name_index_insert(service_t *svc);
+static void pid_index_insert(service_t *svc);
+static service_t *pid_index_take(pid_t pid);
+static void build_dependency_graph(void);
+static void detect_dependency_cycles(void);
+static void queue_ready(service_t *svc);
+static void start_ready_services(void);
+static void admit_release(service_t *svc);
+static void service_up(service_t *svc);
+static void service_failed(service_t *svc);
+static void handle_notify(watch_t *w, uint32_t events);
+static void release_dependents(service_t *svc);
+static void open_listen_sockets(void);
+static void open_listen_sockets_from(int first);
+static void poll_listen_sockets(service_t *svc, int enable);
+static void handle_activation(watch_t *w, uint32_t events);
+static void pass_listen_sockets(service_t *svc, int notify_fd);
+static void setup_cgroups(void);
+static int service_cgroup_open(service_t *svc);
+static void service_kill(service_t *svc, int sig);
+static int cgroup_read_stats(service_t *svc, cgroup_stats_t *st);
+static void setup_control_socket(void);
+static void trace_open(void);
+static void trace_event(int type, int service, pid_t pid, int32_t arg, const char *text);
+static void trace_services(int first);
+static int analyze_trace(const char *path);
+static const char *reexec_blocker(void);
+static void reexec(void);
+static int restore_state(int fd);
+static void setup_service_watch(void);
 
 /**
  * Main init process
  */
 int main(int argc, char *argv[]) {
-    printf("IceNet-Init v%s starting...\n", VERSION);
+    /* The console may be a serial line or pipe; keep messages ordered */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (argc > 1 && strcmp(argv[1], "--analyze") == 0)
+        return analyze_trace(argc > 2 ? argv[2] : TRACE_PATH);
+
+    if (argc > 1 && strcmp(argv[1], "--compile") == 0) {
+        return compile_service_db(argc > 2 ? argv[2] : SERVICE_DIR,
+                                  argc > 3 ? argv[3] : SERVICE_DB);
+    }
+
+    /* Started by a running init's reexec, with its state in this fd */
+    int state_fd = -1;
+    if (argc > 2 && strcmp(argv[1], "--deserialize") == 0)
+        state_fd = atoi(argv[2]);
+
+    if (argc > 2 && strcmp(argv[1], "--test") == 0) {
+        test_mode = 1;
+        service_dir = argv[2];
+    }
+
+    printf("IceNet-Init v%s %s...\n", VERSION, state_fd >= 0 ? "re-executing" : "starting");
 
     /* We must be PID 1 */
     if (getpid() != 1) {
@@ -75,304 +599,5727 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    /* Setup signal handlers */
+    /* Route signals through the event loop */
     setup_signals();
+    setup_event_loop();
+
+    if (state_fd >= 0) {
+        /* Filesystems are mounted and services running; pick up where the old binary was */
+        if (restore_state(state_fd) < 0)
+            setup_control_socket();
+        setup_service_watch();
+        printf("IceNet-Init: Supervising %d services\n", service_count);
+        run_event_loop();
+        return shutdown_system();
+    }
 
     /* Mount essential filesystems */
+    trace_event(TRACE_PHASE_BEGIN, -1, 0, 0, "mount_filesystems");
     mount_filesystems();
+    trace_event(TRACE_PHASE_END, -1, 0, 0, "mount_filesystems");
+    trace_open();
+
+    if (!test_mode) {
+        /* Prefetch last boot's working set, or record it for the next boot */
+        readahead_start();
+
+        /* fstab mounts run in the background; services wait only for those they require */
+        load_fstab();
+
+        /* Listen before coldplug so no device event is missed */
+        setup_uevents();
+    }
 
     /* Load service definitions */
+    trace_event(TRACE_PHASE_BEGIN, -1, 0, 0, "load_services");
     load_services();
+    resolve_mount_requirements(0);
+    resolve_device_requirements(0);
+    trace_event(TRACE_PHASE_END, -1, 0, 0, "load_services");
 
-    /* Start services in order */
-    printf("Starting services...\n");
-    int started = 0;
-    do {
-        started = 0;
-        for (int i = 0; i < service_count; i++) {
-            if (services[i].state == SERVICE_STOPPED) {
-                if (check_dependencies(&services[i])) {
-                    start_service(&services[i]);
-                    started++;
-                }
-            }
-        }
-    } while (started > 0);
+    /* Start every service with no dependencies pending */
+    detect_dependency_cycles();
+    trace_services(0);
 
-    /* Main loop - monitor services */
-    printf("IceNet-Init: System initialization complete\n");
+    printf("Starting services...\n");
 
-    while (!shutdown_requested) {
-        int status;
-        pid_t pid = waitpid(-1, &status, WNOHANG);
-
-        if (pid > 0) {
-            /* A process exited, check if it was a service */
-            for (int i = 0; i < service_count; i++) {
-                if (services[i].pid == pid) {
-                    printf("Service %s (PID %d) exited with status %d\n",
-                           services[i].name, pid, WEXITSTATUS(status));
-
-                    services[i].state = SERVICE_STOPPED;
-                    services[i].pid = 0;
-
-                    /* Respawn if configured */
-                    if (services[i].respawn && services[i].respawn_count < 5) {
-                        printf("Respawning service %s...\n", services[i].name);
-                        services[i].respawn_count++;
-                        sleep(1);
-                        start_service(&services[i]);
-                    } else if (services[i].respawn_count >= 5) {
-                        printf("Service %s failed too many times, not respawning\n",
-                               services[i].name);
-                        services[i].state = SERVICE_FAILED;
-                    }
-                    break;
-                }
-            }
-        }
+    /* Bind sockets up front so their consumers need not wait for them */
+    open_listen_sockets();
+    start_mounts();
+    start_coldplug();
 
-        sleep(1);
+    for (int i = 0; i < service_count; i++) {
+        if (services[i]->state == SERVICE_STOPPED && services[i]->pending_deps == 0)
+            queue_ready(services[i]);
     }
+    start_ready_services();
 
-    /* Shutdown sequence */
+    /* Main loop - supervise services until shutdown is requested */
+    setup_control_socket();
+    setup_service_watch();
+    printf("IceNet-Init: System initialization complete\n");
+    run_event_loop();
+
+    return shutdown_system();
+}
+
+/**
+ * Stop everything, then power off, reboot or kexec as requested
+ */
+static int shutdown_system(void) {
     printf("\nIceNet-Init: Shutting down...\n");
     stop_all_services();
+    log_flush_all();
+    kill_remaining();
+
+    /* Files init itself holds would keep /run and the cgroup tree busy */
+    watch_close(&control_watch);
+    unlink(CONTROL_PATH);
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    for (int i = 0; i < service_count; i++) {
+        if (services[i]->cgroup_fd >= 0) {
+            close(services[i]->cgroup_fd);
+            services[i]->cgroup_fd = -1;
+        }
+    }
+    if (cgroup_services_fd >= 0) {
+        close(cgroup_services_fd);
+        cgroup_services_fd = -1;
+    }
+
+    /* The mounts are the host's; leaving PID 1 tears down the namespace */
+    if (test_mode) {
+        printf("IceNet-Init: Test run finished\n");
+        return 0;
+    }
 
     /* Unmount filesystems */
     sync();
-    umount("/proc");
-    umount("/sys");
-    umount("/dev");
+    unmount_all();
+    sync();
 
-    /* Reboot or halt */
-    reboot(RB_POWER_OFF);
+    if (shutdown_action == SHUTDOWN_KEXEC) {
+        printf("IceNet-Init: Booting the loaded kernel\n");
+        reboot(RB_KEXEC);
+        perror("kexec failed, rebooting");
+    }
+    if (shutdown_action == SHUTDOWN_POWEROFF) {
+        printf("IceNet-Init: Powering off\n");
+        reboot(RB_POWER_OFF);
+    } else {
+        printf("IceNet-Init: Rebooting\n");
+        reboot(RB_AUTOBOOT);
+    }
 
     return 0;
 }
 
 /**
- * Setup signal handlers
+ * Block the signals init handles so they are delivered via signalfd
  */
 static void setup_signals(void) {
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_handler;
-    sigaction(SIGTERM, &sa, NULL);
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGCHLD, &sa, NULL);
+    sigemptyset(&init_sigmask);
+    sigaddset(&init_sigmask, SIGCHLD);
+    sigaddset(&init_sigmask, SIGTERM);
+    sigaddset(&init_sigmask, SIGINT);
+
+    if (sigprocmask(SIG_BLOCK, &init_sigmask, NULL) < 0) {
+        perror("sigprocmask");
+    }
 }
 
 /**
- * Signal handler
+ * Create the epoll instance and register the signalfd
  */
-static void signal_handler(int sig) {
-    switch (sig) {
-        case SIGTERM:
-        case SIGINT:
-            shutdown_requested = 1;
-            break;
-        case SIGCHLD:
-            /* Handled in main loop */
-            break;
+static void setup_event_loop(void) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return;
+    }
+
+    int fd = signalfd(-1, &init_sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        perror("signalfd");
+        return;
     }
+
+    watch_add(&signal_watch, fd, EPOLLIN, handle_signals, NULL);
 }
 
 /**
- * Mount essential filesystems
+ * Dispatch events until shutdown is requested
+ *
+ * epoll_wait() blocks with no timeout: when no service exits and no timer
+ * is pending, init does not wake up at all.
  */
-static void mount_filesystems(void) {
-    printf("Mounting filesystems...\n");
+static void run_event_loop(void) {
+    /* Children may have exited before the signalfd was polled */
+    reap_children();
 
-    /* Create mount points if they don't exist */
-    mkdir("/proc", 0755);
-    mkdir("/sys", 0755);
-    mkdir("/dev", 0755);
-    mkdir("/run", 0755);
-    mkdir("/tmp", 0755);
+    while (!shutdown_requested) {
+        if (dispatch_events() < 0)
+            break;
 
-    /* Mount virtual filesystems */
-    if (mount("proc", "/proc", "proc", MS_NOSUID | MS_NOEXEC | MS_NODEV, NULL) < 0) {
-        perror("Failed to mount /proc");
+        /* Only returns if the new binary could not be executed */
+        if (reexec_requested) {
+            reexec_requested = 0;
+            reexec();
+        }
     }
+}
 
-    if (mount("sysfs", "/sys", "sysfs", MS_NOSUID | MS_NOEXEC | MS_NODEV, NULL) < 0) {
-        perror("Failed to mount /sys");
-    }
+/* Number of the batch being dispatched, 0 outside dispatch_events() */
+static uint32_t dispatch_batch = 0;
+static uint32_t batch_count = 0;
 
-    if (mount("devtmpfs", "/dev", "devtmpfs", MS_NOSUID, "mode=0755") < 0) {
-        perror("Failed to mount /dev");
-    }
+/* Descriptors closed during the batch, closed for real once it is done */
+static int closed_fds[MAX_EVENTS];
+static int closed_count = 0;
 
-    if (mount("tmpfs", "/run", "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755") < 0) {
-        perror("Failed to mount /run");
+/**
+ * Wait for and dispatch one batch of events
+ *
+ * Returns -1 if the event loop itself failed.
+ */
+static int dispatch_events(void) {
+    struct epoll_event events[MAX_EVENTS];
+
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        perror("epoll_wait");
+        return -1;
     }
 
-    if (mount("tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV, "mode=1777") < 0) {
-        perror("Failed to mount /tmp");
+    if (++batch_count == 0)
+        batch_count = 1;
+    dispatch_batch = batch_count;
+
+    for (int i = 0; i < n; i++) {
+        watch_t *w = events[i].data.ptr;
+        if (w->fd < 0 || w->retired == dispatch_batch)
+            continue;
+        w->fn(w, events[i].events);
     }
 
-    printf("Filesystems mounted\n");
+    dispatch_batch = 0;
+    watch_flush_closed();
+    return 0;
 }
 
 /**
- * Load service definitions from /etc/icenet/services
+ * Register a file descriptor with the event loop
  */
-static void load_services(void) {
-    printf("Loading services from %s...\n", SERVICE_DIR);
+static int watch_add(watch_t *w, int fd, uint32_t events, watch_fn fn, void *data) {
+    w->fd = fd;
+    w->fn = fn;
+    w->data = data;
 
-    DIR *dir = opendir(SERVICE_DIR);
-    if (!dir) {
-        fprintf(stderr, "Warning: Could not open service directory: %s\n", SERVICE_DIR);
-        return;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = w;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
     }
+    return 0;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL && service_count < MAX_SERVICES) {
-        if (entry->d_name[0] == '.')
-            continue;
+/**
+ * Drop any event for the watch still pending in the current batch
+ */
+static void watch_retire(watch_t *w) {
+    w->retired = dispatch_batch;
+}
 
-        char path[512];
-        snprintf(path, sizeof(path), "%s/%s", SERVICE_DIR, entry->d_name);
+/**
+ * Unregister and close a watched file descriptor
+ *
+ * During a batch the descriptor stays open until the batch is done, so
+ * its number cannot be handed out again while events for it are pending.
+ */
+static void watch_close(watch_t *w) {
+    if (w->fd < 0)
+        return;
 
-        FILE *f = fopen(path, "r");
-        if (!f)
-            continue;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+    watch_retire(w);
+    if (dispatch_batch && closed_count < MAX_EVENTS)
+        closed_fds[closed_count++] = w->fd;
+    else
+        close(w->fd);
+    w->fd = -1;
+}
 
-        service_t *svc = &services[service_count];
-        memset(svc, 0, sizeof(service_t));
-        strncpy(svc->name, entry->d_name, sizeof(svc->name) - 1);
-        svc->state = SERVICE_STOPPED;
+/**
+ * Close the descriptors whose watches were closed during the batch
+ *
+ * Also called before binding listening sockets again, which would
+ * otherwise collide with the old ones.
+ */
+static void watch_flush_closed(void) {
+    for (int i = 0; i < closed_count; i++)
+        close(closed_fds[i]);
+    closed_count = 0;
+}
 
-        char line[512];
-        while (fgets(line, sizeof(line), f)) {
-            /* Remove newline */
-            line[strcspn(line, "\n")] = 0;
+/**
+ * Arm a one-shot timer, creating its timerfd on first use
+ */
+static int timer_arm(watch_t *w, long ms, watch_fn fn, void *data) {
+    if (w->fd < 0) {
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) {
+            perror("timerfd_create");
+            return -1;
+        }
+        if (watch_add(w, fd, EPOLLIN, fn, data) < 0) {
+            close(fd);
+            w->fd = -1;
+            return -1;
+        }
+    }
 
-            /* Skip comments and empty lines */
-            if (line[0] == '#' || line[0] == '\0')
-                continue;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
 
-            /* Parse key=value */
-            char *eq = strchr(line, '=');
-            if (!eq)
-                continue;
+    return timerfd_settime(w->fd, 0, &its, NULL);
+}
 
-            *eq = '\0';
-            char *key = line;
-            char *value = eq + 1;
+/**
+ * Cancel a pending timer
+ */
+static void timer_disarm(watch_t *w) {
+    struct itimerspec its;
 
-            if (strcmp(key, "exec") == 0) {
-                strncpy(svc->exec, value, sizeof(svc->exec) - 1);
-            } else if (strcmp(key, "depends") == 0) {
-                strncpy(svc->deps[svc->dep_count], value,
-                        sizeof(svc->deps[0]) - 1);
-                svc->dep_count++;
-            } else if (strcmp(key, "respawn") == 0) {
-                svc->respawn = (strcmp(value, "yes") == 0);
-            }
-        }
+    if (w->fd < 0)
+        return;
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(w->fd, 0, &its, NULL);
+}
 
-        fclose(f);
+/**
+ * Drain the signalfd
+ */
+static void handle_signals(watch_t *w, uint32_t events) {
+    (void)events;
 
-        if (svc->exec[0] != '\0') {
-            printf("  Loaded service: %s\n", svc->name);
-            service_count++;
+    struct signalfd_siginfo si;
+    int child_exited = 0;
+
+    while (read(w->fd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+            case SIGTERM:
+            case SIGINT:
+                shutdown_requested = 1;
+                break;
+            case SIGCHLD:
+                child_exited = 1;
+                break;
         }
     }
 
-    closedir(dir);
-    printf("Loaded %d services\n", service_count);
+    /* SIGCHLD coalesces, so one notification may cover many children */
+    if (child_exited)
+        reap_children();
 }
 
 /**
- * Check if all dependencies for a service are running
+ * Reap every exited child in one batch
  */
-static int check_dependencies(service_t *svc) {
-    for (int i = 0; i < svc->dep_count; i++) {
-        int found = 0;
-        for (int j = 0; j < service_count; j++) {
-            if (strcmp(services[j].name, svc->deps[i]) == 0) {
-                if (services[j].state != SERVICE_RUNNING) {
-                    return 0;
-                }
-                found = 1;
-                break;
-            }
-        }
-        if (!found) {
-            fprintf(stderr, "Warning: Dependency %s not found for service %s\n",
-                    svc->deps[i], svc->name);
-        }
+static void reap_children(void) {
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        service_t *svc = pid_index_take(pid);
+        if (svc)
+            service_exited(svc, status);
+        else if (!mount_worker_exited(pid, status))
+            coldplug_worker_exited(pid);
+        /* Anything else is an orphan re-parented to init */
     }
-    return 1;
 }
 
 /**
- * Start a service
+ * Handle the exit of a supervised service
  */
-static void start_service(service_t *svc) {
-    printf("Starting service: %s\n", svc->name);
+static void service_exited(service_t *svc, int status) {
+    trace_event(TRACE_EXIT, svc->index, svc->pid, status, NULL);
 
-    svc->state = SERVICE_STARTING;
+    if (WIFSIGNALED(status)) {
+        printf("Service %s (PID %d) killed by signal %d\n",
+               svc->name, svc->pid, WTERMSIG(status));
+    } else {
+        printf("Service %s (PID %d) exited with status %d\n",
+               svc->name, svc->pid, WEXITSTATUS(status));
+    }
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork");
-        svc->state = SERVICE_FAILED;
+    cgroup_stats_t st;
+    if (cgroup_read_stats(svc, &st) == 0) {
+        printf("  %s used %.3fs CPU, %.1f MiB peak memory\n", svc->name,
+               (double)st.cpu_usec / 1e6, (double)st.memory_peak / (1024.0 * 1024.0));
+    }
+
+    svc->pid = 0;
+    if (svc->pidfd >= 0) {
+        close(svc->pidfd);
+        svc->pidfd = -1;
+    }
+    admit_release(svc);
+    watch_close(&svc->notify_watch);
+    timer_disarm(&svc->stop_timer);
+
+    if (stopping) {
+        svc->state = SERVICE_STOPPED;
+        shutdown_service_done(svc);
         return;
     }
 
-    if (pid == 0) {
-        /* Child process - exec the service */
-        /* Parse exec string into args */
-        char *exec_copy = strdup(svc->exec);
-        int arg_count = 0;
-        char *token = strtok(exec_copy, " ");
-        while (token && arg_count < 31) {
-            svc->args[arg_count++] = token;
-            token = strtok(NULL, " ");
+    /* Stopped or restarted on request: no respawn accounting */
+    if (svc->stop_requested) {
+        svc->state = SERVICE_STOPPED;
+        if (svc->reloading) {
+            svc->reloading = 0;
+            svc->stop_requested = 0;
+            if (!shutdown_requested && svc->pending_deps == 0) {
+                queue_ready(svc);
+                start_ready_services();
+            }
+        } else if (svc->restart_requested && !shutdown_requested) {
+            svc->restart_requested = 0;
+            svc->stop_requested = 0;
+            start_service(svc);
+        }
+        return;
+    }
+
+    int succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    /* A oneshot is up once it has run to completion */
+    if (svc->ready == READY_EXIT) {
+        if (succeeded) {
+            service_up(svc);
+            svc->state = SERVICE_EXITED;
+        } else {
+            service_failed(svc);
         }
-        svc->args[arg_count] = NULL;
+        return;
+    }
+
+    svc->state = SERVICE_STOPPED;
 
-        /* Execute */
-        execvp(svc->args[0], svc->args);
+    if (shutdown_requested)
+        return;
 
-        /* If we get here, exec failed */
-        perror("execvp");
-        exit(1);
+    /* A lazy service is started again by the next connection */
+    if (svc->lazy) {
+        svc->activated = 0;
+        poll_listen_sockets(svc, 1);
+        return;
     }
 
-    /* Parent process */
-    svc->pid = pid;
-    svc->state = SERVICE_RUNNING;
+    /* Respawn if configured, without blocking the rest of the loop */
+    if (svc->respawn) {
+        schedule_respawn(svc);
+    } else if (!svc->released) {
+        /* Exited before signalling readiness: dependents can never start */
+        service_failed(svc);
+    }
 }
 
 /**
- * Stop all running services
+ * Read readiness notifications from a service
+ *
+ * Messages follow the sd_notify convention of newline separated
+ * assignments; only READY=1 is acted upon. The socket is closed once the
+ * service is up since nothing else is expected on it.
  */
-static void stop_all_services(void) {
-    printf("Stopping all services...\n");
+static void handle_notify(watch_t *w, uint32_t events) {
+    service_t *svc = w->data;
+    char buf[512];
+    ssize_t n;
+    int ready = 0;
 
-    /* Send SIGTERM to all services */
-    for (int i = 0; i < service_count; i++) {
-        if (services[i].state == SERVICE_RUNNING && services[i].pid > 0) {
-            printf("  Stopping %s (PID %d)\n", services[i].name, services[i].pid);
-            kill(services[i].pid, SIGTERM);
+    while ((n = recv(w->fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+        buf[n] = '\0';
+        for (char *line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+            if (strcmp(line, "READY=1") == 0)
+                ready = 1;
         }
     }
 
-    /* Wait a bit for graceful shutdown */
-    sleep(2);
-
-    /* Send SIGKILL to any remaining processes */
-    for (int i = 0; i < service_count; i++) {
-        if (services[i].state == SERVICE_RUNNING && services[i].pid > 0) {
-            printf("  Force killing %s (PID %d)\n", services[i].name, services[i].pid);
-            kill(services[i].pid, SIGKILL);
-        }
+    if (ready && svc->state == SERVICE_STARTING) {
+        printf("Service %s is ready\n", svc->name);
+        service_up(svc);
     }
 
-    /* Wait for all children */
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    if (ready || (events & (EPOLLHUP | EPOLLERR)))
+        watch_close(w);
+}
+
+/**
+ * Milliseconds on the monotonic clock
+ */
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * Cheap xorshift PRNG for respawn jitter
+ */
+static uint64_t next_random(void) {
+    if (jitter_state == 0)
+        jitter_state = ((uint64_t)getpid() << 32) ^ monotonic_ms() ^ 0x9e3779b97f4a7c15ULL;
+
+    jitter_state ^= jitter_state << 13;
+    jitter_state ^= jitter_state >> 7;
+    jitter_state ^= jitter_state << 17;
+    return jitter_state;
+}
+
+/**
+ * Arm a service's respawn timer with exponential backoff
+ *
+ * Each failure within the window doubles the delay up to the cap; a run
+ * longer than the window counts as stable and resets it. More than
+ * respawn-limit failures inside a sliding window is a crash storm, and
+ * the service is given up on.
+ */
+static void schedule_respawn(service_t *svc) {
+    uint64_t now = monotonic_ms();
+    uint64_t window = (uint64_t)svc->respawn_window * 1000;
+
+    if (now - svc->started_ms >= window)
+        svc->backoff_level = 0;
+
+    svc->failure_next %= svc->respawn_limit;
+    svc->failures[svc->failure_next] = now;
+    svc->failure_next = (svc->failure_next + 1) % svc->respawn_limit;
+
+    int recent = 0;
+    for (int i = 0; i < svc->respawn_limit; i++) {
+        if (svc->failures[i] && now - svc->failures[i] < window)
+            recent++;
+    }
+
+    if (recent >= svc->respawn_limit) {
+        printf("Service %s failed %d times in %ds, not respawning\n",
+               svc->name, recent, svc->respawn_window);
+        service_failed(svc);
+        return;
+    }
+
+    long delay = svc->respawn_delay;
+    for (int i = 0; i < svc->backoff_level && delay < svc->respawn_max_delay; i++)
+        delay *= 2;
+    if (delay > svc->respawn_max_delay)
+        delay = svc->respawn_max_delay;
+    svc->backoff_level++;
+
+    /* Spread restarts so services sharing a fault do not restart in lockstep */
+    long spread = delay * svc->respawn_jitter / 100;
+    if (spread > 0)
+        delay += (long)(next_random() % (uint64_t)(2 * spread + 1)) - spread;
+
+    printf("Respawning service %s in %ld ms...\n", svc->name, delay);
+    svc->respawn_count++;
+    if (timer_arm(&svc->respawn_timer, delay, respawn_timer_fired, svc) < 0)
+        start_service(svc);
+}
+
+/**
+ * Restart a service once its respawn delay has elapsed
+ */
+static void respawn_timer_fired(watch_t *w, uint32_t events) {
+    (void)events;
+
+    uint64_t expirations;
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    service_t *svc = w->data;
+    if (svc->state == SERVICE_STOPPED)
+        start_service(svc);
+}
+
+/*
+ * Service output
+ *
+ * Each service writes stdout and stderr into a pipe that init drains from
+ * the event loop, so a chatty service is never held up by the console.
+ * Output is kept per service in a ring of timestamped lines, readable
+ * with icenet-initctl log and, for log=file services, appended to disk in
+ * batches.
+ */
+
+/**
+ * Copy bytes into a service's ring, growing it until it reaches full size
+ *
+ * Until the ring wraps its content is linear, so growing it is a realloc.
+ */
+static void log_store(service_t *svc, const char *data, size_t len) {
+    if (svc->log_written + len > svc->log_size && svc->log_size < LOG_BUFFER_SIZE) {
+        size_t size = svc->log_size ? svc->log_size : LOG_INITIAL_SIZE;
+        while (size < svc->log_written + len && size < LOG_BUFFER_SIZE)
+            size *= 2;
+        if (size > LOG_BUFFER_SIZE)
+            size = LOG_BUFFER_SIZE;
+
+        char *buf = realloc(svc->log_buf, size);
+        if (!buf)
+            return;
+        svc->log_buf = buf;
+        svc->log_size = size;
+    }
+
+    /* Only the newest LOG_BUFFER_SIZE bytes can be kept */
+    if (len > svc->log_size) {
+        svc->log_written += len - svc->log_size;
+        data += len - svc->log_size;
+        len = svc->log_size;
+    }
+
+    size_t pos = svc->log_written % svc->log_size;
+    size_t first = len < svc->log_size - pos ? len : svc->log_size - pos;
+    memcpy(svc->log_buf + pos, data, first);
+    memcpy(svc->log_buf, data + first, len - first);
+    svc->log_written += len;
+}
+
+/**
+ * Oldest byte still held in a service's ring
+ */
+static uint64_t log_oldest(service_t *svc) {
+    return svc->log_written > svc->log_size ? svc->log_written - svc->log_size : 0;
+}
+
+/**
+ * Find the contiguous run of ring content starting at byte offset from
+ *
+ * Returns its length, 0 once from has caught up with the newest byte.
+ */
+static size_t log_chunk(service_t *svc, uint64_t from, const char **data) {
+    if (from >= svc->log_written)
+        return 0;
+
+    size_t pos = from % svc->log_size;
+    uint64_t len = svc->log_written - from;
+    *data = svc->log_buf + pos;
+    return len < svc->log_size - pos ? (size_t)len : svc->log_size - pos;
+}
+
+/**
+ * Add service output to its ring, stamping each line as it begins
+ */
+static void log_append(service_t *svc, const char *data, size_t len) {
+    while (len > 0) {
+        if (!svc->log_midline) {
+            char stamp[32];
+            uint64_t ms = monotonic_ms();
+            int n = snprintf(stamp, sizeof(stamp), "[%6llu.%03llu] ",
+                             (unsigned long long)(ms / 1000), (unsigned long long)(ms % 1000));
+            log_store(svc, stamp, (size_t)n);
+        }
+
+        const char *nl = memchr(data, '\n', len);
+        size_t line = nl ? (size_t)(nl - data) + 1 : len;
+        log_store(svc, data, line);
+        svc->log_midline = nl == NULL;
+        data += line;
+        len -= line;
+    }
+}
+
+/**
+ * Append the output a service produced since the last flush to its log file
+ *
+ * Output that the ring overwrote before it could be flushed is noted in
+ * the file. If the file cannot be opened, e.g. while / is still read-only,
+ * the output stays in memory for the next attempt.
+ */
+static void log_flush(service_t *svc) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.log", LOG_DIR, svc->name);
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+    if (fd < 0)
+        return;
+
+    uint64_t from = log_oldest(svc);
+    if (from > svc->log_flushed) {
+        dprintf(fd, "[%llu bytes of output lost]\n",
+                (unsigned long long)(from - svc->log_flushed));
+    } else {
+        from = svc->log_flushed;
+    }
+
+    const char *data;
+    size_t len;
+    while ((len = log_chunk(svc, from, &data)) > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0)
+            break;
+        from += (uint64_t)n;
+    }
+
+    svc->log_flushed = from;
+    close(fd);
+}
+
+/**
+ * Write out the output of every log=file service
+ *
+ * Output still in the pipes is drained first, so nothing a service wrote
+ * before exiting is lost at shutdown.
+ */
+static void log_flush_all(void) {
+    /* LOG_DIR may be on a filesystem that is not mounted yet */
+    if (mounts_settled < mount_count)
+        return;
+
+    mkdir(LOG_DIR, 0755);
+    for (int i = 0; i < service_count; i++) {
+        service_t *svc = services[i];
+        if (svc->log_mode != LOG_FILE)
+            continue;
+        if (svc->log_watch.fd >= 0)
+            handle_log(&svc->log_watch, 0);
+        if (svc->log_written > svc->log_flushed)
+            log_flush(svc);
+    }
+}
+
+/**
+ * Flush log files when the batching delay has elapsed
+ */
+static void log_flush_fired(watch_t *w, uint32_t events) {
+    (void)events;
+
+    uint64_t expirations;
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    log_flush_armed = 0;
+    log_flush_all();
+
+    /* Still waiting for the filesystem holding LOG_DIR */
+    if (mounts_settled < mount_count && timer_arm(w, LOG_FLUSH_MS, log_flush_fired, NULL) == 0)
+        log_flush_armed = 1;
+}
+
+/**
+ * Drain a service's output pipe into its ring
+ *
+ * At most LOG_READ_MAX bytes are taken per call so one service cannot
+ * starve the event loop; epoll reports the pipe again if more is left.
+ */
+static void handle_log(watch_t *w, uint32_t events) {
+    (void)events;
+
+    service_t *svc = w->data;
+    char buf[4096];
+    size_t total = 0;
+    ssize_t n = 1;
+
+    while (total < LOG_READ_MAX && (n = read(w->fd, buf, sizeof(buf))) > 0) {
+        log_append(svc, buf, (size_t)n);
+        total += (size_t)n;
+    }
+
+    /* Every writer is gone: the service and anything it forked */
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        if (svc->log_midline)
+            log_append(svc, "\n", 1);
+        watch_close(w);
+    }
+
+    if (total > 0 && svc->log_mode == LOG_FILE && !log_flush_armed &&
+        timer_arm(&log_flush_timer, LOG_FLUSH_MS, log_flush_fired, NULL) == 0)
+        log_flush_armed = 1;
+}
+
+/**
+ * Mount essential filesystems
+ */
+static void mount_filesystems(void) {
+    printf("Mounting filesystems...\n");
+
+    /* Create mount points if they don't exist */
+    mkdir("/proc", 0755);
+    mkdir("/sys", 0755);
+    mkdir("/dev", 0755);
+    mkdir("/run", 0755);
+    mkdir("/tmp", 0755);
+
+    /* A test namespace shares the host's devices and cgroups; see its own PIDs only */
+    if (test_mode) {
+        if (mount("proc", "/proc", "proc", MS_NOSUID | MS_NOEXEC | MS_NODEV, NULL) < 0)
+            perror("Failed to mount /proc");
+        if (mount("tmpfs", "/run", "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755") < 0)
+            perror("Failed to mount /run");
+        return;
+    }
+
+    /* Mount virtual filesystems */
+    if (mount("proc", "/proc", "proc", MS_NOSUID | MS_NOEXEC | MS_NODEV, NULL) < 0) {
+        perror("Failed to mount /proc");
+    }
+
+    if (mount("sysfs", "/sys", "sysfs", MS_NOSUID | MS_NOEXEC | MS_NODEV, NULL) < 0) {
+        perror("Failed to mount /sys");
+    }
+
+    if (mount("devtmpfs", "/dev", "devtmpfs", MS_NOSUID, "mode=0755") < 0) {
+        perror("Failed to mount /dev");
+    }
+
+    if (mount("tmpfs", "/run", "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755") < 0) {
+        perror("Failed to mount /run");
+    }
+
+    if (mount("tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV, "mode=1777") < 0) {
+        perror("Failed to mount /tmp");
+    }
+
+    setup_cgroups();
+
+    printf("Filesystems mounted\n");
+}
+
+/**
+ * Split fstab options into MS_* flags and filesystem data
+ *
+ * Returns 0 if the entry should not be mounted at boot.
+ */
+static int parse_mount_options(const char *options, mount_entry_t *m) {
+    static const struct {
+        const char *name;
+        unsigned long set;
+        unsigned long clear;
+    } flags[] = {
+        { "ro", MS_RDONLY, 0 },             { "rw", 0, MS_RDONLY },
+        { "nosuid", MS_NOSUID, 0 },         { "suid", 0, MS_NOSUID },
+        { "nodev", MS_NODEV, 0 },           { "dev", 0, MS_NODEV },
+        { "noexec", MS_NOEXEC, 0 },         { "exec", 0, MS_NOEXEC },
+        { "sync", MS_SYNCHRONOUS, 0 },      { "async", 0, MS_SYNCHRONOUS },
+        { "noatime", MS_NOATIME, 0 },       { "atime", 0, MS_NOATIME },
+        { "nodiratime", MS_NODIRATIME, 0 }, { "relatime", MS_RELATIME, 0 },
+        { "strictatime", MS_STRICTATIME, 0 }, { "bind", MS_BIND, 0 },
+        { "rbind", MS_BIND | MS_REC, 0 },   { "defaults", 0, 0 },
+        { "auto", 0, 0 },                   { "nouser", 0, 0 },
+        { "user", 0, 0 },                   { "users", 0, 0 },
+        { "nofail", 0, 0 },
+    };
+    char buf[256];
+    size_t len = 0;
+
+    snprintf(buf, sizeof(buf), "%s", options);
+    m->flags = 0;
+    m->data[0] = '\0';
+
+    for (char *opt = strtok(buf, ","); opt; opt = strtok(NULL, ",")) {
+        if (strcmp(opt, "noauto") == 0 || strcmp(opt, "_netdev") == 0)
+            return 0;
+
+        size_t i;
+        for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+            if (strcmp(opt, flags[i].name) == 0) {
+                m->flags = (m->flags | flags[i].set) & ~flags[i].clear;
+                break;
+            }
+        }
+
+        /* x-* options are for userspace tools only */
+        if (i < sizeof(flags) / sizeof(flags[0]) || strncmp(opt, "x-", 2) == 0)
+            continue;
+
+        int n = snprintf(m->data + len, sizeof(m->data) - len, "%s%s", len ? "," : "", opt);
+        if (n > 0 && (size_t)n < sizeof(m->data) - len)
+            len += n;
+    }
+    return 1;
+}
+
+/**
+ * Is path at or below dir, by whole path components?
+ */
+static int path_within(const char *path, const char *dir) {
+    size_t len = strlen(dir);
+
+    if (strcmp(dir, "/") == 0)
+        return path[0] == '/';
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/**
+ * Find the deepest fstab entry containing path, -1 if none
+ */
+static int find_mount(const char *path, int exclude) {
+    int best = -1;
+    size_t best_len = 0;
+
+    for (int i = 0; i < mount_count; i++) {
+        size_t len = strlen(mounts[i].dir);
+        if (i != exclude && path_within(path, mounts[i].dir) && (best < 0 || len > best_len)) {
+            best = i;
+            best_len = len;
+        }
+    }
+    return best;
+}
+
+/**
+ * Is dir already a mount point, e.g. mounted by the initramfs?
+ */
+static int is_mounted(const char *dir) {
+    FILE *f = fopen("/proc/self/mounts", "r");
+    char line[512];
+    int found = 0;
+
+    if (!f)
+        return 0;
+    while (!found && fgets(line, sizeof(line), f)) {
+        char target[256];
+        if (sscanf(line, "%*s %255s", target) == 1 && strcmp(target, dir) == 0)
+            found = 1;
+    }
+    fclose(f);
+    return found;
+}
+
+/**
+ * Read the boot-time entries of /etc/fstab
+ *
+ * swap, network filesystems and noauto entries are left out; filesystems
+ * that are already mounted count as done. Each entry records the entry it
+ * is mounted inside so that parents are always mounted first.
+ */
+static void load_fstab(void) {
+    FILE *f = fopen(FSTAB_PATH, "r");
+    char line[512];
+
+    if (!f)
+        return;
+
+    while (fgets(line, sizeof(line), f) && mount_count < MAX_MOUNTS) {
+        char spec[128], dir[128], type[32], options[256] = "defaults";
+        int freq = 0, passno = 0;
+
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+
+        if (sscanf(p, "%127s %127s %31s %255s %d %d", spec, dir, type, options,
+                   &freq, &passno) < 3)
+            continue;
+
+        if (strcmp(type, "swap") == 0 || dir[0] != '/' ||
+            strncmp(type, "nfs", 3) == 0 || strcmp(type, "cifs") == 0)
+            continue;
+
+        mount_entry_t *m = &mounts[mount_count];
+        memset(m, 0, sizeof(*m));
+        if (!parse_mount_options(options, m))
+            continue;
+
+        snprintf(m->spec, sizeof(m->spec), "%s", spec);
+        snprintf(m->dir, sizeof(m->dir), "%s", dir);
+        snprintf(m->type, sizeof(m->type), "%s", type);
+        m->passno = passno;
+        m->state = MOUNT_PENDING;
+
+        /* The root filesystem is always mounted; it may still need fsck and a remount */
+        if (strcmp(dir, "/") != 0 && is_mounted(dir))
+            m->state = MOUNT_DONE;
+        mount_count++;
+    }
+    fclose(f);
+
+    for (int i = 0; i < mount_count; i++) {
+        mounts[i].parent = find_mount(mounts[i].dir, i);
+        if (mounts[i].state == MOUNT_DONE)
+            mounts_settled++;
+    }
+}
+
+/**
+ * Make services wait for the filesystems named by requires-mount
+ *
+ * A path is served by the deepest fstab entry containing it; a path on
+ * no fstab entry lives on the root filesystem and needs no waiting.
+ */
+static void resolve_mount_requirements(int first) {
+    for (int i = first; i < service_count; i++)
+        resolve_service_mounts(services[i]);
+}
+
+static void resolve_service_mounts(service_t *svc) {
+    for (int r = 0; r < svc->mount_req_count; r++) {
+        int idx = find_mount(svc->mount_reqs[r], -1);
+        if (idx < 0 || mounts[idx].state == MOUNT_DONE)
+            continue;
+
+        mount_entry_t *m = &mounts[idx];
+        if (m->state == MOUNT_FAILED) {
+            if (svc->state == SERVICE_STOPPED) {
+                fprintf(stderr, "Warning: Service %s not started, mount %s failed\n",
+                        svc->name, m->dir);
+                service_failed(svc);
+            }
+            continue;
+        }
+
+        int *waiters = realloc(m->waiters, (m->waiter_count + 1) * sizeof(int));
+        if (!waiters)
+            continue;
+        m->waiters = waiters;
+        m->waiters[m->waiter_count++] = svc->index;
+        svc->pending_waits++;
+        svc->pending_deps++;
+    }
+}
+
+/* Device specs init has to wait for; anything else is a pseudo filesystem */
+static int spec_is_device(const char *spec) {
+    return spec[0] == '/' || strncmp(spec, "UUID=", 5) == 0 ||
+           strncmp(spec, "LABEL=", 6) == 0 || strncmp(spec, "PARTUUID=", 9) == 0;
+}
+
+/**
+ * Read the UUID and label of an ext2/3/4 or FAT filesystem
+ *
+ * UUIDs are formatted the way blkid prints them.
+ */
+static int probe_filesystem(const char *dev, char *uuid, size_t uuid_size,
+                            char *label, size_t label_size) {
+    uint8_t sb[2048];
+    int fd = open(dev, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    ssize_t n = pread(fd, sb, sizeof(sb), 0);
+    close(fd);
+    if (n != (ssize_t)sizeof(sb))
+        return -1;
+
+    const uint8_t *ext = sb + 1024;
+    if (ext[56] == 0x53 && ext[57] == 0xef) {
+        const uint8_t *u = ext + 104;
+        snprintf(uuid, uuid_size,
+                 "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                 u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+                 u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+        snprintf(label, label_size, "%.16s", (const char *)ext + 120);
+        return 0;
+    }
+
+    if (sb[510] == 0x55 && sb[511] == 0xaa &&
+        (memcmp(sb + 82, "FAT32", 5) == 0 || memcmp(sb + 54, "FAT", 3) == 0)) {
+        const uint8_t *id = memcmp(sb + 82, "FAT32", 5) == 0 ? sb + 67 : sb + 39;
+        snprintf(uuid, uuid_size, "%02X%02X-%02X%02X", id[3], id[2], id[1], id[0]);
+        snprintf(label, label_size, "%.11s", (const char *)id + 4);
+        for (char *end = label + strlen(label); end > label && end[-1] == ' '; )
+            *--end = '\0';
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Translate an fstab device spec to a device node
+ *
+ * udev's /dev/disk links are used when present; otherwise every block
+ * device is probed, since init may run without udev.
+ */
+static int resolve_device(const char *spec, char *dev, size_t size) {
+    static const struct {
+        const char *prefix;
+        const char *dir;
+    } links[] = {
+        { "UUID=", "/dev/disk/by-uuid/" },
+        { "LABEL=", "/dev/disk/by-label/" },
+        { "PARTUUID=", "/dev/disk/by-partuuid/" },
+    };
+
+    if (spec[0] == '/') {
+        snprintf(dev, size, "%s", spec);
+        return access(dev, F_OK);
+    }
+
+    for (size_t i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+        size_t len = strlen(links[i].prefix);
+        if (strncmp(spec, links[i].prefix, len) != 0)
+            continue;
+
+        snprintf(dev, size, "%s%s", links[i].dir, spec + len);
+        if (access(dev, F_OK) == 0)
+            return 0;
+        if (i == 2)
+            return -1;
+
+        DIR *dir = opendir("/sys/class/block");
+        struct dirent *entry;
+        if (!dir)
+            return -1;
+        while ((entry = readdir(dir)) != NULL) {
+            char uuid[40], label[20];
+            if (entry->d_name[0] == '.')
+                continue;
+            snprintf(dev, size, "/dev/%.200s", entry->d_name);
+            if (probe_filesystem(dev, uuid, sizeof(uuid), label, sizeof(label)) < 0)
+                continue;
+            if ((i == 0 && strcasecmp(uuid, spec + len) == 0) ||
+                (i == 1 && strcmp(label, spec + len) == 0)) {
+                closedir(dir);
+                return 0;
+            }
+        }
+        closedir(dir);
+        return -1;
+    }
+    return -1;
+}
+
+/**
+ * Decide from the superblock whether a filesystem needs checking
+ *
+ * An ext filesystem is checked when it has recorded errors, was not
+ * unmounted cleanly and has no journal to replay, or is due by mount
+ * count or check interval. Other filesystems are always checked.
+ */
+static int fsck_needed(const char *dev, const char *type) {
+    if (strncmp(type, "ext", 3) != 0)
+        return 1;
+
+    uint8_t sb[1024];
+    int fd = open(dev, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 1;
+    ssize_t n = pread(fd, sb, sizeof(sb), 1024);
+    close(fd);
+    if (n != (ssize_t)sizeof(sb) || sb[56] != 0x53 || sb[57] != 0xef)
+        return 1;
+
+    uint16_t mnt_count = sb[52] | sb[53] << 8;
+    int16_t max_mnt_count = (int16_t)(sb[54] | sb[55] << 8);
+    uint16_t state = sb[58] | sb[59] << 8;
+    uint32_t lastcheck = sb[64] | sb[65] << 8 | sb[66] << 16 | (uint32_t)sb[67] << 24;
+    uint32_t interval = sb[68] | sb[69] << 8 | sb[70] << 16 | (uint32_t)sb[71] << 24;
+    int has_journal = sb[92] & 0x04;
+
+    if (state & 0x02)
+        return 1;
+    if (!(state & 0x01) && !has_journal)
+        return 1;
+    if (max_mnt_count > 0 && mnt_count >= max_mnt_count)
+        return 1;
+    if (interval > 0 && (uint32_t)time(NULL) >= lastcheck + interval)
+        return 1;
+    return 0;
+}
+
+/**
+ * Run fsck.<type> -p on a device
+ *
+ * Checks of partitions on the same disk are serialized with a lock file
+ * per disk so that only different disks are checked in parallel.
+ * Returns -1 if the filesystem has errors fsck could not correct.
+ */
+static int run_fsck(mount_entry_t *m, const char *dev) {
+    char real[256], disk[64], lock_path[128], prog[48];
+
+    /* /sys/class/block/sda1 resolves to .../block/sda/sda1 */
+    snprintf(disk, sizeof(disk), "%s", strrchr(dev, '/') + 1);
+    if (realpath(dev, real)) {
+        char sys[300], sys_real[PATH_MAX];
+        snprintf(sys, sizeof(sys), "/sys/class/block/%s", strrchr(real, '/') + 1);
+        snprintf(disk, sizeof(disk), "%s", strrchr(real, '/') + 1);
+        if (realpath(sys, sys_real)) {
+            char part[PATH_MAX + 16];
+            snprintf(part, sizeof(part), "%s/partition", sys_real);
+            if (access(part, F_OK) == 0) {
+                *strrchr(sys_real, '/') = '\0';
+                snprintf(disk, sizeof(disk), "%s", strrchr(sys_real, '/') + 1);
+            }
+        }
+    }
+
+    snprintf(lock_path, sizeof(lock_path), RUN_DIR "/fsck-%s.lock", disk);
+    int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock >= 0)
+        flock(lock, LOCK_EX);
+
+    printf("Checking %s (%s)\n", dev, m->dir);
+    snprintf(prog, sizeof(prog), "fsck.%s", m->type);
+
+    int status = -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp(prog, prog, "-p", dev, (char *)NULL);
+        _exit(127);
+    }
+    if (pid > 0)
+        waitpid(pid, &status, 0);
+
+    if (lock >= 0)
+        close(lock);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "Warning: Could not run %s for %s\n", prog, dev);
+        return 0;
+    }
+    /* 1 = errors corrected, 2 = reboot recommended; 4 and up = left uncorrected */
+    if (WEXITSTATUS(status) >= 4) {
+        fprintf(stderr, "Error: %s found uncorrected errors on %s\n", prog, dev);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Body of a mount worker: wait for the device, check and mount it
+ *
+ * Runs in a forked child so that slow devices and fsck never block init.
+ */
+static int mount_worker(mount_entry_t *m) {
+    char dev[256];
+    int is_root = strcmp(m->dir, "/") == 0;
+
+    snprintf(dev, sizeof(dev), "%s", m->spec);
+    if (spec_is_device(m->spec) && !(m->flags & MS_BIND)) {
+        /* devtmpfs creates the node once the kernel has found the device */
+        long waited = 0;
+        while (resolve_device(m->spec, dev, sizeof(dev)) < 0) {
+            if (waited >= DEVICE_TIMEOUT_MS) {
+                fprintf(stderr, "Error: Device %s for %s did not appear\n", m->spec, m->dir);
+                return 1;
+            }
+            usleep(100 * 1000);
+            waited += 100;
+        }
+
+        struct statvfs vfs;
+        int root_ro = is_root && statvfs("/", &vfs) == 0 && (vfs.f_flag & ST_RDONLY);
+        if (m->passno > 0 && (!is_root || root_ro) && fsck_needed(dev, m->type) &&
+            run_fsck(m, dev) < 0) {
+            return 1;
+        }
+    }
+
+    if (is_root) {
+        if (mount(NULL, "/", NULL, MS_REMOUNT | m->flags, m->data[0] ? m->data : NULL) < 0) {
+            fprintf(stderr, "Failed to remount /: %s\n", strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    mkdir(m->dir, 0755);
+    if (mount(dev, m->dir, m->type, m->flags, m->data[0] ? m->data : NULL) < 0) {
+        fprintf(stderr, "Failed to mount %s on %s: %s\n", dev, m->dir, strerror(errno));
+        return 1;
+    }
+    printf("Mounted %s on %s\n", dev, m->dir);
+    return 0;
+}
+
+/**
+ * Fork the worker for one fstab entry
+ */
+static void mount_launch(mount_entry_t *m) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        sigprocmask(SIG_UNBLOCK, &init_sigmask, NULL);
+        _exit(mount_worker(m));
+    }
+    if (pid < 0) {
+        perror("fork");
+        mount_settled(m, 0);
+        return;
+    }
+    m->pid = pid;
+    m->state = MOUNT_RUNNING;
+}
+
+/**
+ * Record the outcome of an entry and act on everything waiting for it
+ *
+ * Waiting services are released or failed, and the entries mounted inside
+ * this one are launched, or failed along with it.
+ */
+static void mount_settled(mount_entry_t *m, int ok) {
+    m->pid = 0;
+    m->state = ok ? MOUNT_DONE : MOUNT_FAILED;
+    mounts_settled++;
+
+    for (int w = 0; w < m->waiter_count; w++) {
+        service_t *svc = services[m->waiters[w]];
+        svc->pending_waits--;
+        if (!ok) {
+            if (svc->state == SERVICE_STOPPED) {
+                fprintf(stderr, "Warning: Service %s not started, mount %s failed\n",
+                        svc->name, m->dir);
+                service_failed(svc);
+            }
+        } else if (--svc->pending_deps == 0 && svc->state == SERVICE_STOPPED) {
+            queue_ready(svc);
+        }
+    }
+    free(m->waiters);
+    m->waiters = NULL;
+    m->waiter_count = 0;
+
+    for (int i = 0; i < mount_count; i++) {
+        if (mounts[i].parent != m - mounts || mounts[i].state != MOUNT_PENDING)
+            continue;
+        if (ok)
+            mount_launch(&mounts[i]);
+        else
+            mount_settled(&mounts[i], 0);
+    }
+
+    if (mounts_settled == mount_count)
+        trace_event(TRACE_PHASE_END, -1, 0, 0, "mount_fstab");
+    start_ready_services();
+}
+
+/**
+ * Launch the fstab entries whose parent filesystem is ready
+ */
+static void start_mounts(void) {
+    if (mounts_settled == mount_count)
+        return;
+
+    trace_event(TRACE_PHASE_BEGIN, -1, 0, 0, "mount_fstab");
+    for (int i = 0; i < mount_count; i++) {
+        mount_entry_t *m = &mounts[i];
+        if (m->state == MOUNT_PENDING &&
+            (m->parent < 0 || mounts[m->parent].state == MOUNT_DONE))
+            mount_launch(m);
+    }
+}
+
+/**
+ * Handle the exit of a mount worker
+ */
+static int mount_worker_exited(pid_t pid, int status) {
+    for (int i = 0; i < mount_count; i++) {
+        if (mounts[i].pid == pid) {
+            mount_settled(&mounts[i], WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Files opened while recording the boot working set */
+static watch_t readahead_watch = { .fd = -1 };
+static watch_t readahead_timer = { .fd = -1 };
+static char **readahead_files = NULL;
+static int readahead_file_count = 0;
+
+/* Recorded paths by hash; file is the index into readahead_files plus one */
+typedef struct {
+    uint32_t hash;
+    uint32_t file;
+} readahead_seen_t;
+
+static readahead_seen_t readahead_seen[READAHEAD_MAX_FILES * 2];
+
+/* One cached range of a file, placed by its position on disk */
+typedef struct {
+    dev_t dev;
+    uint64_t block;
+    uint64_t offset;
+    uint64_t length;
+    int file;
+} readahead_range_t;
+
+/**
+ * Stamp for the readahead list: changes whenever packages or services do
+ *
+ * ice-pkg and service edits add or remove files in these directories,
+ * which updates their modification times.
+ */
+static void readahead_stamp(char *buf, size_t size) {
+    struct stat pkg, svc;
+
+    if (stat(PACKAGE_DB_DIR, &pkg) < 0)
+        memset(&pkg, 0, sizeof(pkg));
+    if (stat(SERVICE_DIR, &svc) < 0)
+        memset(&svc, 0, sizeof(svc));
+    snprintf(buf, size, "%lld.%09ld %lld.%09ld",
+             (long long)pkg.st_mtim.tv_sec, pkg.st_mtim.tv_nsec,
+             (long long)svc.st_mtim.tv_sec, svc.st_mtim.tv_nsec);
+}
+
+/**
+ * Prefetch every range of the readahead list, in on-disk order
+ *
+ * Runs in a forked child at the lowest best-effort I/O priority, so the
+ * prefetch stays ahead of the services without starving their own reads.
+ */
+static void readahead_replay(FILE *f) {
+    char line[4200];
+    char last[4096] = "";
+    int fd = -1, ranges = 0;
+
+    /* IOPRIO_WHO_PROCESS, best effort class 2, level 7 */
+    syscall(SYS_ioprio_set, 1, 0, (2 << 13) | 7);
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long offset, length;
+        int pos;
+
+        if (sscanf(line, "%llu %llu %n", &offset, &length, &pos) < 2)
+            continue;
+        char *path = line + pos;
+        path[strcspn(path, "\n")] = '\0';
+
+        if (strcmp(path, last) != 0) {
+            if (fd >= 0)
+                close(fd);
+            fd = open(path, O_RDONLY | O_NOATIME | O_CLOEXEC);
+            snprintf(last, sizeof(last), "%s", path);
+        }
+        if (fd >= 0 && readahead(fd, (off64_t)offset, (size_t)length) == 0)
+            ranges++;
+    }
+    if (fd >= 0)
+        close(fd);
+    printf("Readahead: prefetched %d ranges\n", ranges);
+}
+
+static int compare_ranges(const void *a, const void *b) {
+    const readahead_range_t *x = a, *y = b;
+
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->block != y->block)
+        return x->block < y->block ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/**
+ * Physical position of a file offset, 0 if the filesystem cannot tell
+ */
+static uint64_t file_block(int fd, uint64_t offset) {
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } fm;
+
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_start = offset;
+    fm.map.fm_length = 1;
+    fm.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) < 0 || fm.map.fm_mapped_extents == 0)
+        return 0;
+    return fm.extent.fe_physical + (offset - fm.extent.fe_logical);
+}
+
+/**
+ * Write the readahead list from the recorded files
+ *
+ * mincore() tells which pages of each file boot actually read; those
+ * ranges are sorted by device and physical block so the replay reads the
+ * disk front to back. Runs in a forked child.
+ */
+static int readahead_write(const char *stamp) {
+    long page = sysconf(_SC_PAGESIZE);
+    readahead_range_t *ranges = NULL;
+    size_t count = 0, capacity = 0;
+
+    for (int i = 0; i < readahead_file_count; i++) {
+        struct stat st;
+        int fd = open(readahead_files[i], O_RDONLY | O_NOATIME | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            close(fd);
+            continue;
+        }
+
+        size_t pages = ((size_t)st.st_size + page - 1) / page;
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        unsigned char *vec = malloc(pages);
+        if (map == MAP_FAILED || !vec || mincore(map, st.st_size, vec) < 0) {
+            if (map != MAP_FAILED)
+                munmap(map, st.st_size);
+            free(vec);
+            close(fd);
+            continue;
+        }
+
+        for (size_t p = 0; p < pages; ) {
+            if (!(vec[p] & 1)) {
+                p++;
+                continue;
+            }
+            size_t start = p;
+            while (p < pages && (vec[p] & 1))
+                p++;
+
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                readahead_range_t *grown = realloc(ranges, capacity * sizeof(*ranges));
+                if (!grown)
+                    break;
+                ranges = grown;
+            }
+            readahead_range_t *r = &ranges[count++];
+            r->dev = st.st_dev;
+            r->offset = (uint64_t)start * page;
+            r->length = (uint64_t)(p - start) * page;
+            r->block = file_block(fd, r->offset);
+            r->file = i;
+        }
+
+        munmap(map, st.st_size);
+        free(vec);
+        close(fd);
+    }
+
+    qsort(ranges, count, sizeof(*ranges), compare_ranges);
+
+    mkdir(READAHEAD_DIR, 0755);
+    FILE *f = fopen(READAHEAD_LIST ".tmp", "w");
+    if (!f) {
+        free(ranges);
+        return 1;
+    }
+    fprintf(f, "%s %s\n", READAHEAD_MAGIC, stamp);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(f, "%llu %llu %s\n", (unsigned long long)ranges[i].offset,
+                (unsigned long long)ranges[i].length, readahead_files[ranges[i].file]);
+    }
+    int ok = fclose(f) == 0 && rename(READAHEAD_LIST ".tmp", READAHEAD_LIST) == 0;
+    if (ok)
+        printf("Readahead: recorded %zu ranges in %d files\n", count, readahead_file_count);
+    free(ranges);
+    return ok ? 0 : 1;
+}
+
+/**
+ * Remember each file opened while recording
+ */
+static void handle_fanotify(watch_t *w, uint32_t events) {
+    (void)events;
+    char buf[4096] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    ssize_t n;
+
+    while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+        struct fanotify_event_metadata *ev = (struct fanotify_event_metadata *)buf;
+
+        for (; FAN_EVENT_OK(ev, n); ev = FAN_EVENT_NEXT(ev, n)) {
+            if (ev->fd < 0)
+                continue;
+
+            char link[32], path[4096];
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", ev->fd);
+            ssize_t len = readlink(link, path, sizeof(path) - 1);
+            close(ev->fd);
+            if (len <= 0 || readahead_file_count >= READAHEAD_MAX_FILES)
+                continue;
+            path[len] = '\0';
+
+            uint32_t h = hash_name(path);
+            uint32_t mask = READAHEAD_MAX_FILES * 2 - 1;
+            uint32_t slot = h & mask;
+            while (readahead_seen[slot].file &&
+                   (readahead_seen[slot].hash != h ||
+                    strcmp(readahead_files[readahead_seen[slot].file - 1], path) != 0))
+                slot = (slot + 1) & mask;
+            if (readahead_seen[slot].file)
+                continue;
+
+            char *copy = strdup(path);
+            char **files = realloc(readahead_files,
+                                   (readahead_file_count + 1) * sizeof(*files));
+            if (!copy || !files) {
+                free(copy);
+                if (files)
+                    readahead_files = files;
+                continue;
+            }
+            readahead_files = files;
+            readahead_files[readahead_file_count++] = copy;
+            readahead_seen[slot].hash = h;
+            readahead_seen[slot].file = readahead_file_count;
+        }
+    }
+}
+
+/**
+ * End of the recording window: save the list from a child
+ */
+static void readahead_record_done(watch_t *w, uint32_t events) {
+    (void)w;
+    (void)events;
+
+    /* Drain what is already queued, then stop recording */
+    handle_fanotify(&readahead_watch, EPOLLIN);
+    watch_close(&readahead_watch);
+    watch_close(&readahead_timer);
+
+    char stamp[64];
+    readahead_stamp(stamp, sizeof(stamp));
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_UNBLOCK, &init_sigmask, NULL);
+        _exit(readahead_write(stamp));
+    }
+    if (pid < 0)
+        perror("fork");
+
+    for (int i = 0; i < readahead_file_count; i++)
+        free(readahead_files[i]);
+    free(readahead_files);
+    readahead_files = NULL;
+    readahead_file_count = 0;
+    memset(readahead_seen, 0, sizeof(readahead_seen));
+}
+
+/**
+ * Replay the readahead list if it is current, otherwise record a new one
+ *
+ * Recording watches the root mount with fanotify for the first
+ * READAHEAD_RECORD_MS of boot; the list is rebuilt whenever the package
+ * database or the service directory changes.
+ */
+static void readahead_start(void) {
+    char stamp[64], line[256], expected[128];
+    FILE *f = fopen(READAHEAD_LIST, "r");
+
+    readahead_stamp(stamp, sizeof(stamp));
+    snprintf(expected, sizeof(expected), "%s %s\n", READAHEAD_MAGIC, stamp);
+
+    if (f && fgets(line, sizeof(line), f) && strcmp(line, expected) == 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            sigprocmask(SIG_UNBLOCK, &init_sigmask, NULL);
+            readahead_replay(f);
+            _exit(0);
+        }
+        if (pid < 0)
+            perror("fork");
+        fclose(f);
+        return;
+    }
+    if (f)
+        fclose(f);
+
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_NONBLOCK | FAN_CLOEXEC,
+                           O_RDONLY | O_LARGEFILE | O_CLOEXEC | O_NOATIME);
+    if (fd < 0) {
+        perror("fanotify_init");
+        return;
+    }
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN, AT_FDCWD, "/") < 0 ||
+        watch_add(&readahead_watch, fd, EPOLLIN, handle_fanotify, NULL) < 0) {
+        perror("fanotify_mark");
+        close(fd);
+        return;
+    }
+
+    printf("Readahead: recording the boot working set\n");
+    timer_arm(&readahead_timer, READAHEAD_RECORD_MS, readahead_record_done, NULL);
+}
+
+/* A service waiting for a device node (requires-device) */
+typedef struct {
+    char path[64];
+    int service;
+} device_wait_t;
+
+static watch_t uevent_watch = { .fd = -1 };
+static device_wait_t *device_waits = NULL;
+static int device_wait_count = 0;
+
+/* Modaliases waiting for a modprobe worker */
+static char **modalias_queue = NULL;
+static int modalias_head = 0;
+static int modalias_tail = 0;
+static int modalias_capacity = 0;
+
+/* Every alias ever queued, open addressed and at most 3/4 full */
+typedef struct {
+    uint32_t hash;              /* 0 if empty */
+    char *alias;
+} modalias_seen_t;
+
+static modalias_seen_t *modalias_seen = NULL;
+static uint32_t modalias_seen_mask = 0;
+static uint32_t modalias_seen_count = 0;
+
+static pid_t *modprobe_pids = NULL;
+static int modprobe_max = 0;
+static int modprobe_running = 0;
+static int modprobe_broken = 0;
+static pid_t coldplug_pid = 0;
+static int coldplug_active = 0;
+
+static void handle_uevent(watch_t *w, uint32_t events);
+
+/**
+ * Subscribe to kernel uevents
+ */
+static void setup_uevents(void) {
+    struct sockaddr_nl addr;
+
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        perror("uevent socket");
+        return;
+    }
+
+    /* Coldplug replays every device at once */
+    int size = UEVENT_BUFFER_SIZE;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("uevent bind");
+        close(fd);
+        return;
+    }
+
+    if (watch_add(&uevent_watch, fd, EPOLLIN, handle_uevent, NULL) < 0)
+        close(fd);
+}
+
+/**
+ * Make services wait for the device nodes named by requires-device
+ *
+ * The wait is registered before checking for the node; a node appearing
+ * in between is still reported by a queued uevent.
+ */
+static void resolve_device_requirements(int first) {
+    for (int i = first; i < service_count; i++)
+        resolve_service_devices(services[i]);
+}
+
+static void resolve_service_devices(service_t *svc) {
+    for (int r = 0; r < svc->device_req_count; r++) {
+        if (access(svc->device_reqs[r], F_OK) == 0)
+            continue;
+
+        device_wait_t *waits = realloc(device_waits, (device_wait_count + 1) * sizeof(*waits));
+        if (!waits)
+            continue;
+        device_waits = waits;
+        snprintf(waits[device_wait_count].path, sizeof(waits[0].path), "%s",
+                 svc->device_reqs[r]);
+        waits[device_wait_count++].service = svc->index;
+        svc->pending_waits++;
+        svc->pending_deps++;
+    }
+}
+
+/**
+ * Forget the mounts and devices a service was waiting for
+ *
+ * Used when its requirements are replaced by a reload or it is removed.
+ */
+static void drop_service_waits(service_t *svc) {
+    for (int i = 0; i < mount_count; i++) {
+        mount_entry_t *m = &mounts[i];
+        int kept = 0;
+        for (int w = 0; w < m->waiter_count; w++) {
+            if (m->waiters[w] != svc->index)
+                m->waiters[kept++] = m->waiters[w];
+        }
+        m->waiter_count = kept;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < device_wait_count; i++) {
+        if (device_waits[i].service != svc->index)
+            device_waits[kept++] = device_waits[i];
+    }
+    device_wait_count = kept;
+    svc->pending_waits = 0;
+}
+
+/**
+ * Release the services waiting for a device node that appeared
+ */
+static void device_added(const char *path) {
+    int kept = 0;
+
+    for (int i = 0; i < device_wait_count; i++) {
+        if (strcmp(device_waits[i].path, path) != 0) {
+            device_waits[kept++] = device_waits[i];
+            continue;
+        }
+
+        service_t *svc = services[device_waits[i].service];
+        printf("Device %s appeared for service %s\n", path, svc->name);
+        svc->pending_waits--;
+        if (--svc->pending_deps == 0 && svc->state == SERVICE_STOPPED)
+            queue_ready(svc);
+    }
+    device_wait_count = kept;
+    start_ready_services();
+}
+
+/**
+ * Start modprobe workers while there are queued modaliases and free slots
+ *
+ * Each worker loads a batch of aliases with one modprobe -a, so a
+ * coldplug of hundreds of devices costs a few dozen processes.
+ */
+static void modprobe_dispatch(void) {
+    extern char **environ;
+
+    while (modalias_head != modalias_tail && modprobe_running < modprobe_max) {
+        char *argv[MODPROBE_BATCH + 5];
+        int argc = 0;
+
+        argv[argc++] = "modprobe";
+        argv[argc++] = "-a";
+        argv[argc++] = "-b";
+        argv[argc++] = "-q";
+        int first = argc;
+        while (modalias_head != modalias_tail && argc < first + MODPROBE_BATCH)
+            argv[argc++] = modalias_queue[modalias_head++ % modalias_capacity];
+        argv[argc] = NULL;
+
+        posix_spawnattr_t attr;
+        sigset_t none;
+        sigemptyset(&none);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, &none);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+        pid_t pid;
+        int err = posix_spawnp(&pid, "modprobe", NULL, &attr, argv, environ);
+        posix_spawnattr_destroy(&attr);
+
+        for (int i = first; i < argc; i++)
+            free(argv[i]);
+
+        if (err != 0) {
+            fprintf(stderr, "Warning: Cannot run modprobe: %s\n", strerror(err));
+            while (modalias_head != modalias_tail)
+                free(modalias_queue[modalias_head++ % modalias_capacity]);
+            modprobe_broken = 1;
+            break;
+        }
+
+        for (int i = 0; i < modprobe_max; i++) {
+            if (modprobe_pids[i] == 0) {
+                modprobe_pids[i] = pid;
+                break;
+            }
+        }
+        modprobe_running++;
+    }
+
+    if (coldplug_active && coldplug_pid == 0 && modprobe_running == 0 &&
+        modalias_head == modalias_tail) {
+        coldplug_active = 0;
+        trace_event(TRACE_PHASE_END, -1, 0, 0, "coldplug");
+    }
+}
+
+/**
+ * Double the table of seen aliases
+ */
+static int modalias_seen_grow(void) {
+    uint32_t size = modalias_seen ? (modalias_seen_mask + 1) * 2 : 1024;
+    modalias_seen_t *table = calloc(size, sizeof(*table));
+    if (!table)
+        return -1;
+
+    for (uint32_t i = 0; modalias_seen && i <= modalias_seen_mask; i++) {
+        if (!modalias_seen[i].hash)
+            continue;
+        uint32_t slot = modalias_seen[i].hash & (size - 1);
+        while (table[slot].hash)
+            slot = (slot + 1) & (size - 1);
+        table[slot] = modalias_seen[i];
+    }
+    free(modalias_seen);
+    modalias_seen = table;
+    modalias_seen_mask = size - 1;
+    return 0;
+}
+
+/**
+ * Remember an alias; returns 0 if it was seen before
+ *
+ * Without memory to remember it, the alias counts as new: loading a
+ * module twice is harmless, never loading it is not.
+ */
+static int modalias_seen_insert(const char *alias) {
+    static int warned = 0;
+    uint32_t h = hash_name(alias) | 1;
+    uint32_t slot = h & modalias_seen_mask;
+
+    for (; modalias_seen && modalias_seen[slot].hash; slot = (slot + 1) & modalias_seen_mask) {
+        if (modalias_seen[slot].hash == h && strcmp(modalias_seen[slot].alias, alias) == 0)
+            return 0;
+    }
+
+    char *copy = strdup(alias);
+    int full = !modalias_seen || (modalias_seen_count + 1) * 4 > (modalias_seen_mask + 1) * 3;
+    if (!copy || (full && modalias_seen_grow() < 0)) {
+        free(copy);
+        if (!warned)
+            fprintf(stderr, "Warning: Out of memory for module aliases, duplicates may load\n");
+        warned = 1;
+        return 1;
+    }
+
+    slot = h & modalias_seen_mask;
+    while (modalias_seen[slot].hash)
+        slot = (slot + 1) & modalias_seen_mask;
+    modalias_seen[slot].hash = h;
+    modalias_seen[slot].alias = copy;
+    modalias_seen_count++;
+    return 1;
+}
+
+/**
+ * Queue a module alias for loading, once
+ */
+static void modalias_add(const char *alias) {
+    if (!modalias_seen_insert(alias))
+        return;
+
+    if (modalias_tail - modalias_head == modalias_capacity) {
+        int capacity = modalias_capacity ? modalias_capacity * 2 : 256;
+        char **queue = malloc(capacity * sizeof(*queue));
+        if (!queue)
+            return;
+        int n = 0;
+        while (modalias_head != modalias_tail)
+            queue[n++] = modalias_queue[modalias_head++ % modalias_capacity];
+        free(modalias_queue);
+        modalias_queue = queue;
+        modalias_capacity = capacity;
+        modalias_head = 0;
+        modalias_tail = n;
+    }
+
+    char *copy = strdup(alias);
+    if (copy)
+        modalias_queue[modalias_tail++ % modalias_capacity] = copy;
+}
+
+/**
+ * Read kernel uevents
+ *
+ * Each message is "ACTION@DEVPATH" followed by NUL separated KEY=VALUE
+ * pairs. New devices have their MODALIAS loaded and their node matched
+ * against requires-device waits.
+ */
+static void handle_uevent(watch_t *w, uint32_t events) {
+    (void)events;
+    char buf[8192];
+
+    for (;;) {
+        struct sockaddr_nl from;
+        struct iovec iov = { buf, sizeof(buf) - 1 };
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        ssize_t n = recvmsg(w->fd, &msg, 0);
+        if (n < 0) {
+            if (errno == ENOBUFS) {
+                fprintf(stderr, "Warning: uevent queue overflowed, some events were lost\n");
+                continue;
+            }
+            break;
+        }
+
+        /* Only the kernel may send these */
+        if (from.nl_pid != 0 || n == 0)
+            continue;
+        buf[n] = '\0';
+
+        const char *action = NULL, *modalias = NULL, *devname = NULL;
+        for (char *p = buf + strlen(buf) + 1; p < buf + n; p += strlen(p) + 1) {
+            if (strncmp(p, "ACTION=", 7) == 0)
+                action = p + 7;
+            else if (strncmp(p, "MODALIAS=", 9) == 0)
+                modalias = p + 9;
+            else if (strncmp(p, "DEVNAME=", 8) == 0)
+                devname = p + 8;
+        }
+        if (!action || strcmp(action, "add") != 0)
+            continue;
+
+        if (modalias && modprobe_pids && !modprobe_broken)
+            modalias_add(modalias);
+        if (devname && device_wait_count > 0) {
+            char path[128];
+            snprintf(path, sizeof(path), "%s%s", devname[0] == '/' ? "" : "/dev/", devname);
+            device_added(path);
+        }
+    }
+    modprobe_dispatch();
+}
+
+/**
+ * Ask the kernel to replay "add" events for every device under dir
+ */
+static void coldplug_walk(int dir_fd) {
+    DIR *dir = fdopendir(dir_fd);
+    struct dirent *entry;
+
+    if (!dir) {
+        close(dir_fd);
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        if (entry->d_type == DT_DIR) {
+            int fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd >= 0)
+                coldplug_walk(fd);
+        } else if (strcmp(entry->d_name, "uevent") == 0) {
+            int fd = openat(dirfd(dir), "uevent", O_WRONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                if (write(fd, "add\n", 4) < 0) {
+                    /* Some devices refuse replays; nothing to do */
+                }
+                close(fd);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Replay uevents for devices the kernel found before init ran
+ *
+ * The walk runs in a forked child; the events it triggers arrive on the
+ * uevent socket, where their modaliases feed a pool of modprobe workers
+ * sized to the number of CPUs.
+ */
+static void start_coldplug(void) {
+    if (uevent_watch.fd < 0)
+        return;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    modprobe_max = cpus > 0 ? (int)cpus : 1;
+    modprobe_pids = calloc(modprobe_max, sizeof(pid_t));
+    if (!modprobe_pids) {
+        modprobe_max = 0;
+        return;
+    }
+
+    trace_event(TRACE_PHASE_BEGIN, -1, 0, 0, "coldplug");
+    coldplug_active = 1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_UNBLOCK, &init_sigmask, NULL);
+        int fd = open("/sys/devices", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0)
+            coldplug_walk(fd);
+        _exit(0);
+    }
+    if (pid < 0) {
+        perror("fork");
+        coldplug_active = 0;
+        return;
+    }
+    coldplug_pid = pid;
+}
+
+/**
+ * Handle the exit of the coldplug walker or a modprobe worker
+ */
+static void coldplug_worker_exited(pid_t pid) {
+    if (pid == coldplug_pid) {
+        coldplug_pid = 0;
+    } else {
+        int i;
+        for (i = 0; i < modprobe_max && modprobe_pids[i] != pid; i++)
+            ;
+        if (i == modprobe_max)
+            return;
+        modprobe_pids[i] = 0;
+        modprobe_running--;
+    }
+
+    /* Events from the walk may still be queued on the socket */
+    handle_uevent(&uevent_watch, EPOLLIN);
+}
+
+/**
+ * Make room for at least n services
+ *
+ * The index table grows by doubling while the services themselves are
+ * allocated a chunk at a time, so pointers held by watches and timers
+ * stay valid. Both hash indexes are rebuilt at twice the capacity.
+ */
+static int services_reserve(int n) {
+    if (n <= service_capacity)
+        return 0;
+
+    int capacity = service_capacity ? service_capacity : SERVICE_CHUNK;
+    while (capacity < n)
+        capacity *= 2;
+
+    service_t **table = realloc(services, capacity * sizeof(*table));
+    if (!table)
+        return -1;
+    services = table;
+
+    int *queue = malloc(capacity * sizeof(*queue));
+    if (!queue)
+        return -1;
+
+    for (int i = service_capacity; i < capacity; i += SERVICE_CHUNK) {
+        service_t *chunk = calloc(SERVICE_CHUNK, sizeof(service_t));
+        if (!chunk) {
+            free(queue);
+            return -1;
+        }
+        for (int j = 0; j < SERVICE_CHUNK; j++)
+            services[i + j] = &chunk[j];
+    }
+
+    if (ready_count > 0)
+        memcpy(queue, ready_queue, ready_count * sizeof(*queue));
+    free(ready_queue);
+    ready_queue = queue;
+    service_capacity = capacity;
+
+    uint32_t size = 1;
+    while (size < (uint32_t)capacity * 2)
+        size <<= 1;
+
+    uint32_t *names = calloc(size, sizeof(uint32_t));
+    uint32_t *pids = calloc(size, sizeof(uint32_t));
+    if (!names || !pids) {
+        free(names);
+        free(pids);
+        return -1;
+    }
+    free(name_index);
+    free(pid_index);
+    name_index = names;
+    pid_index = pids;
+    index_mask = size - 1;
+
+    for (int i = 0; i < service_count; i++) {
+        if (!services[i]->removed)
+            name_index_insert(services[i]);
+        if (services[i]->pid > 0)
+            pid_index_insert(services[i]);
+    }
+    return 0;
+}
+
+/**
+ * Get the next free service slot, or NULL when out of memory
+ *
+ * The slot only becomes part of the table once passed to service_add().
+ */
+static service_t *service_slot(void) {
+    if (services_reserve(service_count + 1) < 0) {
+        fprintf(stderr, "Error: Out of memory for services\n");
+        return NULL;
+    }
+    return services[service_count];
+}
+
+/**
+ * Append the service in the next free slot to the table
+ */
+static void service_add(service_t *svc) {
+    svc->index = service_count++;
+    name_index_insert(svc);
+}
+
+/**
+ * Forget every loaded service, e.g. after a malformed database
+ */
+static void services_clear(void) {
+    service_count = 0;
+    if (name_index)
+        memset(name_index, 0, (index_mask + 1) * sizeof(uint32_t));
+}
+
+static void name_index_insert(service_t *svc) {
+    uint32_t slot = hash_name(svc->name) & index_mask;
+    while (name_index[slot])
+        slot = (slot + 1) & index_mask;
+    name_index[slot] = (uint32_t)svc->index + 1;
+}
+
+/**
+ * Index names again, leaving out removed services
+ */
+static void name_index_rebuild(void) {
+    memset(name_index, 0, (index_mask + 1) * sizeof(uint32_t));
+    for (int i = 0; i < service_count; i++) {
+        if (!services[i]->removed)
+            name_index_insert(services[i]);
+    }
+}
+
+static uint32_t hash_pid(pid_t pid) {
+    return ((uint32_t)pid * 2654435761u) & index_mask;
+}
+
+static void pid_index_insert(service_t *svc) {
+    uint32_t slot = hash_pid(svc->pid);
+    while (pid_index[slot])
+        slot = (slot + 1) & index_mask;
+    pid_index[slot] = (uint32_t)svc->index + 1;
+}
+
+/**
+ * Find the service running as pid and drop it from the PID index
+ *
+ * Removal shifts later entries of the probe run back so lookups never
+ * need tombstones.
+ */
+static service_t *pid_index_take(pid_t pid) {
+    if (!pid_index)
+        return NULL;
+
+    uint32_t slot = hash_pid(pid);
+    while (pid_index[slot] && services[pid_index[slot] - 1]->pid != pid)
+        slot = (slot + 1) & index_mask;
+    if (!pid_index[slot])
+        return NULL;
+
+    service_t *svc = services[pid_index[slot] - 1];
+    pid_index[slot] = 0;
+
+    for (uint32_t next = (slot + 1) & index_mask; pid_index[next];
+         next = (next + 1) & index_mask) {
+        uint32_t home = hash_pid(services[pid_index[next] - 1]->pid);
+
+        /* Move the entry back unless its home lies in (slot, next] */
+        if (((next - home) & index_mask) >= ((next - slot) & index_mask)) {
+            pid_index[slot] = pid_index[next];
+            pid_index[next] = 0;
+            slot = next;
+        }
+    }
+    return svc;
+}
+
+/**
+ * Load service definitions from /etc/icenet/services
+ *
+ * The compiled database is used when it is present and up to date, which
+ * avoids opening and parsing every service file during early boot.
+ */
+static void load_services(void) {
+    if (!test_mode && load_service_db(SERVICE_DB, SERVICE_DIR) == 0)
+        return;
+
+    load_service_dir(service_dir);
+    build_dependency_graph();
+}
+
+/**
+ * Reset a service slot to its defaults
+ */
+static void service_init(service_t *svc, const char *name) {
+    memset(svc, 0, sizeof(service_t));
+    snprintf(svc->name, sizeof(svc->name), "%.63s", name);
+    svc->state = SERVICE_STOPPED;
+    svc->respawn_timer.fd = -1;
+    svc->notify_watch.fd = -1;
+    svc->stop_timer.fd = -1;
+    svc->log_watch.fd = -1;
+    svc->pidfd = -1;
+    svc->cgroup_fd = -1;
+    svc->respawn_delay = RESPAWN_DELAY_MS;
+    svc->respawn_max_delay = RESPAWN_MAX_DELAY_MS;
+    svc->respawn_jitter = RESPAWN_JITTER_PCT;
+    svc->respawn_limit = RESPAWN_LIMIT;
+    svc->respawn_window = RESPAWN_WINDOW_S;
+    svc->stop_timeout = STOP_TIMEOUT_MS;
+}
+
+/**
+ * Read the next key=value pair from a service file
+ *
+ * Returns 1 with key and value pointing into line, or 0 at end of file.
+ */
+static int read_service_key(FILE *f, char *line, size_t size, char **key, char **value) {
+    while (fgets(line, (int)size, f)) {
+        /* Remove newline */
+        line[strcspn(line, "\n")] = 0;
+
+        /* Skip comments and empty lines */
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+
+        /* Parse key=value */
+        char *eq = strchr(line, '=');
+        if (!eq)
+            continue;
+
+        *eq = '\0';
+        *key = line;
+        *value = eq + 1;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Parse a numeric service key, clamping it to [min, max]
+ *
+ * Returns fallback, normally the current setting, if value is not a number.
+ */
+static long parse_number(service_t *svc, const char *key, const char *value,
+                         long min, long max, long fallback) {
+    char *end;
+    long n = strtol(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0') {
+        fprintf(stderr, "Warning: Invalid %s=%s for service %s\n", key, value, svc->name);
+        return fallback;
+    }
+    if (n < min)
+        return min;
+    if (n > max)
+        return max;
+    return n;
+}
+
+/**
+ * Apply a service key other than exec and depends
+ */
+static void service_set_key(service_t *svc, const char *key, const char *value) {
+    if (strcmp(key, "respawn") == 0) {
+        svc->respawn = (strcmp(value, "yes") == 0);
+    } else if (strcmp(key, "respawn-delay") == 0) {
+        svc->respawn_delay = parse_number(svc, key, value, 1, 3600000,
+                                          svc->respawn_delay);
+    } else if (strcmp(key, "respawn-max-delay") == 0) {
+        svc->respawn_max_delay = parse_number(svc, key, value, 1, 3600000,
+                                              svc->respawn_max_delay);
+    } else if (strcmp(key, "respawn-jitter") == 0) {
+        svc->respawn_jitter = (int)parse_number(svc, key, value, 0, 100,
+                                                svc->respawn_jitter);
+    } else if (strcmp(key, "respawn-limit") == 0) {
+        svc->respawn_limit = (int)parse_number(svc, key, value, 1, MAX_RESPAWN_LIMIT,
+                                               svc->respawn_limit);
+    } else if (strcmp(key, "respawn-window") == 0) {
+        svc->respawn_window = (int)parse_number(svc, key, value, 1, 86400,
+                                                svc->respawn_window);
+    } else if (strcmp(key, "stop-timeout") == 0) {
+        svc->stop_timeout = parse_number(svc, key, value, 1, 3600000, svc->stop_timeout);
+    } else if (strcmp(key, "listen") == 0) {
+        if (svc->listen_count < MAX_LISTEN) {
+            listen_t *l = &svc->listens[svc->listen_count++];
+            strncpy(l->spec, value, sizeof(l->spec) - 1);
+            l->watch.fd = -1;
+        }
+    } else if (strcmp(key, "env") == 0) {
+        const char *eq = strchr(value, '=');
+        if (!eq || eq == value || strlen(value) >= sizeof(svc->env[0])) {
+            fprintf(stderr, "Warning: Invalid env %s for service %s\n", value, svc->name);
+        } else if (svc->env_count < MAX_ENV) {
+            snprintf(svc->env[svc->env_count++], sizeof(svc->env[0]), "%s", value);
+        }
+    } else if (strcmp(key, "requires-mount") == 0) {
+        if (value[0] != '/' || strlen(value) >= sizeof(svc->mount_reqs[0])) {
+            fprintf(stderr, "Warning: Invalid requires-mount %s for service %s\n",
+                    value, svc->name);
+        } else if (svc->mount_req_count < MAX_MOUNT_REQS) {
+            snprintf(svc->mount_reqs[svc->mount_req_count++], sizeof(svc->mount_reqs[0]),
+                     "%s", value);
+        }
+    } else if (strcmp(key, "requires-device") == 0) {
+        if (strncmp(value, "/dev/", 5) != 0 || strlen(value) >= sizeof(svc->device_reqs[0])) {
+            fprintf(stderr, "Warning: Invalid requires-device %s for service %s\n",
+                    value, svc->name);
+        } else if (svc->device_req_count < MAX_DEVICE_REQS) {
+            snprintf(svc->device_reqs[svc->device_req_count++], sizeof(svc->device_reqs[0]),
+                     "%s", value);
+        }
+    } else if (strcmp(key, "workdir") == 0) {
+        snprintf(svc->workdir, sizeof(svc->workdir), "%s", value);
+    } else if (strcmp(key, "priority") == 0) {
+        svc->priority = (int)parse_number(svc, key, value, -100, 100, svc->priority);
+    } else if (strcmp(key, "lazy") == 0) {
+        svc->lazy = (strcmp(value, "yes") == 0);
+    } else if (strncmp(key, "cpu.", 4) == 0 || strncmp(key, "memory.", 7) == 0 ||
+               strncmp(key, "io.", 3) == 0 || strncmp(key, "pids.", 5) == 0) {
+        /* Written verbatim to the cgroup interface file of the same name */
+        if (svc->cgroup_setting_count < MAX_CGROUP_SETTINGS && !strchr(key, '/')) {
+            cgroup_setting_t *cs = &svc->cgroup_settings[svc->cgroup_setting_count++];
+            snprintf(cs->key, sizeof(cs->key), "%s", key);
+            snprintf(cs->value, sizeof(cs->value), "%s", value);
+        }
+    } else if (strcmp(key, "log") == 0) {
+        if (strcmp(value, "memory") == 0) {
+            svc->log_mode = LOG_MEMORY;
+        } else if (strcmp(value, "file") == 0) {
+            svc->log_mode = LOG_FILE;
+        } else if (strcmp(value, "console") == 0) {
+            svc->log_mode = LOG_CONSOLE;
+        } else {
+            fprintf(stderr, "Warning: Unknown log mode %s for service %s\n",
+                    value, svc->name);
+        }
+    } else if (strcmp(key, "ready") == 0) {
+        if (strcmp(value, "notify") == 0) {
+            svc->ready = READY_NOTIFY;
+        } else if (strcmp(value, "exit") == 0) {
+            svc->ready = READY_EXIT;
+        } else if (strcmp(value, "started") == 0) {
+            svc->ready = READY_STARTED;
+        } else {
+            fprintf(stderr, "Warning: Unknown ready mode %s for service %s\n",
+                    value, svc->name);
+        }
+    } else {
+        fprintf(stderr, "Warning: Unknown key %s for service %s\n", key, svc->name);
+    }
+}
+
+/**
+ * Split exec into argv once, at load time
+ *
+ * Follows shell quoting: words are separated by blanks, '...' is taken
+ * literally, and inside "..." or unquoted text a backslash escapes the
+ * next character. Unquoting only ever shrinks a word, so the words are
+ * written back into argbuf in place. Returns -1 on an unterminated quote
+ * or too many arguments.
+ */
+static int split_exec(service_t *svc) {
+    const char *in = svc->exec;
+    char *out = svc->argbuf;
+    int arg_count = 0;
+
+    for (;;) {
+        while (*in == ' ' || *in == '\t')
+            in++;
+        if (*in == '\0')
+            break;
+
+        if (arg_count == MAX_ARGS - 1) {
+            fprintf(stderr, "Warning: Too many arguments for service %s\n", svc->name);
+            return -1;
+        }
+        svc->args[arg_count++] = out;
+
+        char quote = 0;
+        while (*in && (quote || (*in != ' ' && *in != '\t'))) {
+            if (quote == '\'') {
+                if (*in == '\'')
+                    quote = 0;
+                else
+                    *out++ = *in;
+                in++;
+            } else if (*in == '\\' && in[1]) {
+                *out++ = in[1];
+                in += 2;
+            } else if (*in == '"') {
+                quote = quote ? 0 : '"';
+                in++;
+            } else if (*in == '\'' && !quote) {
+                quote = '\'';
+                in++;
+            } else {
+                *out++ = *in++;
+            }
+        }
+        *out++ = '\0';
+
+        if (quote) {
+            fprintf(stderr, "Warning: Unterminated quote in exec of service %s\n", svc->name);
+            return -1;
+        }
+    }
+
+    svc->args[arg_count] = NULL;
+    if (arg_count == 0) {
+        fprintf(stderr, "Warning: Empty exec for service %s\n", svc->name);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Parse one service file into svc
+ *
+ * Returns 0 if it defines a service that can be run.
+ */
+static int parse_service_file(service_t *svc, const char *dir_path, const char *name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, name);
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    service_init(svc, name);
+
+    char line[512];
+    char *key, *value;
+    while (read_service_key(f, line, sizeof(line), &key, &value)) {
+        if (strcmp(key, "exec") == 0) {
+            strncpy(svc->exec, value, sizeof(svc->exec) - 1);
+        } else if (strcmp(key, "depends") == 0) {
+            if (svc->dep_count < MAX_DEPS) {
+                strncpy(svc->deps[svc->dep_count], value, sizeof(svc->deps[0]) - 1);
+                svc->dep_count++;
+            }
+        } else {
+            service_set_key(svc, key, value);
+        }
+    }
+
+    fclose(f);
+
+    if (svc->exec[0] == '\0' || split_exec(svc) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Parse every service file in a directory
+ */
+static int load_service_dir(const char *dir_path) {
+    printf("Loading services from %s...\n", dir_path);
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        fprintf(stderr, "Warning: Could not open service directory: %s\n", dir_path);
+        return -1;
+    }
+
+    struct dirent *entry;
+    int loaded = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        /* Already loaded, e.g. when reloading */
+        if (find_service(entry->d_name) >= 0)
+            continue;
+
+        service_t *svc = service_slot();
+        if (!svc)
+            break;
+
+        if (parse_service_file(svc, dir_path, entry->d_name) == 0) {
+            printf("  Loaded service: %s\n", svc->name);
+            service_add(svc);
+            loaded++;
+        }
+    }
+
+    closedir(dir);
+    printf("Loaded %d services\n", loaded);
+    return 0;
+}
+
+/**
+ * FNV-1a, used for the name and path indexes
+ */
+static uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Stamp a service directory with one stat pass
+ *
+ * Catches in-place edits, which leave the directory mtime alone, without
+ * opening or parsing any file.
+ */
+static int svcdb_stamp_dir(const char *dir_path, svcdb_stamp_t *stamp) {
+    memset(stamp, 0, sizeof(*stamp));
+
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+        return -1;
+
+    struct stat st;
+    if (fstat(dirfd(dir), &st) < 0) {
+        closedir(dir);
+        return -1;
+    }
+    stamp->dir_mtime_sec = st.st_mtim.tv_sec;
+    stamp->dir_mtime_nsec = st.st_mtim.tv_nsec;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) < 0)
+            continue;
+
+        stamp->file_count++;
+        stamp->total_size += (uint64_t)st.st_size;
+        if (st.st_mtim.tv_sec > stamp->file_mtime_sec ||
+            (st.st_mtim.tv_sec == stamp->file_mtime_sec &&
+             st.st_mtim.tv_nsec > stamp->file_mtime_nsec)) {
+            stamp->file_mtime_sec = st.st_mtim.tv_sec;
+            stamp->file_mtime_nsec = st.st_mtim.tv_nsec;
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+/* Bounds checked accessors for the mapped database */
+static const char *svcdb_string(const svcdb_header_t *hdr, uint32_t off) {
+    if (off >= hdr->strings_size)
+        return NULL;
+    return svcdb + hdr->strings + off;
+}
+
+static const uint32_t *svcdb_words(const svcdb_header_t *hdr, uint32_t idx, uint32_t n) {
+    if (idx > hdr->word_count || n > hdr->word_count - idx)
+        return NULL;
+    return (const uint32_t *)(svcdb + hdr->words) + idx;
+}
+
+static int svcdb_string_terminated(const char *map, const svcdb_header_t *hdr) {
+    return map[hdr->strings + hdr->strings_size - 1] == '\0';
+}
+
+/**
+ * Load services from a compiled database
+ *
+ * Returns -1 if the database is missing, stale or malformed, in which
+ * case the caller falls back to parsing the service directory.
+ */
+static int load_service_db(const char *path, const char *dir_path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(svcdb_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const svcdb_header_t *hdr = map;
+    size_t size = st.st_size;
+
+    int valid = memcmp(hdr->magic, SVCDB_MAGIC, sizeof(hdr->magic)) == 0 &&
+        hdr->version == SVCDB_VERSION && hdr->file_size == size &&
+        hdr->service_count <= size / sizeof(svcdb_record_t) &&
+        hdr->records <= size &&
+        hdr->service_count * sizeof(svcdb_record_t) <= size - hdr->records &&
+        hdr->words <= size && hdr->words % sizeof(uint32_t) == 0 &&
+        hdr->word_count <= (size - hdr->words) / sizeof(uint32_t) &&
+        hdr->strings <= size && hdr->strings_size <= size - hdr->strings &&
+        hdr->strings_size > 0 && svcdb_string_terminated(map, hdr);
+
+    if (!valid) {
+        fprintf(stderr, "Warning: Ignoring malformed service database %s\n", path);
+        munmap(map, size);
+        return -1;
+    }
+
+    svcdb_stamp_t stamp;
+    if (svcdb_stamp_dir(dir_path, &stamp) < 0 ||
+        memcmp(&stamp, &hdr->stamp, sizeof(stamp)) != 0) {
+        printf("Service database %s is stale, parsing %s\n", path, dir_path);
+        munmap(map, size);
+        return -1;
+    }
+
+    if (services_reserve((int)hdr->service_count) < 0 ||
+        edges_reserve((int)hdr->service_count * MAX_DEPS) < 0) {
+        munmap(map, size);
+        return -1;
+    }
+
+    svcdb = map;
+    svcdb_size = size;
+
+    const svcdb_record_t *recs = (const svcdb_record_t *)(svcdb + hdr->records);
+    int edges = 0;
+
+    for (uint32_t i = 0; i < hdr->service_count; i++) {
+        const svcdb_record_t *rec = &recs[i];
+        const char *name = svcdb_string(hdr, rec->name);
+        const char *exec = svcdb_string(hdr, rec->exec);
+        const uint32_t *argv = svcdb_words(hdr, rec->argv, rec->argc);
+        const uint32_t *deps = svcdb_words(hdr, rec->deps, rec->dep_count);
+        const uint32_t *dependents = svcdb_words(hdr, rec->dependents, rec->dependent_count);
+        const uint32_t *keys = svcdb_words(hdr, rec->keys, rec->key_count * 2u);
+
+        int indices_ok = 1;
+        for (int d = 0; deps && d < rec->dep_count; d++)
+            indices_ok &= deps[d] < hdr->service_count;
+        for (int e = 0; dependents && e < rec->dependent_count; e++)
+            indices_ok &= dependents[e] < hdr->service_count;
+
+        if (!name || !exec || !argv || !deps || !dependents || !keys || !indices_ok ||
+            rec->argc >= MAX_ARGS || rec->dep_count > MAX_DEPS ||
+            edges + rec->dependent_count > edge_capacity) {
+            fprintf(stderr, "Warning: Ignoring malformed service database %s\n", path);
+            services_clear();
+            svcdb = NULL;
+            munmap(map, size);
+            return -1;
+        }
+
+        service_t *svc = service_slot();
+        service_init(svc, name);
+        snprintf(svc->exec, sizeof(svc->exec), "%s", exec);
+
+        /* argv points straight into the mapping */
+        for (int a = 0; a < rec->argc; a++)
+            svc->args[a] = (char *)svcdb_string(hdr, argv[a]);
+        svc->args[rec->argc] = NULL;
+
+        svc->dep_count = rec->dep_count;
+        for (int d = 0; d < rec->dep_count; d++)
+            svc->dep_idx[d] = (int)deps[d];
+        svc->pending_deps = rec->dep_count;
+
+        svc->first_dependent = edges;
+        svc->dependent_count = rec->dependent_count;
+        for (int e = 0; e < rec->dependent_count; e++)
+            dependent_edges[edges++] = (int)dependents[e];
+
+        for (int k = 0; k < rec->key_count; k++) {
+            const char *key = svcdb_string(hdr, keys[2 * k]);
+            const char *value = svcdb_string(hdr, keys[2 * k + 1]);
+            if (key && value)
+                service_set_key(svc, key, value);
+        }
+        service_add(svc);
+    }
+
+    /* Dependency names, for messages */
+    for (int i = 0; i < service_count; i++) {
+        for (int d = 0; d < services[i]->dep_count; d++) {
+            int idx = services[i]->dep_idx[d];
+            memcpy(services[i]->deps[d], services[idx]->name, sizeof(services[i]->deps[d]));
+        }
+    }
+
+    printf("Loaded %d services from %s\n", service_count, path);
+    return 0;
+}
+
+/* Growable buffers used while compiling the database */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;                 /* An append ran out of memory */
+} buffer_t;
+
+static int buffer_append(buffer_t *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->len + len)
+            cap *= 2;
+        char *p = realloc(b->data, cap);
+        if (!p) {
+            b->failed = 1;
+            return -1;
+        }
+        b->data = p;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static uint32_t add_string(buffer_t *strings, const char *s) {
+    uint32_t off = (uint32_t)strings->len;
+    buffer_append(strings, s, strlen(s) + 1);
+    return off;
+}
+
+static uint32_t add_word(buffer_t *words, uint32_t w) {
+    uint32_t idx = (uint32_t)(words->len / sizeof(uint32_t));
+    buffer_append(words, &w, sizeof(w));
+    return idx;
+}
+
+/**
+ * Compile a service directory into a database image
+ */
+static int compile_service_db(const char *dir_path, const char *out_path) {
+    /* Stamped before parsing, so an edit racing the compile reads as stale */
+    svcdb_stamp_t stamp;
+    if (svcdb_stamp_dir(dir_path, &stamp) < 0) {
+        fprintf(stderr, "Cannot stat %s: %s\n", dir_path, strerror(errno));
+        return 1;
+    }
+
+    if (load_service_dir(dir_path) < 0)
+        return 1;
+    build_dependency_graph();
+
+    buffer_t strings = { 0 }, words = { 0 };
+    svcdb_record_t *recs = calloc(service_count ? service_count : 1, sizeof(svcdb_record_t));
+    if (!recs)
+        return 1;
+
+    /* Offset 0 is the empty string */
+    add_string(&strings, "");
+
+    for (int i = 0; i < service_count; i++) {
+        service_t *svc = services[i];
+        svcdb_record_t *rec = &recs[i];
+
+        rec->name = add_string(&strings, svc->name);
+        rec->exec = add_string(&strings, svc->exec);
+
+        uint32_t argv[MAX_ARGS];
+        for (rec->argc = 0; svc->args[rec->argc]; rec->argc++)
+            argv[rec->argc] = add_string(&strings, svc->args[rec->argc]);
+        rec->argv = (uint32_t)(words.len / sizeof(uint32_t));
+        for (int a = 0; a < rec->argc; a++)
+            add_word(&words, argv[a]);
+
+        /* Unresolved dependencies were already reported and are dropped */
+        rec->deps = (uint32_t)(words.len / sizeof(uint32_t));
+        for (int d = 0; d < svc->dep_count; d++) {
+            if (svc->dep_idx[d] >= 0) {
+                add_word(&words, (uint32_t)svc->dep_idx[d]);
+                rec->dep_count++;
+            }
+        }
+
+        rec->dependents = (uint32_t)(words.len / sizeof(uint32_t));
+        rec->dependent_count = (uint16_t)svc->dependent_count;
+        for (int e = 0; e < svc->dependent_count; e++)
+            add_word(&words, (uint32_t)dependent_edges[svc->first_dependent + e]);
+
+        /* Every other key is stored verbatim and replayed at load */
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, svc->name);
+        FILE *f = fopen(path, "r");
+        rec->keys = (uint32_t)(words.len / sizeof(uint32_t));
+        if (f) {
+            char line[512];
+            char *key, *value;
+            while (read_service_key(f, line, sizeof(line), &key, &value)) {
+                if (strcmp(key, "exec") == 0 || strcmp(key, "depends") == 0)
+                    continue;
+                add_word(&words, add_string(&strings, key));
+                add_word(&words, add_string(&strings, value));
+                rec->key_count++;
+            }
+            fclose(f);
+        }
+    }
+
+    /* Offsets into a short buffer would point past the data */
+    if (strings.failed || words.failed) {
+        fprintf(stderr, "Out of memory compiling %s\n", out_path);
+        free(recs);
+        free(strings.data);
+        free(words.data);
+        return 1;
+    }
+
+    svcdb_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SVCDB_MAGIC, sizeof(hdr.magic));
+    hdr.version = SVCDB_VERSION;
+    hdr.service_count = (uint32_t)service_count;
+    hdr.stamp = stamp;
+    hdr.records = sizeof(hdr);
+    hdr.words = hdr.records + (uint32_t)(service_count * sizeof(svcdb_record_t));
+    hdr.word_count = (uint32_t)(words.len / sizeof(uint32_t));
+    hdr.strings = hdr.words + (uint32_t)words.len;
+    hdr.strings_size = (uint32_t)strings.len;
+    hdr.file_size = hdr.strings + hdr.strings_size;
+
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+
+    int ret = 1;
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f) {
+        fprintf(stderr, "Cannot create %s: %s\n", tmp_path, strerror(errno));
+    } else {
+        int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+            (service_count == 0 ||
+             fwrite(recs, sizeof(svcdb_record_t), service_count, f) == (size_t)service_count) &&
+            (words.len == 0 || fwrite(words.data, words.len, 1, f) == 1) &&
+            fwrite(strings.data, strings.len, 1, f) == 1;
+
+        if (fclose(f) != 0)
+            ok = 0;
+
+        if (ok && rename(tmp_path, out_path) == 0) {
+            printf("Compiled %d services into %s (%u bytes)\n",
+                   service_count, out_path, hdr.file_size);
+            ret = 0;
+        } else {
+            fprintf(stderr, "Failed to write %s: %s\n", out_path, strerror(errno));
+            unlink(tmp_path);
+        }
+    }
+
+    free(recs);
+    free(strings.data);
+    free(words.data);
+    return ret;
+}
+
+/**
+ * Find a service by name
+ */
+static int find_service(const char *name) {
+    if (!name_index)
+        return -1;
+
+    for (uint32_t slot = hash_name(name) & index_mask; name_index[slot];
+         slot = (slot + 1) & index_mask) {
+        int idx = (int)name_index[slot] - 1;
+        if (strcmp(services[idx]->name, name) == 0)
+            return idx;
+    }
+    return -1;
+}
+
+/**
+ * Make room for n reverse dependency edges
+ */
+static int edges_reserve(int n) {
+    if (n <= edge_capacity)
+        return 0;
+
+    int *edges = realloc(dependent_edges, n * sizeof(*edges));
+    if (!edges)
+        return -1;
+    dependent_edges = edges;
+    edge_capacity = n;
+    return 0;
+}
+
+/**
+ * Resolve dependency names and build the reverse edge lists
+ *
+ * Each service's pending_deps counter starts at its number of resolved
+ * dependencies that are not up yet; it is decremented as those come up,
+ * and the service is queued when it reaches zero (Kahn's algorithm).
+ * Rebuilding is safe at runtime, which reload relies on.
+ */
+static void build_dependency_graph(void) {
+    int *counts = calloc(service_count ? service_count : 1, sizeof(int));
+    int total = 0;
+
+    if (!counts) {
+        fprintf(stderr, "Error: Out of memory building dependency graph\n");
+        return;
+    }
+
+    for (int i = 0; i < service_count; i++) {
+        service_t *svc = services[i];
+        svc->pending_deps = svc->pending_waits;
+
+        for (int d = 0; d < svc->dep_count; d++) {
+            int idx = find_service(svc->deps[d]);
+            svc->dep_idx[d] = idx;
+
+            if (idx < 0) {
+                fprintf(stderr, "Warning: Dependency %s not found for service %s\n",
+                        svc->deps[d], svc->name);
+                continue;
+            }
+            counts[idx]++;
+            total++;
+            if (!services[idx]->released)
+                svc->pending_deps++;
+        }
+    }
+
+    if (edges_reserve(total) < 0) {
+        fprintf(stderr, "Error: Out of memory building dependency graph\n");
+        free(counts);
+        return;
+    }
+
+    int offset = 0;
+    for (int i = 0; i < service_count; i++) {
+        services[i]->first_dependent = offset;
+        services[i]->dependent_count = 0;
+        offset += counts[i];
+    }
+
+    for (int i = 0; i < service_count; i++) {
+        service_t *svc = services[i];
+        for (int d = 0; d < svc->dep_count; d++) {
+            int idx = svc->dep_idx[d];
+            if (idx < 0)
+                continue;
+            service_t *dep = services[idx];
+            dependent_edges[dep->first_dependent + dep->dependent_count++] = i;
+        }
+    }
+    free(counts);
+}
+
+/**
+ * Report services that can never start because of a dependency cycle
+ *
+ * Runs Kahn's algorithm on a copy of the in-degrees; anything left over
+ * is either on a cycle or depends on one. Those services are marked
+ * failed so they are reported once instead of silently never starting.
+ */
+static void detect_dependency_cycles(void) {
+    int n = service_count ? service_count : 1;
+    int *indegree = malloc(n * sizeof(int));
+    int *queue = malloc(n * sizeof(int));
+    int *seen = malloc(n * sizeof(int));
+    int head = 0, tail = 0;
+    int visited = 0;
+
+    if (!indegree || !queue || !seen) {
+        free(indegree);
+        free(queue);
+        free(seen);
+        return;
+    }
+
+    for (int i = 0; i < service_count; i++) {
+        /* Mounts and devices are not part of the graph; only service edges form cycles */
+        indegree[i] = services[i]->pending_deps - services[i]->pending_waits;
+        if (indegree[i] == 0)
+            queue[tail++] = i;
+    }
+
+    while (head < tail) {
+        service_t *svc = services[queue[head++]];
+        visited++;
+        for (int e = 0; e < svc->dependent_count; e++) {
+            int next = dependent_edges[svc->first_dependent + e];
+            if (--indegree[next] == 0)
+                queue[tail++] = next;
+        }
+    }
+
+    for (int i = 0; i < service_count && visited < service_count; i++) {
+        if (indegree[i] == 0)
+            continue;
+
+        /* Walk unresolved dependencies until a service repeats */
+        memset(seen, 0, n * sizeof(int));
+        int cur = i;
+        while (!seen[cur]) {
+            seen[cur] = 1;
+            service_t *svc = services[cur];
+            for (int d = 0; d < svc->dep_count; d++) {
+                int idx = svc->dep_idx[d];
+                if (idx >= 0 && indegree[idx] > 0) {
+                    cur = idx;
+                    break;
+                }
+            }
+        }
+
+        fprintf(stderr, "Error: Service %s blocked by dependency cycle:", services[i]->name);
+        int start = cur;
+        do {
+            fprintf(stderr, " %s ->", services[cur]->name);
+            service_t *svc = services[cur];
+            for (int d = 0; d < svc->dep_count; d++) {
+                int idx = svc->dep_idx[d];
+                if (idx >= 0 && indegree[idx] > 0) {
+                    cur = idx;
+                    break;
+                }
+            }
+        } while (cur != start);
+        fprintf(stderr, " %s\n", services[start]->name);
+
+        services[i]->state = SERVICE_FAILED;
+    }
+
+    free(indegree);
+    free(queue);
+    free(seen);
+}
+
+/**
+ * Order of the ready queue: priority, then services more others wait
+ * for, then first come first served
+ */
+static int ready_before(int a, int b) {
+    const service_t *x = services[a];
+    const service_t *y = services[b];
+
+    if (x->priority != y->priority)
+        return x->priority > y->priority;
+    if (x->dependent_count != y->dependent_count)
+        return x->dependent_count > y->dependent_count;
+    return (int32_t)(x->ready_seq - y->ready_seq) < 0;
+}
+
+/**
+ * Queue a service whose dependencies are all up
+ */
+static void queue_ready(service_t *svc) {
+    if (svc->queued)
+        return;
+    svc->queued = 1;
+    svc->ready_seq = ready_seq++;
+
+    int i = ready_count++;
+    while (i > 0 && ready_before(svc->index, ready_queue[(i - 1) / 2])) {
+        ready_queue[i] = ready_queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    ready_queue[i] = svc->index;
+}
+
+/**
+ * Remove and return the first service in the ready queue
+ */
+static service_t *ready_pop(void) {
+    service_t *top = services[ready_queue[0]];
+    int last = ready_queue[--ready_count];
+    int i = 0;
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= ready_count)
+            break;
+        if (child + 1 < ready_count && ready_before(ready_queue[child + 1], ready_queue[child]))
+            child++;
+        if (!ready_before(ready_queue[child], last))
+            break;
+        ready_queue[i] = ready_queue[child];
+        i = child;
+    }
+    ready_queue[i] = last;
+
+    top->queued = 0;
+    return top;
+}
+
+/**
+ * Read the cumulative "some" stall time from a /proc/pressure file
+ */
+static int read_stall_total(const char *path, uint64_t *total) {
+    char buf[256];
+    unsigned long long us;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+
+    if (sscanf(buf, "some avg10=%*f avg60=%*f avg300=%*f total=%llu", &us) != 1)
+        return -1;
+    *total = us;
+    return 0;
+}
+
+/**
+ * Adjust the number of start slots to the pressure the system is under
+ *
+ * Starts at one slot per CPU. Stall time is the difference between two
+ * readings of the PSI totals, so each sample covers the last
+ * ADMIT_SAMPLE_MS rather than a 10 s average. When CPU or I/O stalls
+ * exceed ADMIT_PRESSURE_HIGH percent the budget halves; while both stay
+ * under ADMIT_PRESSURE_LOW and services wait for a slot it doubles, up to
+ * ADMIT_MAX_PER_CPU slots per CPU. Without PSI, or with ICENET_NO_PSI
+ * set in init's environment (e.g. on the kernel command line), the budget
+ * stays at one slot per CPU.
+ */
+static void admit_update(void) {
+    uint64_t now = monotonic_ms();
+    uint64_t cpu, io;
+
+    if (admit_budget == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        admit_budget = cpus > 0 ? (int)cpus : 1;
+        admit_limit = admit_budget * ADMIT_MAX_PER_CPU;
+        admit_psi = !getenv("ICENET_NO_PSI") &&
+                    read_stall_total("/proc/pressure/cpu", &admit_stall_us[0]) == 0 &&
+                    read_stall_total("/proc/pressure/io", &admit_stall_us[1]) == 0;
+        admit_sampled_ms = now;
+        return;
+    }
+    if (!admit_psi || now - admit_sampled_ms < ADMIT_SAMPLE_MS)
+        return;
+
+    if (read_stall_total("/proc/pressure/cpu", &cpu) < 0 ||
+        read_stall_total("/proc/pressure/io", &io) < 0) {
+        admit_psi = 0;
+        return;
+    }
+
+    uint64_t window_us = (now - admit_sampled_ms) * 1000;
+    uint64_t stall = cpu - admit_stall_us[0];
+    if (io - admit_stall_us[1] > stall)
+        stall = io - admit_stall_us[1];
+    uint64_t pct = stall * 100 / window_us;
+
+    admit_stall_us[0] = cpu;
+    admit_stall_us[1] = io;
+    admit_sampled_ms = now;
+
+    if (pct >= ADMIT_PRESSURE_HIGH) {
+        admit_budget = admit_budget > 1 ? admit_budget / 2 : 1;
+    } else if (pct < ADMIT_PRESSURE_LOW && ready_count > 0 &&
+               admit_running >= admit_budget) {
+        admit_budget = admit_budget * 2 < admit_limit ? admit_budget * 2 : admit_limit;
+    }
+}
+
+/**
+ * Give back a service's start slot once it is up, has exited or has had
+ * ADMIT_SLOT_MS to get going
+ *
+ * With PSI, a ready=started service keeps its slot until the next pressure
+ * sample instead, so that the load it causes is seen before the budget is
+ * spent again.
+ */
+static void admit_release(service_t *svc) {
+    if (!svc->admitted)
+        return;
+    svc->admitted = 0;
+    admit_running--;
+    start_ready_services();
+}
+
+/**
+ * Expire start slots and admit waiting services while any are queued
+ */
+static void admit_timer_fired(watch_t *w, uint32_t events) {
+    (void)events;
+
+    uint64_t expirations;
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+    admit_timer_armed = 0;
+
+    /* Sample first, so started services count against the pressure they caused */
+    admit_update();
+
+    uint64_t now = monotonic_ms();
+    for (int i = 0; i < service_count && admit_running > 0; i++) {
+        service_t *svc = services[i];
+        int sampled = svc->ready == READY_STARTED && svc->state == SERVICE_RUNNING &&
+                      svc->started_ms < admit_sampled_ms;
+        if (svc->admitted && (sampled || now - svc->started_ms >= ADMIT_SLOT_MS)) {
+            svc->admitted = 0;
+            admit_running--;
+        }
+    }
+    start_ready_services();
+}
+
+/**
+ * Launch queued services while start slots are free
+ *
+ * Services released while draining are queued and launched in the same
+ * pass, so a whole wave of independent services starts at once, as far
+ * as the budget allows. The rest wait for slots to be given back.
+ */
+static void start_ready_services(void) {
+    static int draining = 0;
+    if (draining || shutdown_requested)
+        return;
+
+    draining = 1;
+    while (ready_count > 0) {
+        service_t *svc = services[ready_queue[0]];
+        int startable = svc->state == SERVICE_STOPPED && (!svc->lazy || svc->activated);
+
+        if (startable) {
+            admit_update();
+            if (admit_running >= admit_budget)
+                break;
+        }
+
+        ready_pop();
+        if (svc->state != SERVICE_STOPPED || svc->removed)
+            continue;
+
+        if (svc->lazy && !svc->activated) {
+            poll_listen_sockets(svc, 1);
+            continue;
+        }
+        svc->admitted = 1;
+        admit_running++;
+        start_service(svc);
+    }
+    draining = 0;
+
+    if (ready_count > 0 && !admit_timer_armed &&
+        timer_arm(&admit_timer, ADMIT_SAMPLE_MS, admit_timer_fired, NULL) == 0)
+        admit_timer_armed = 1;
+}
+
+/**
+ * Mark a service as failed and report the dependents it strands
+ */
+static void service_failed(service_t *svc) {
+    svc->state = SERVICE_FAILED;
+    admit_release(svc);
+
+    if (svc->released || shutdown_requested)
+        return;
+
+    for (int e = 0; e < svc->dependent_count; e++) {
+        service_t *dep = services[dependent_edges[svc->first_dependent + e]];
+        if (dep->state == SERVICE_STOPPED) {
+            fprintf(stderr, "Warning: Service %s not started, dependency %s failed\n",
+                    dep->name, svc->name);
+        }
+    }
+}
+
+/**
+ * Mark a service as up and release its dependents
+ */
+static void service_up(service_t *svc) {
+    trace_event(TRACE_READY, svc->index, svc->pid, 0, NULL);
+    svc->state = SERVICE_RUNNING;
+
+    /*
+     * Forked is not the same as initialized: with PSI, ready=started keeps
+     * its slot until the next sample. Without PSI the budget cannot adapt,
+     * and holding the slot would only serialize independent services.
+     */
+    if (svc->ready != READY_STARTED || !admit_psi)
+        admit_release(svc);
+    release_dependents(svc);
+}
+
+/**
+ * Release the dependents of a service that came up
+ */
+static void release_dependents(service_t *svc) {
+    /* A respawned service must not release its dependents twice */
+    if (svc->released)
+        return;
+    svc->released = 1;
+
+    for (int e = 0; e < svc->dependent_count; e++) {
+        service_t *dep = services[dependent_edges[svc->first_dependent + e]];
+        if (--dep->pending_deps == 0 && dep->state == SERVICE_STOPPED)
+            queue_ready(dep);
+    }
+    start_ready_services();
+}
+
+/* Everything the spawned child needs, prepared by the parent */
+typedef struct {
+    service_t *svc;
+    int notify_fd;              /* Readiness socket, -1 if none */
+    int log_fd;                 /* Becomes stdout and stderr, -1 to keep init's */
+    char **envp;
+    char listen_pid[32];        /* "LISTEN_PID=" filled in by the child */
+} spawn_t;
+
+/* The child borrows this stack only until it calls exec */
+static char spawn_stack[SPAWN_STACK_SIZE] __attribute__((aligned(16)));
+
+/**
+ * Report a failure from the spawned child without touching stdio
+ */
+static void spawn_error(const char *what, const char *name) {
+    struct iovec iov[4] = {
+        { (void *)"icenet-init: ", 13 },
+        { (void *)what, strlen(what) },
+        { (void *)name, strlen(name) },
+        { (void *)"\n", 1 },
+    };
+    if (writev(STDERR_FILENO, iov, 4) < 0) {
+        /* Nowhere left to report it */
+    }
+}
+
+/**
+ * Child side of a spawn, running in init's memory until it execs
+ *
+ * The parent is suspended meanwhile (CLONE_VFORK), so only async-signal-
+ * safe calls are allowed and nothing may be allocated: the heap and
+ * globals are shared with init.
+ */
+static int spawn_child(void *arg) {
+    spawn_t *sp = arg;
+    service_t *svc = sp->svc;
+
+    /* Signals blocked for the signalfd must not stay blocked */
+    sigprocmask(SIG_UNBLOCK, &init_sigmask, NULL);
+
+    /* Join the service cgroup before exec so every descendant is tracked */
+    if (svc->cgroup_fd >= 0) {
+        int procs = openat(svc->cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (procs < 0 || write(procs, "0", 1) < 0)
+            spawn_error("cannot join cgroup of ", svc->name);
+        if (procs >= 0)
+            close(procs);
+    }
+
+    /* Before the sockets are placed, which may reuse the pipe's fd number */
+    if (sp->log_fd >= 0) {
+        dup2(sp->log_fd, STDOUT_FILENO);
+        dup2(sp->log_fd, STDERR_FILENO);
+    }
+
+    if (svc->listen_count > 0 || sp->notify_fd >= 0)
+        pass_listen_sockets(svc, sp->notify_fd);
+
+    /* Decimal PID without stdio */
+    char digits[16];
+    int n = 0;
+    for (pid_t pid = getpid(); pid > 0; pid /= 10)
+        digits[n++] = (char)('0' + pid % 10);
+    char *p = sp->listen_pid + strlen("LISTEN_PID=");
+    while (n > 0)
+        *p++ = digits[--n];
+    *p = '\0';
+
+    if (svc->workdir[0] && chdir(svc->workdir) < 0) {
+        spawn_error("cannot enter workdir of ", svc->name);
+        _exit(1);
+    }
+
+    /* The trace counters are shared with init, which keeps them accurate */
+    trace_event(TRACE_EXEC, svc->index, getpid(), 0, NULL);
+    execvpe(svc->args[0], svc->args, sp->envp);
+
+    spawn_error("cannot execute ", svc->args[0]);
+    _exit(1);
+}
+
+/**
+ * Build the environment of a service: init's own, overridden by env=
+ * keys and the socket activation and readiness variables
+ *
+ * Returns a malloc'd array whose entries point into svc, buf and environ.
+ */
+static char **build_service_env(service_t *svc, spawn_t *sp, char *buf, size_t size) {
+    extern char **environ;
+    int inherited = 0;
+
+    while (environ[inherited])
+        inherited++;
+
+    char **envp = malloc((inherited + svc->env_count + 4) * sizeof(char *));
+    if (!envp)
+        return NULL;
+
+    int n = 0;
+    for (int i = 0; i < svc->env_count; i++)
+        envp[n++] = svc->env[i];
+
+    int fds = 0;
+    for (int j = 0; j < svc->listen_count; j++) {
+        if (svc->listens[j].watch.fd >= 0)
+            fds++;
+    }
+    if (fds > 0) {
+        int len = snprintf(buf, size, "LISTEN_FDS=%d", fds);
+        envp[n++] = buf;
+        buf += len + 1;
+        size -= len + 1;
+        strcpy(sp->listen_pid, "LISTEN_PID=");
+        envp[n++] = sp->listen_pid;
+    }
+    if (sp->notify_fd >= 0) {
+        /* pass_listen_sockets() puts it right after the listening sockets */
+        snprintf(buf, size, "NOTIFY_FD=%d", LISTEN_FDS_START + fds);
+        envp[n++] = buf;
+    }
+
+    int overrides = n;
+    for (int i = 0; i < inherited; i++) {
+        size_t name_len = strcspn(environ[i], "=");
+        int shadowed = 0;
+        for (int j = 0; j < overrides && !shadowed; j++) {
+            shadowed = strncmp(envp[j], environ[i], name_len) == 0 &&
+                       envp[j][name_len] == '=';
+        }
+        if (!shadowed)
+            envp[n++] = environ[i];
+    }
+    envp[n] = NULL;
+    return envp;
+}
+
+/**
+ * Start a service
+ *
+ * The child is created with clone(CLONE_VM | CLONE_VFORK), so init's
+ * memory is never copied, and CLONE_PIDFD returns a pidfd that keeps
+ * signals from reaching a recycled PID.
+ */
+static void start_service(service_t *svc) {
+    /* Pending respawns and activations are dropped once shutdown begins */
+    if (shutdown_requested)
+        return;
+
+    printf("Starting service: %s\n", svc->name);
+
+    svc->state = SERVICE_STARTING;
+    svc->started_ms = monotonic_ms();
+    svc->stop_requested = 0;
+    svc->killed = 0;
+    service_cgroup_open(svc);
+
+    /* Readiness channel: init keeps sv[0], the service inherits sv[1] */
+    int sv[2] = { -1, -1 };
+    if (svc->ready == READY_NOTIFY &&
+        socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        service_failed(svc);
+        return;
+    }
+
+    /* Output pipe: init drains out[0], the service writes to out[1] */
+    int out[2] = { -1, -1 };
+    if (svc->log_mode != LOG_CONSOLE) {
+        /* Cut off whatever an earlier run left holding the old pipe */
+        if (svc->log_watch.fd >= 0) {
+            handle_log(&svc->log_watch, 0);
+            watch_close(&svc->log_watch);
+        }
+        if (pipe2(out, O_CLOEXEC) < 0) {
+            perror("pipe2");
+            out[0] = out[1] = -1;
+        } else {
+            fcntl(out[0], F_SETFL, O_NONBLOCK);
+        }
+    }
+
+    spawn_t sp;
+    char envbuf[64];
+    sp.svc = svc;
+    sp.notify_fd = sv[1];
+    sp.log_fd = out[1];
+    sp.envp = build_service_env(svc, &sp, envbuf, sizeof(envbuf));
+
+    /* Logged before spawning: the child reaches exec before we return */
+    trace_event(TRACE_FORK, svc->index, 0, 0, NULL);
+
+    int pidfd = -1;
+    pid_t pid = -1;
+    if (sp.envp) {
+        pid = clone(spawn_child, spawn_stack + sizeof(spawn_stack),
+                    CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, &sp, &pidfd);
+
+        /* Kernels before 5.2 lack pidfds; signal by PID there */
+        if (pid < 0 && errno == EINVAL) {
+            pidfd = -1;
+            pid = clone(spawn_child, spawn_stack + sizeof(spawn_stack),
+                        CLONE_VM | CLONE_VFORK | SIGCHLD, &sp);
+        }
+    }
+    free(sp.envp);
+
+    if (pid < 0) {
+        perror("clone");
+        if (sv[0] >= 0) {
+            close(sv[0]);
+            close(sv[1]);
+        }
+        if (out[0] >= 0) {
+            close(out[0]);
+            close(out[1]);
+        }
+        service_failed(svc);
+        return;
+    }
+
+    svc->pid = pid;
+    svc->pidfd = pidfd;
+    if (pidfd >= 0)
+        fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+    pid_index_insert(svc);
+
+    /* The service owns its listening sockets while it runs */
+    poll_listen_sockets(svc, 0);
+
+    if (sv[0] >= 0) {
+        close(sv[1]);
+        if (watch_add(&svc->notify_watch, sv[0], EPOLLIN, handle_notify, svc) < 0) {
+            close(sv[0]);
+            svc->notify_watch.fd = -1;
+        }
+    }
+
+    if (out[0] >= 0) {
+        close(out[1]);
+        if (watch_add(&svc->log_watch, out[0], EPOLLIN, handle_log, svc) < 0) {
+            close(out[0]);
+            svc->log_watch.fd = -1;
+        }
+    }
+
+    if (svc->ready == READY_STARTED)
+        service_up(svc);
+}
+
+/**
+ * Create a listening socket from a listen= specification
+ *
+ * Accepted forms are tcp:PORT, tcp:ADDR:PORT, udp:PORT, udp:ADDR:PORT
+ * (IPv6 addresses in brackets) and unix:PATH. A bare port listens on all
+ * IPv4 and IPv6 addresses.
+ */
+static int open_listen_socket(const char *spec) {
+    int type;
+    const char *rest;
+
+    if (strncmp(spec, "tcp:", 4) == 0) {
+        type = SOCK_STREAM;
+        rest = spec + 4;
+    } else if (strncmp(spec, "udp:", 4) == 0) {
+        type = SOCK_DGRAM;
+        rest = spec + 4;
+    } else if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(spec + 5) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sun.sun_path, spec + 5);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        unlink(sun.sun_path);
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+            listen(fd, SOMAXCONN) < 0) {
+            close(fd);
+            return -1;
+        }
+        chmod(sun.sun_path, 0666);
+        return fd;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Split optional address from port */
+    char addr[64] = "";
+    const char *port = rest;
+    if (rest[0] == '[') {
+        const char *end = strchr(rest, ']');
+        if (!end || end[1] != ':' || (size_t)(end - rest - 1) >= sizeof(addr)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(addr, rest + 1, end - rest - 1);
+        port = end + 2;
+    } else if (strchr(rest, ':')) {
+        const char *colon = strchr(rest, ':');
+        if ((size_t)(colon - rest) >= sizeof(addr)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(addr, rest, colon - rest);
+        port = colon + 1;
+    }
+
+    char *endp;
+    long portnum = strtol(port, &endp, 10);
+    if (*port == '\0' || *endp != '\0' || portnum < 0 || portnum > 65535) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    memset(&ss, 0, sizeof(ss));
+
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+    int family;
+
+    if (addr[0] && inet_pton(AF_INET, addr, &sin->sin_addr) == 1) {
+        family = AF_INET;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons((uint16_t)portnum);
+        sslen = sizeof(*sin);
+    } else if (!addr[0] || inet_pton(AF_INET6, addr, &sin6->sin6_addr) == 1) {
+        family = AF_INET6;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons((uint16_t)portnum);
+        if (!addr[0])
+            sin6->sin6_addr = in6addr_any;
+        sslen = sizeof(*sin6);
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = socket(family, type | SOCK_CLOEXEC, 0);
+    if (fd < 0 && family == AF_INET6 && !addr[0] && errno == EAFNOSUPPORT) {
+        /* Kernel built without IPv6 */
+        family = AF_INET;
+        memset(&ss, 0, sizeof(ss));
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons((uint16_t)portnum);
+        sin->sin_addr.s_addr = htonl(INADDR_ANY);
+        sslen = sizeof(*sin);
+        fd = socket(family, type | SOCK_CLOEXEC, 0);
+    }
+    if (fd < 0)
+        return -1;
+
+    int one = 1, zero = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (family == AF_INET6 && !addr[0])
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+    if (bind(fd, (struct sockaddr *)&ss, sslen) < 0 ||
+        (type == SOCK_STREAM && listen(fd, SOMAXCONN) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Bind the listening sockets of every service
+ *
+ * Once its sockets exist a service is as good as up for its dependents:
+ * connections queue in the kernel until the service accepts them, so
+ * dependents are released immediately.
+ */
+static void open_listen_sockets(void) {
+    open_listen_sockets_from(0);
+}
+
+/**
+ * Bind the listening sockets of services loaded from index first on
+ */
+static void open_listen_sockets_from(int first) {
+    /* Sockets closed by a reload must be gone before their addresses are bound again */
+    watch_flush_closed();
+
+    for (int i = first; i < service_count; i++) {
+        service_t *svc = services[i];
+        int opened = 0;
+
+        for (int j = 0; j < svc->listen_count; j++) {
+            listen_t *l = &svc->listens[j];
+
+            /* Kept across a re-exec */
+            if (l->watch.fd >= 0) {
+                opened++;
+                continue;
+            }
+            l->watch.fd = open_listen_socket(l->spec);
+            if (l->watch.fd < 0) {
+                fprintf(stderr, "Warning: Could not listen on %s for service %s: %s\n",
+                        l->spec, svc->name, strerror(errno));
+                continue;
+            }
+            opened++;
+        }
+
+        if (svc->lazy && opened == 0) {
+            fprintf(stderr, "Warning: Service %s has no sockets, starting it eagerly\n",
+                    svc->name);
+            svc->lazy = 0;
+        }
+
+        if (opened > 0 && opened == svc->listen_count)
+            release_dependents(svc);
+    }
+}
+
+/**
+ * Start or stop watching a service's sockets for activation
+ */
+static void poll_listen_sockets(service_t *svc, int enable) {
+    if (!svc->lazy)
+        return;
+
+    for (int j = 0; j < svc->listen_count; j++) {
+        listen_t *l = &svc->listens[j];
+        if (l->watch.fd < 0 || l->polled == enable)
+            continue;
+
+        if (enable) {
+            if (watch_add(&l->watch, l->watch.fd, EPOLLIN, handle_activation, svc) < 0)
+                continue;
+        } else {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, l->watch.fd, NULL);
+            watch_retire(&l->watch);
+        }
+        l->polled = enable;
+    }
+}
+
+/**
+ * Start a lazy service on its first incoming connection
+ */
+static void handle_activation(watch_t *w, uint32_t events) {
+    (void)events;
+    service_t *svc = w->data;
+
+    /* Stop polling; the connection stays queued for the service */
+    poll_listen_sockets(svc, 0);
+    svc->activated = 1;
+
+    if (svc->state == SERVICE_STOPPED && svc->pending_deps == 0) {
+        printf("Activating service %s on incoming connection\n", svc->name);
+        start_service(svc);
+    }
+}
+
+/**
+ * Move a service's listening sockets to fds 3.. in the child
+ *
+ * Follows the LISTEN_FDS convention, with the readiness socket placed
+ * right after the listening sockets. Everything is first duplicated above
+ * the target range so that no dup2() clobbers a descriptor that still has
+ * to be moved. The environment describing them is built by the parent.
+ */
+static void pass_listen_sockets(service_t *svc, int notify_fd) {
+    int count = 0;
+    int moved[MAX_LISTEN];
+    int high = LISTEN_FDS_START + svc->listen_count + 1;
+
+    for (int j = 0; j < svc->listen_count; j++) {
+        if (svc->listens[j].watch.fd >= 0)
+            moved[count++] = fcntl(svc->listens[j].watch.fd, F_DUPFD_CLOEXEC, high);
+    }
+
+    int notify_moved = notify_fd >= 0 ? fcntl(notify_fd, F_DUPFD_CLOEXEC, high) : -1;
+
+    for (int j = 0; j < count; j++) {
+        dup2(moved[j], LISTEN_FDS_START + j);
+        close(moved[j]);
+    }
+
+    if (notify_moved >= 0) {
+        dup2(notify_moved, LISTEN_FDS_START + count);
+        close(notify_moved);
+    }
+}
+
+/**
+ * Write a value to a cgroup interface file
+ */
+static int cgroup_write(int dir_fd, const char *file, const char *value) {
+    int fd = openat(dir_fd, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    ssize_t n = write(fd, value, strlen(value));
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return n < 0 ? -1 : 0;
+}
+
+/**
+ * Read a cgroup interface file into buf
+ */
+static int cgroup_read(int dir_fd, const char *file, char *buf, size_t size) {
+    int fd = openat(dir_fd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    buf[n] = '\0';
+    return 0;
+}
+
+/**
+ * Mount cgroup v2 and create the parent cgroup for services
+ *
+ * init itself stays in the root cgroup, which is exempt from the
+ * no-internal-processes rule, so controllers can be delegated down to
+ * CGROUP_SERVICES and from there to each service.
+ */
+static void setup_cgroups(void) {
+    struct statfs sfs;
+
+    mkdir(CGROUP_ROOT, 0755);
+    if (statfs(CGROUP_ROOT, &sfs) < 0 || sfs.f_type != CGROUP2_MAGIC) {
+        if (mount("cgroup2", CGROUP_ROOT, "cgroup2",
+                  MS_NOSUID | MS_NOEXEC | MS_NODEV, NULL) < 0) {
+            perror("Failed to mount " CGROUP_ROOT);
+            return;
+        }
+    }
+
+    if (mkdir(CGROUP_SERVICES, 0755) < 0 && errno != EEXIST) {
+        perror("Failed to create " CGROUP_SERVICES);
+        return;
+    }
+
+    int root_fd = open(CGROUP_ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    cgroup_services_fd = open(CGROUP_SERVICES, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0 || cgroup_services_fd < 0) {
+        perror("Failed to open " CGROUP_SERVICES);
+        if (root_fd >= 0)
+            close(root_fd);
+        return;
+    }
+
+    /* Controllers the kernel lacks are skipped one by one */
+    static const char *controllers[] = { "+cpu", "+memory", "+io", "+pids" };
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        cgroup_write(root_fd, "cgroup.subtree_control", controllers[i]);
+        cgroup_write(cgroup_services_fd, "cgroup.subtree_control", controllers[i]);
+    }
+    close(root_fd);
+}
+
+/**
+ * Create a service's cgroup and apply its resource settings
+ */
+static int service_cgroup_open(service_t *svc) {
+    if (cgroup_services_fd < 0)
+        return -1;
+    if (svc->cgroup_fd >= 0)
+        return 0;
+
+    if (mkdirat(cgroup_services_fd, svc->name, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Warning: Could not create cgroup for %s: %s\n",
+                svc->name, strerror(errno));
+        return -1;
+    }
+
+    svc->cgroup_fd = openat(cgroup_services_fd, svc->name,
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (svc->cgroup_fd < 0)
+        return -1;
+
+    for (int i = 0; i < svc->cgroup_setting_count; i++) {
+        cgroup_setting_t *cs = &svc->cgroup_settings[i];
+        if (cgroup_write(svc->cgroup_fd, cs->key, cs->value) < 0) {
+            fprintf(stderr, "Warning: Could not set %s=%s for %s: %s\n",
+                    cs->key, cs->value, svc->name, strerror(errno));
+        }
+    }
+    return 0;
+}
+
+/**
+ * Signal a service
+ *
+ * SIGKILL goes through cgroup.kill when available so that processes the
+ * service forked or daemonized are killed along with it.
+ */
+static void service_kill(service_t *svc, int sig) {
+    if (sig == SIGKILL && svc->cgroup_fd >= 0 &&
+        cgroup_write(svc->cgroup_fd, "cgroup.kill", "1") == 0) {
+        return;
+    }
+
+    if (svc->pidfd >= 0)
+        syscall(SYS_pidfd_send_signal, svc->pidfd, sig, NULL, 0);
+    else if (svc->pid > 0)
+        kill(svc->pid, sig);
+}
+
+/**
+ * Parse the "some avg10" figure from a PSI file
+ */
+static double read_pressure(int dir_fd, const char *file) {
+    char buf[256];
+    double avg10 = 0.0;
+
+    if (cgroup_read(dir_fd, file, buf, sizeof(buf)) == 0)
+        sscanf(buf, "some avg10=%lf", &avg10);
+    return avg10;
+}
+
+/**
+ * Read CPU time, peak memory and pressure of a service
+ */
+static int cgroup_read_stats(service_t *svc, cgroup_stats_t *st) {
+    char buf[512];
+
+    if (svc->cgroup_fd < 0)
+        return -1;
+
+    memset(st, 0, sizeof(*st));
+
+    if (cgroup_read(svc->cgroup_fd, "cpu.stat", buf, sizeof(buf)) == 0) {
+        char *p = strstr(buf, "usage_usec ");
+        if (p)
+            st->cpu_usec = strtoull(p + 11, NULL, 10);
+    }
+
+    /* memory.peak needs Linux 5.19; fall back to current usage */
+    if (cgroup_read(svc->cgroup_fd, "memory.peak", buf, sizeof(buf)) == 0 ||
+        cgroup_read(svc->cgroup_fd, "memory.current", buf, sizeof(buf)) == 0) {
+        st->memory_peak = strtoull(buf, NULL, 10);
+    }
+
+    st->cpu_pressure = read_pressure(svc->cgroup_fd, "cpu.pressure");
+    st->memory_pressure = read_pressure(svc->cgroup_fd, "memory.pressure");
+    st->io_pressure = read_pressure(svc->cgroup_fd, "io.pressure");
+    return 0;
+}
+
+/**
+ * Human readable service state
+ */
+static const char *state_name(service_state_t state) {
+    switch (state) {
+        case SERVICE_STOPPED:  return "stopped";
+        case SERVICE_STARTING: return "starting";
+        case SERVICE_RUNNING:  return "running";
+        case SERVICE_EXITED:   return "exited";
+        case SERVICE_FAILED:   return "failed";
+    }
+    return "unknown";
+}
+
+/**
+ * Escalate to SIGKILL when a stopped service ignores SIGTERM
+ */
+static void stop_timer_fired(watch_t *w, uint32_t events) {
+    (void)events;
+
+    uint64_t expirations;
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    service_t *svc = w->data;
+    if (svc->pid <= 0)
+        return;
+
+    if (!svc->killed) {
+        printf("Service %s did not stop in time, killing it\n", svc->name);
+        svc->killed = 1;
+        service_kill(svc, SIGKILL);
+        timer_arm(&svc->stop_timer, KILL_TIMEOUT_MS, stop_timer_fired, svc);
+        return;
+    }
+
+    /* Stuck in the kernel; do not hold up shutdown for it */
+    fprintf(stderr, "Warning: Service %s (PID %d) survived SIGKILL\n", svc->name, svc->pid);
+    if (stopping)
+        shutdown_service_done(svc);
+}
+
+/**
+ * Stop a service on request, without respawning it
+ */
+static void service_stop(service_t *svc) {
+    svc->stop_requested = 1;
+    svc->reloading = 0;
+    timer_disarm(&svc->respawn_timer);
+    poll_listen_sockets(svc, 0);
+
+    if (svc->pid > 0) {
+        printf("Stopping service %s (PID %d)\n", svc->name, svc->pid);
+        service_kill(svc, SIGTERM);
+        timer_arm(&svc->stop_timer, svc->stop_timeout, stop_timer_fired, svc);
+    } else if (svc->state != SERVICE_EXITED) {
+        svc->state = SERVICE_STOPPED;
+    }
+}
+
+/**
+ * Start a service on request, clearing any failure history
+ */
+static int service_start(service_t *svc, char *err, size_t errlen) {
+    if (svc->pid > 0) {
+        snprintf(err, errlen, "%s is already running", svc->name);
+        return -1;
+    }
+    if (svc->pending_deps > 0) {
+        snprintf(err, errlen, "%s is waiting for its dependencies", svc->name);
+        return -1;
+    }
+
+    timer_disarm(&svc->respawn_timer);
+    memset(svc->failures, 0, sizeof(svc->failures));
+    svc->backoff_level = 0;
+    svc->activated = 1;
+    svc->state = SERVICE_STOPPED;
+    start_service(svc);
+    return 0;
+}
+
+/* What a reload changed, for the log and the control reply */
+typedef struct {
+    int added;
+    int removed;
+    int restarted;              /* Including dependents of changed services */
+    int updated;                /* Changed settings only, applied in place */
+} reload_stats_t;
+
+/**
+ * Whether two definitions of a service start different processes
+ *
+ * Anything that shapes the process, its environment or its place in the
+ * dependency graph counts; respawn, stop and priority settings do not.
+ */
+static int service_launch_differs(const service_t *a, const service_t *b) {
+    if (strcmp(a->exec, b->exec) != 0 || strcmp(a->workdir, b->workdir) != 0 ||
+        a->ready != b->ready || a->lazy != b->lazy || a->log_mode != b->log_mode ||
+        a->env_count != b->env_count || a->dep_count != b->dep_count ||
+        a->listen_count != b->listen_count || a->mount_req_count != b->mount_req_count ||
+        a->device_req_count != b->device_req_count ||
+        a->cgroup_setting_count != b->cgroup_setting_count)
+        return 1;
+
+    for (int i = 0; i < a->env_count; i++) {
+        if (strcmp(a->env[i], b->env[i]) != 0)
+            return 1;
+    }
+    for (int i = 0; i < a->dep_count; i++) {
+        if (strcmp(a->deps[i], b->deps[i]) != 0)
+            return 1;
+    }
+    for (int i = 0; i < a->listen_count; i++) {
+        if (strcmp(a->listens[i].spec, b->listens[i].spec) != 0)
+            return 1;
+    }
+    for (int i = 0; i < a->mount_req_count; i++) {
+        if (strcmp(a->mount_reqs[i], b->mount_reqs[i]) != 0)
+            return 1;
+    }
+    for (int i = 0; i < a->device_req_count; i++) {
+        if (strcmp(a->device_reqs[i], b->device_reqs[i]) != 0)
+            return 1;
+    }
+    for (int i = 0; i < a->cgroup_setting_count; i++) {
+        if (strcmp(a->cgroup_settings[i].key, b->cgroup_settings[i].key) != 0 ||
+            strcmp(a->cgroup_settings[i].value, b->cgroup_settings[i].value) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int service_settings_differ(const service_t *a, const service_t *b) {
+    return a->respawn != b->respawn || a->respawn_delay != b->respawn_delay ||
+           a->respawn_max_delay != b->respawn_max_delay ||
+           a->respawn_jitter != b->respawn_jitter || a->respawn_limit != b->respawn_limit ||
+           a->respawn_window != b->respawn_window || a->stop_timeout != b->stop_timeout ||
+           a->priority != b->priority;
+}
+
+/**
+ * Replace the definition of a loaded service, keeping its runtime state
+ *
+ * A running process keeps what it was started with; the new definition
+ * applies from its next start. Sockets whose specs changed are closed and
+ * bound again by open_listen_sockets_from().
+ */
+static void service_redefine(service_t *svc, const service_t *def) {
+    int listens_changed = svc->listen_count != def->listen_count;
+    for (int i = 0; !listens_changed && i < svc->listen_count; i++)
+        listens_changed = strcmp(svc->listens[i].spec, def->listens[i].spec) != 0;
+
+    if (listens_changed) {
+        poll_listen_sockets(svc, 0);
+        for (int i = 0; i < svc->listen_count; i++)
+            watch_close(&svc->listens[i].watch);
+        memcpy(svc->listens, def->listens, sizeof(svc->listens));
+        svc->listen_count = def->listen_count;
+    }
+
+    int waits_changed = svc->mount_req_count != def->mount_req_count ||
+                        svc->device_req_count != def->device_req_count ||
+                        memcmp(svc->mount_reqs, def->mount_reqs, sizeof(svc->mount_reqs)) != 0 ||
+                        memcmp(svc->device_reqs, def->device_reqs, sizeof(svc->device_reqs)) != 0;
+
+    /* args point into argbuf, so split the copied exec again */
+    memcpy(svc->exec, def->exec, sizeof(svc->exec));
+    split_exec(svc);
+    memcpy(svc->env, def->env, sizeof(svc->env));
+    svc->env_count = def->env_count;
+    memcpy(svc->workdir, def->workdir, sizeof(svc->workdir));
+    memcpy(svc->deps, def->deps, sizeof(svc->deps));
+    svc->dep_count = def->dep_count;
+    memcpy(svc->cgroup_settings, def->cgroup_settings, sizeof(svc->cgroup_settings));
+    svc->cgroup_setting_count = def->cgroup_setting_count;
+    svc->ready = def->ready;
+    svc->lazy = def->lazy;
+    svc->log_mode = def->log_mode;
+    svc->priority = def->priority;
+    svc->respawn = def->respawn;
+    svc->respawn_delay = def->respawn_delay;
+    svc->respawn_max_delay = def->respawn_max_delay;
+    svc->respawn_jitter = def->respawn_jitter;
+    svc->respawn_limit = def->respawn_limit;
+    svc->respawn_window = def->respawn_window;
+    svc->stop_timeout = def->stop_timeout;
+
+    if (waits_changed) {
+        drop_service_waits(svc);
+        memcpy(svc->mount_reqs, def->mount_reqs, sizeof(svc->mount_reqs));
+        svc->mount_req_count = def->mount_req_count;
+        memcpy(svc->device_reqs, def->device_reqs, sizeof(svc->device_reqs));
+        svc->device_req_count = def->device_req_count;
+        resolve_service_mounts(svc);
+        resolve_service_devices(svc);
+    }
+}
+
+/**
+ * Stop a service whose file was deleted, for good
+ */
+static void service_remove(service_t *svc) {
+    printf("Removing service %s\n", svc->name);
+    service_stop(svc);
+    for (int i = 0; i < svc->listen_count; i++)
+        watch_close(&svc->listens[i].watch);
+    drop_service_waits(svc);
+
+    svc->removed = 1;
+    svc->listen_count = 0;
+    svc->dep_count = 0;
+    name_index_rebuild();
+}
+
+/**
+ * Restart a service whose definition, or a dependency's, changed
+ *
+ * Its dependents count it as down until it is up again, and it is queued
+ * once it has exited and its own dependencies are up. A service stopped
+ * by the operator stays stopped.
+ */
+static void reload_restart(service_t *svc) {
+    if (svc->stop_requested && !svc->reloading)
+        return;
+
+    svc->released = 0;
+    svc->restart_requested = 0;
+    svc->activated = 0;
+    svc->backoff_level = 0;
+    memset(svc->failures, 0, sizeof(svc->failures));
+    timer_disarm(&svc->respawn_timer);
+
+    if (svc->pid > 0) {
+        if (!svc->reloading) {
+            service_stop(svc);
+            svc->reloading = 1;
+        }
+    } else {
+        svc->state = SERVICE_STOPPED;
+    }
+}
+
+/**
+ * Compare one service file with the loaded definition and apply it
+ *
+ * def is scratch space. A missing file removes the service; a file that
+ * no longer parses leaves it as it is, e.g. while it is being written.
+ */
+static void reload_service_file(const char *name, service_t *def, reload_stats_t *st) {
+    char path[512];
+    struct stat sb;
+    int idx = find_service(name);
+
+    if (strlen(name) >= sizeof(def->name)) {
+        fprintf(stderr, "Warning: Service name %s is too long\n", name);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", service_dir, name);
+    if (stat(path, &sb) < 0) {
+        if (idx >= 0) {
+            service_remove(services[idx]);
+            st->removed++;
+        }
+        return;
+    }
+
+    if (parse_service_file(def, service_dir, name) < 0) {
+        fprintf(stderr, "Warning: Ignoring invalid service file %s\n", path);
+        return;
+    }
+
+    if (idx < 0) {
+        service_t *svc = service_slot();
+        if (!svc)
+            return;
+        *svc = *def;
+        split_exec(svc);
+        service_add(svc);
+        printf("  Loaded service: %s\n", svc->name);
+        st->added++;
+        return;
+    }
+
+    service_t *svc = services[idx];
+    if (service_launch_differs(svc, def)) {
+        service_redefine(svc, def);
+        svc->reload_mark = 1;
+    } else if (service_settings_differ(svc, def)) {
+        service_redefine(svc, def);
+        st->updated++;
+    }
+}
+
+/**
+ * Apply changed service files without touching unaffected services
+ *
+ * With names, only those files are compared; without, every file in the
+ * directory is, and services whose files are gone are removed. Added
+ * services are started, and services whose launch definition changed are
+ * restarted together with everything that depends on them, in dependency
+ * order.
+ */
+static void reload_services(char (*names)[64], int count, reload_stats_t *st) {
+    service_t *def = malloc(sizeof(*def));
+    int first = service_count;
+    char *seen = NULL;
+
+    memset(st, 0, sizeof(*st));
+    if (!def) {
+        fprintf(stderr, "Error: Out of memory reloading services\n");
+        return;
+    }
+
+    if (names) {
+        for (int i = 0; i < count; i++)
+            reload_service_file(names[i], def, st);
+    } else {
+        DIR *dir = opendir(service_dir);
+        seen = calloc(first ? first : 1, 1);
+        if (!dir || !seen) {
+            fprintf(stderr, "Warning: Could not reload %s\n", service_dir);
+            if (dir)
+                closedir(dir);
+            free(seen);
+            free(def);
+            return;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.')
+                continue;
+            reload_service_file(entry->d_name, def, st);
+            int idx = find_service(entry->d_name);
+            if (idx >= 0 && idx < first)
+                seen[idx] = 1;
+        }
+        closedir(dir);
+
+        for (int i = 0; i < first; i++) {
+            if (!seen[i] && !services[i]->removed) {
+                service_remove(services[i]);
+                st->removed++;
+            }
+        }
+        free(seen);
+    }
+    free(def);
+
+    int changed = 0;
+    for (int i = 0; i < service_count; i++)
+        changed |= services[i]->reload_mark;
+    if (!changed && st->added == 0 && st->removed == 0)
+        return;
+
+    resolve_mount_requirements(first);
+    resolve_device_requirements(first);
+    build_dependency_graph();
+
+    /* Everything downstream of a changed service restarts with it */
+    int *stack = malloc((service_count ? service_count : 1) * sizeof(int));
+    int top = 0;
+    for (int i = 0; stack && i < service_count; i++) {
+        if (services[i]->reload_mark)
+            stack[top++] = i;
+    }
+    while (top > 0) {
+        service_t *svc = services[stack[--top]];
+        for (int e = 0; e < svc->dependent_count; e++) {
+            int next = dependent_edges[svc->first_dependent + e];
+            if (!services[next]->reload_mark) {
+                services[next]->reload_mark = 1;
+                stack[top++] = next;
+            }
+        }
+    }
+    free(stack);
+
+    for (int i = 0; i < first; i++) {
+        if (services[i]->reload_mark && !services[i]->removed) {
+            printf("Restarting service %s for the new configuration\n", services[i]->name);
+            reload_restart(services[i]);
+            st->restarted++;
+        }
+    }
+
+    /* Dependents of restarted services wait for them again */
+    build_dependency_graph();
+    detect_dependency_cycles();
+    trace_services(first);
+    open_listen_sockets_from(0);
+
+    for (int i = 0; i < service_count; i++) {
+        service_t *svc = services[i];
+        if ((i >= first || svc->reload_mark) && svc->pid <= 0 && !svc->removed &&
+            !svc->stop_requested && svc->state == SERVICE_STOPPED && svc->pending_deps == 0)
+            queue_ready(svc);
+        svc->reload_mark = 0;
+    }
+    start_ready_services();
+}
+
+/**
+ * Apply the service files changed since the directory went quiet
+ */
+static void reload_timer_fired(watch_t *w, uint32_t events) {
+    (void)events;
+
+    uint64_t expirations;
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+    if (shutdown_requested)
+        return;
+
+    reload_stats_t st;
+    reload_services(reload_rescan ? NULL : reload_names, reload_name_count, &st);
+    reload_name_count = 0;
+    reload_rescan = 0;
+
+    if (st.added || st.removed || st.restarted || st.updated) {
+        printf("IceNet-Init: Reloaded services: %d added, %d removed, %d restarted, "
+               "%d updated\n", st.added, st.removed, st.restarted, st.updated);
+    }
+}
+
+/**
+ * Remember a changed service file until the reload
+ */
+static void reload_note(const char *name) {
+    for (int i = 0; i < reload_name_count; i++) {
+        if (strcmp(reload_names[i], name) == 0)
+            return;
+    }
+
+    if (reload_name_count == reload_name_capacity) {
+        int capacity = reload_name_capacity ? reload_name_capacity * 2 : 16;
+        char (*names)[64] = realloc(reload_names, capacity * sizeof(*names));
+        if (!names) {
+            reload_rescan = 1;
+            return;
+        }
+        reload_names = names;
+        reload_name_capacity = capacity;
+    }
+    snprintf(reload_names[reload_name_count++], sizeof(reload_names[0]), "%.63s", name);
+}
+
+/**
+ * Collect inotify events for the service directory
+ *
+ * Editors and config management write a file in several steps, so the
+ * reload waits until no event has arrived for RELOAD_DELAY_MS.
+ */
+static void handle_service_dir(watch_t *w, uint32_t events) {
+    (void)events;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW)
+                reload_rescan = 1;
+            else if (ev->len > 0 && ev->name[0] != '.')
+                reload_note(ev->name);
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+
+    timer_arm(&reload_timer, RELOAD_DELAY_MS, reload_timer_fired, NULL);
+}
+
+/**
+ * Watch the service directory so edits take effect without a reboot
+ */
+static void setup_service_watch(void) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        perror("inotify_init1");
+        return;
+    }
+
+    uint32_t mask = IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+    if (inotify_add_watch(fd, service_dir, mask) < 0) {
+        fprintf(stderr, "Warning: Cannot watch %s: %s\n", service_dir, strerror(errno));
+        close(fd);
+        return;
+    }
+    if (watch_add(&service_dir_watch, fd, EPOLLIN, handle_service_dir, NULL) < 0)
+        close(fd);
+}
+
+/* An accepted control connection, freed once answered */
+typedef struct {
+    watch_t watch;
+    uid_t uid;
+    char request[256];
+    size_t len;
+    buffer_t reply;             /* Answer, sent from offset sent on */
+    size_t sent;
+} control_conn_t;
+
+static void buffer_printf(buffer_t *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void buffer_printf(buffer_t *b, const char *fmt, ...) {
+    char line[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if (n > 0)
+        buffer_append(b, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+/**
+ * Describe one service for the status command
+ */
+static void control_status(buffer_t *out, service_t *svc) {
+    static const char *ready_names[] = { "started", "notify", "exit" };
+    static const char *log_names[] = { "memory", "file", "console" };
+
+    buffer_printf(out, "name: %s\n", svc->name);
+    buffer_printf(out, "state: %s\n", state_name(svc->state));
+    buffer_printf(out, "pid: %d\n", (int)svc->pid);
+    buffer_printf(out, "exec: %s\n", svc->exec);
+    buffer_printf(out, "ready: %s\n", ready_names[svc->ready]);
+    buffer_printf(out, "restarts: %d\n", svc->respawn_count);
+    buffer_printf(out, "priority: %d\n", svc->priority);
+    buffer_printf(out, "log: %s\n", log_names[svc->log_mode]);
+    if (svc->pid > 0) {
+        buffer_printf(out, "uptime: %.3fs\n",
+                      (double)(monotonic_ms() - svc->started_ms) / 1000.0);
+    }
+
+    for (int d = 0; d < svc->dep_count; d++) {
+        int idx = svc->dep_idx[d];
+        buffer_printf(out, "depends: %s (%s)\n", svc->deps[d],
+                      idx >= 0 ? state_name(services[idx]->state) : "missing");
+    }
+    for (int j = 0; j < svc->listen_count; j++) {
+        buffer_printf(out, "listen: %s%s\n", svc->listens[j].spec,
+                      svc->listens[j].watch.fd < 0 ? " (not bound)" : "");
+    }
+
+    cgroup_stats_t st;
+    if (cgroup_read_stats(svc, &st) == 0) {
+        buffer_printf(out, "cpu: %.3fs\n", (double)st.cpu_usec / 1e6);
+        buffer_printf(out, "memory-peak: %llu\n", (unsigned long long)st.memory_peak);
+        buffer_printf(out, "pressure: cpu=%.2f memory=%.2f io=%.2f\n",
+                      st.cpu_pressure, st.memory_pressure, st.io_pressure);
+    }
+}
+
+/**
+ * Copy a service's recorded output for the log command
+ *
+ * Once the ring has wrapped, its oldest line is partial and is skipped.
+ */
+static void control_log(buffer_t *out, service_t *svc) {
+    /* Include what is still in the pipe */
+    if (svc->log_watch.fd >= 0)
+        handle_log(&svc->log_watch, 0);
+
+    uint64_t from = log_oldest(svc);
+    int skip = from > 0;
+    const char *data;
+    size_t len;
+
+    while ((len = log_chunk(svc, from, &data)) > 0) {
+        from += len;
+        if (skip) {
+            const char *nl = memchr(data, '\n', len);
+            if (!nl)
+                continue;
+            len -= (size_t)(nl + 1 - data);
+            data = nl + 1;
+            skip = 0;
+        }
+        buffer_append(out, data, len);
+    }
+    if (svc->log_midline)
+        buffer_append(out, "\n", 1);
+}
+
+/**
+ * Execute one control request
+ *
+ * The protocol is one request line per connection, answered by "OK" or
+ * "ERR <reason>" and then any data lines, after which init closes the
+ * connection. Everything is answered from the in-memory service table.
+ */
+static void control_execute(control_conn_t *conn, buffer_t *out) {
+    char *cmd = strtok(conn->request, " \t\r\n");
+    char *arg = strtok(NULL, " \t\r\n");
+    char err[256];
+
+    if (!cmd) {
+        buffer_printf(out, "ERR empty request\n");
+        return;
+    }
+
+    if (strcmp(cmd, "list") == 0) {
+        buffer_printf(out, "OK\n");
+        for (int i = 0; i < service_count; i++) {
+            service_t *svc = services[i];
+            if (svc->removed)
+                continue;
+            buffer_printf(out, "%-24s %-9s %7d %5d\n", svc->name,
+                          state_name(svc->state), (int)svc->pid, svc->respawn_count);
+        }
+        return;
+    }
+
+    int privileged = strcmp(cmd, "status") != 0;
+    if (privileged && conn->uid != 0) {
+        buffer_printf(out, "ERR permission denied\n");
+        return;
+    }
+
+    if (strcmp(cmd, "reload") == 0) {
+        reload_stats_t st;
+        reload_services(NULL, 0, &st);
+        buffer_printf(out, "OK\n%d added, %d removed, %d restarted, %d updated\n",
+                      st.added, st.removed, st.restarted, st.updated);
+        return;
+    }
+
+    /* Shutdown starts once this reply has been sent */
+    if (strcmp(cmd, "poweroff") == 0 || strcmp(cmd, "reboot") == 0 ||
+        strcmp(cmd, "kexec") == 0) {
+        if (strcmp(cmd, "kexec") == 0) {
+            if (kexec_load_kernel(arg, err, sizeof(err)) < 0) {
+                buffer_printf(out, "ERR %s\n", err);
+                return;
+            }
+            shutdown_action = SHUTDOWN_KEXEC;
+        } else {
+            shutdown_action = strcmp(cmd, "reboot") == 0 ? SHUTDOWN_REBOOT : SHUTDOWN_POWEROFF;
+        }
+        shutdown_requested = 1;
+        buffer_printf(out, "OK\n");
+        return;
+    }
+
+    /* Executed once this reply has been sent */
+    if (strcmp(cmd, "reexec") == 0) {
+        const char *busy = reexec_blocker();
+        if (busy) {
+            buffer_printf(out, "ERR %s, try again later\n", busy);
+        } else {
+            reexec_requested = 1;
+            buffer_printf(out, "OK\n");
+        }
+        return;
+    }
+
+    int idx = arg ? find_service(arg) : -1;
+    if (strcmp(cmd, "status") != 0 && strcmp(cmd, "start") != 0 &&
+        strcmp(cmd, "stop") != 0 && strcmp(cmd, "restart") != 0 && strcmp(cmd, "log") != 0) {
+        buffer_printf(out, "ERR unknown command %s\n", cmd);
+        return;
+    }
+    if (!arg) {
+        buffer_printf(out, "ERR %s needs a service name\n", cmd);
+        return;
+    }
+    if (idx < 0) {
+        buffer_printf(out, "ERR no such service %s\n", arg);
+        return;
+    }
+
+    service_t *svc = services[idx];
+
+    if (strcmp(cmd, "status") == 0) {
+        buffer_printf(out, "OK\n");
+        control_status(out, svc);
+    } else if (strcmp(cmd, "log") == 0) {
+        buffer_printf(out, "OK\n");
+        control_log(out, svc);
+    } else if (strcmp(cmd, "start") == 0) {
+        if (service_start(svc, err, sizeof(err)) < 0)
+            buffer_printf(out, "ERR %s\n", err);
+        else
+            buffer_printf(out, "OK\n");
+    } else if (strcmp(cmd, "stop") == 0) {
+        service_stop(svc);
+        buffer_printf(out, "OK\n");
+    } else {
+        if (svc->pid > 0) {
+            svc->restart_requested = 1;
+            service_stop(svc);
+            buffer_printf(out, "OK\n");
+        } else if (service_start(svc, err, sizeof(err)) < 0) {
+            buffer_printf(out, "ERR %s\n", err);
+        } else {
+            buffer_printf(out, "OK\n");
+        }
+    }
+}
+
+static void control_conn_close(control_conn_t *conn) {
+    free(conn->reply.data);
+    watch_close(&conn->watch);
+    free(conn);
+}
+
+/**
+ * Send as much of the reply as the socket takes
+ *
+ * Waits for EPOLLOUT while the client is slow to read, and closes the
+ * connection once everything is sent or the client went away.
+ */
+static void control_conn_send(control_conn_t *conn) {
+    while (conn->sent < conn->reply.len) {
+        ssize_t n = send(conn->watch.fd, conn->reply.data + conn->sent,
+                         conn->reply.len - conn->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            conn->sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLOUT;
+            ev.data.ptr = &conn->watch;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->watch.fd, &ev) == 0)
+                return;
+            perror("control reply");
+            break;
+        } else {
+            perror("control reply");
+            break;
+        }
+    }
+    control_conn_close(conn);
+}
+
+/**
+ * Read a request from a control connection and answer it
+ */
+static void handle_control_conn(watch_t *w, uint32_t events) {
+    control_conn_t *conn = w->data;
+
+    /* Already answered, the socket has room for more of the reply */
+    if (conn->reply.data) {
+        if (events & (EPOLLHUP | EPOLLERR))
+            control_conn_close(conn);
+        else
+            control_conn_send(conn);
+        return;
+    }
+
+    int done = (events & (EPOLLHUP | EPOLLERR)) != 0;
+
+    while (conn->len < sizeof(conn->request) - 1) {
+        ssize_t n = read(w->fd, conn->request + conn->len, sizeof(conn->request) - 1 - conn->len);
+        if (n > 0) {
+            conn->len += (size_t)n;
+            continue;
+        }
+        if (n == 0)
+            done = 1;
+        else if (errno != EAGAIN && errno != EINTR)
+            done = 1;
+        break;
+    }
+    conn->request[conn->len] = '\0';
+
+    if (strchr(conn->request, '\n') || conn->len == sizeof(conn->request) - 1)
+        done = 1;
+    if (!done)
+        return;
+
+    control_execute(conn, &conn->reply);
+    control_conn_send(conn);
+}
+
+/**
+ * Accept control connections
+ */
+static void handle_control_accept(watch_t *w, uint32_t events) {
+    (void)events;
+
+    int fd;
+    while ((fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        control_conn_t *conn = calloc(1, sizeof(*conn));
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+
+        if (!conn || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->uid = cred.uid;
+
+        int sndbuf = 256 * 1024;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+        if (watch_add(&conn->watch, fd, EPOLLIN | EPOLLRDHUP, handle_control_conn, conn) < 0) {
+            close(fd);
+            free(conn);
+        }
+    }
+}
+
+/**
+ * Listen for icenet-initctl requests
+ *
+ * Anyone may connect to read status; requests that change anything or
+ * read service output are refused unless the peer is root.
+ */
+static void setup_control_socket(void) {
+    struct sockaddr_un sun;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, CONTROL_PATH);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("control socket");
+        return;
+    }
+
+    mkdir(RUN_DIR, 0755);
+    unlink(CONTROL_PATH);
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(fd, 16) < 0) {
+        perror("Failed to bind " CONTROL_PATH);
+        close(fd);
+        return;
+    }
+    chmod(CONTROL_PATH, 0666);
+
+    if (watch_add(&control_watch, fd, EPOLLIN, handle_control_accept, NULL) < 0)
+        close(fd);
+}
+
+/*
+ * Re-exec
+ *
+ * icenet-initctl reexec replaces the running init with INIT_PATH, e.g.
+ * after an upgrade, without stopping any service. The runtime state is
+ * written to a memfd (see state_header_t) and the new binary restores it.
+ */
+
+/**
+ * Explain why init cannot re-exec right now, or return NULL if it can
+ *
+ * Boot-time workers report back through state that is not handed over,
+ * so a re-exec waits until they are done.
+ */
+static const char *reexec_blocker(void) {
+    if (test_mode)
+        return "init is running in test mode";
+    if (mounts_settled < mount_count)
+        return "fstab entries are still being mounted";
+    if (coldplug_active || modprobe_running > 0)
+        return "kernel modules are still being loaded";
+    if (readahead_watch.fd >= 0)
+        return "the boot working set is still being recorded";
+    for (int i = 0; i < service_count; i++) {
+        if (services[i]->removed && services[i]->pid > 0)
+            return "removed services are still stopping";
+    }
+    return NULL;
+}
+
+/**
+ * Time left on a timer in milliseconds, 0 if it is not armed
+ *
+ * A timer that expired but was not yet dispatched counts as 1 ms, so the
+ * new binary still runs it.
+ */
+static int64_t timer_remaining(watch_t *w) {
+    struct itimerspec its;
+    struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+
+    if (w->fd < 0 || timerfd_gettime(w->fd, &its) < 0)
+        return 0;
+
+    int64_t ms = (int64_t)its.it_value.tv_sec * 1000 + its.it_value.tv_nsec / 1000000;
+    if (ms == 0 && (its.it_value.tv_nsec > 0 || poll(&pfd, 1, 0) > 0))
+        ms = 1;
+    return ms;
+}
+
+static void set_cloexec(int fd, int cloexec) {
+    if (fd >= 0)
+        fcntl(fd, F_SETFD, cloexec ? FD_CLOEXEC : 0);
+}
+
+/**
+ * Set or clear close-on-exec on every descriptor handed to the new binary
+ */
+static void state_fds_cloexec(int cloexec) {
+    set_cloexec(control_watch.fd, cloexec);
+    set_cloexec(uevent_watch.fd, cloexec);
+
+    for (int i = 0; i < service_count; i++) {
+        service_t *svc = services[i];
+        set_cloexec(svc->pidfd, cloexec);
+        set_cloexec(svc->notify_watch.fd, cloexec);
+        set_cloexec(svc->log_watch.fd, cloexec);
+        for (int j = 0; j < svc->listen_count; j++)
+            set_cloexec(svc->listens[j].watch.fd, cloexec);
+    }
+}
+
+/**
+ * Write the runtime state of init and every service
+ */
+static int serialize_state(buffer_t *b) {
+    state_header_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+    hdr.version = STATE_VERSION;
+    for (int i = 0; i < service_count; i++)
+        hdr.service_count += !services[i]->removed;
+    hdr.control_fd = control_watch.fd;
+    hdr.uevent_fd = uevent_watch.fd;
+    if (buffer_append(b, &hdr, sizeof(hdr)) < 0)
+        return -1;
+
+    for (int i = 0; i < service_count; i++) {
+        service_t *svc = services[i];
+        state_service_t rec;
+
+        if (svc->removed)
+            continue;
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.name, svc->name, sizeof(rec.name));
+        rec.pid = svc->pid;
+        rec.pidfd = svc->pidfd;
+        rec.notify_fd = svc->notify_watch.fd;
+        rec.log_fd = svc->log_watch.fd;
+        rec.listen_count = svc->listen_count;
+        for (int j = 0; j < svc->listen_count; j++) {
+            rec.listen_fds[j] = svc->listens[j].watch.fd;
+            memcpy(rec.listen_specs[j], svc->listens[j].spec, sizeof(rec.listen_specs[j]));
+        }
+        rec.state = svc->state;
+        rec.released = svc->released;
+        rec.activated = svc->activated;
+        rec.killed = svc->killed;
+        rec.stop_requested = svc->stop_requested;
+        rec.restart_requested = svc->restart_requested;
+        rec.had_cgroup = svc->cgroup_fd >= 0;
+        rec.respawn_count = svc->respawn_count;
+        rec.backoff_level = svc->backoff_level;
+        rec.failure_next = svc->failure_next;
+        rec.log_midline = svc->log_midline;
+        rec.respawn_ms = timer_remaining(&svc->respawn_timer);
+        rec.stop_ms = timer_remaining(&svc->stop_timer);
+        rec.started_ms = svc->started_ms;
+        memcpy(rec.failures, svc->failures, sizeof(rec.failures));
+        rec.log_written = svc->log_written;
+        rec.log_flushed = svc->log_flushed;
+
+        uint64_t from = log_oldest(svc);
+        rec.log_length = (uint32_t)(svc->log_written - from);
+        if (buffer_append(b, &rec, sizeof(rec)) < 0)
+            return -1;
+
+        const char *data;
+        size_t len;
+        while ((len = log_chunk(svc, from, &data)) > 0) {
+            if (buffer_append(b, data, len) < 0)
+                return -1;
+            from += len;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Replace init with INIT_PATH, keeping every service running
+ *
+ * Does not return on success. If the state cannot be written or the
+ * binary cannot be executed, nothing has changed and supervision goes on.
+ */
+static void reexec(void) {
+    printf("IceNet-Init: Re-executing %s\n", INIT_PATH);
+    log_flush_all();
+
+    buffer_t state = { 0 };
+    int fd = memfd_create("icenet-init-state", 0);
+    if (fd < 0 || serialize_state(&state) < 0) {
+        perror("Failed to save state for re-exec");
+        if (fd >= 0)
+            close(fd);
+        free(state.data);
+        return;
+    }
+
+    size_t done = 0;
+    while (done < state.len) {
+        ssize_t n = write(fd, state.data + done, state.len - done);
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    free(state.data);
+
+    if (done == state.len && lseek(fd, 0, SEEK_SET) == 0) {
+        char arg[16];
+        snprintf(arg, sizeof(arg), "%d", fd);
+
+        state_fds_cloexec(0);
+        execl(INIT_PATH, INIT_PATH, "--deserialize", arg, (char *)NULL);
+        state_fds_cloexec(1);
+    }
+
+    perror("Failed to re-execute " INIT_PATH);
+    close(fd);
+}
+
+/**
+ * Apply the saved runtime state of one service
+ */
+static void restore_service(service_t *svc, const state_service_t *rec, const char *log) {
+    svc->pid = rec->pid;
+    svc->pidfd = rec->pidfd;
+    svc->state = rec->state >= SERVICE_STOPPED && rec->state <= SERVICE_FAILED ?
+                 (service_state_t)rec->state : SERVICE_STOPPED;
+    svc->released = rec->released;
+    svc->activated = rec->activated;
+    svc->killed = rec->killed;
+    svc->stop_requested = rec->stop_requested;
+    svc->restart_requested = rec->restart_requested;
+    svc->respawn_count = rec->respawn_count;
+    svc->backoff_level = rec->backoff_level;
+    svc->failure_next = rec->failure_next >= 0 ? rec->failure_next % MAX_RESPAWN_LIMIT : 0;
+    svc->started_ms = rec->started_ms;
+    memcpy(svc->failures, rec->failures, sizeof(svc->failures));
+
+    if (svc->pid > 0)
+        pid_index_insert(svc);
+
+    if (rec->notify_fd >= 0 &&
+        watch_add(&svc->notify_watch, rec->notify_fd, EPOLLIN, handle_notify, svc) < 0) {
+        close(rec->notify_fd);
+        svc->notify_watch.fd = -1;
+    }
+
+    /* Rebuild the ring at the same offsets, so flushing resumes where it stopped */
+    svc->log_written = rec->log_written - rec->log_length;
+    if (rec->log_length > 0)
+        log_store(svc, log, rec->log_length);
+    if (svc->log_written != rec->log_written) {
+        /* Out of memory: start an empty log */
+        svc->log_written = 0;
+        svc->log_flushed = 0;
+    } else {
+        svc->log_flushed = rec->log_flushed;
+    }
+    svc->log_midline = rec->log_midline;
+
+    if (rec->log_fd >= 0 &&
+        watch_add(&svc->log_watch, rec->log_fd, EPOLLIN, handle_log, svc) < 0) {
+        close(rec->log_fd);
+        svc->log_watch.fd = -1;
+    }
+
+    /* Sockets whose listen= line is gone are closed; new ones are bound later */
+    for (int j = 0; j < rec->listen_count && j < MAX_LISTEN; j++) {
+        int fd = rec->listen_fds[j];
+        if (fd < 0)
+            continue;
+
+        int k = 0;
+        while (k < svc->listen_count &&
+               (svc->listens[k].watch.fd >= 0 ||
+                strncmp(svc->listens[k].spec, rec->listen_specs[j], sizeof(svc->listens[k].spec))))
+            k++;
+        if (k < svc->listen_count)
+            svc->listens[k].watch.fd = fd;
+        else
+            close(fd);
+    }
+
+    if (rec->had_cgroup)
+        service_cgroup_open(svc);
+
+    if (rec->respawn_ms > 0)
+        timer_arm(&svc->respawn_timer, (long)rec->respawn_ms, respawn_timer_fired, svc);
+    if (rec->stop_ms > 0)
+        timer_arm(&svc->stop_timer, (long)rec->stop_ms, stop_timer_fired, svc);
+}
+
+/**
+ * Close the descriptors of a saved service that is no longer defined
+ */
+static void drop_service_state(const state_service_t *rec) {
+    if (rec->pid > 0) {
+        fprintf(stderr, "Warning: Service %.63s (PID %d) is no longer defined, "
+                "leaving it unsupervised\n", rec->name, (int)rec->pid);
+    }
+
+    int fds[] = { rec->pidfd, rec->notify_fd, rec->log_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    for (int j = 0; j < rec->listen_count && j < MAX_LISTEN; j++) {
+        if (rec->listen_fds[j] >= 0)
+            close(rec->listen_fds[j]);
+    }
+}
+
+/**
+ * Take over from the init that re-executed this binary
+ *
+ * Service definitions are loaded afresh, so an upgrade may also change
+ * them; saved state is applied to services of the same name. Returns -1
+ * if the state could not be read, in which case services still running
+ * are no longer supervised and nothing is started.
+ */
+static int restore_state(int fd) {
+    struct stat st;
+    char *map = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(state_header_t))
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    setup_cgroups();
+    load_services();
+
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot read re-exec state\n");
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    state_header_t hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (memcmp(hdr.magic, STATE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != STATE_VERSION) {
+        fprintf(stderr, "Error: Re-exec state has an unsupported format\n");
+        munmap(map, size);
+        return -1;
+    }
+
+    size_t off = sizeof(hdr);
+    int restored = 0;
+    for (uint32_t i = 0; i < hdr.service_count; i++) {
+        state_service_t rec;
+        if (size - off < sizeof(rec))
+            break;
+        memcpy(&rec, map + off, sizeof(rec));
+        off += sizeof(rec);
+        if (rec.log_length > size - off || rec.log_length > rec.log_written)
+            break;
+        const char *log = map + off;
+        off += rec.log_length;
+
+        rec.name[sizeof(rec.name) - 1] = '\0';
+        int idx = find_service(rec.name);
+        if (idx < 0) {
+            drop_service_state(&rec);
+            continue;
+        }
+        restore_service(services[idx], &rec, log);
+        restored++;
+    }
+    munmap(map, size);
+
+    if (hdr.control_fd >= 0 &&
+        watch_add(&control_watch, hdr.control_fd, EPOLLIN, handle_control_accept, NULL) < 0) {
+        close(hdr.control_fd);
+        control_watch.fd = -1;
+    }
+    if (hdr.uevent_fd >= 0 &&
+        watch_add(&uevent_watch, hdr.uevent_fd, EPOLLIN, handle_uevent, NULL) < 0) {
+        close(hdr.uevent_fd);
+        uevent_watch.fd = -1;
+    }
+    state_fds_cloexec(1);
+
+    /* In-degrees now count only dependencies that have not come up */
+    build_dependency_graph();
+    resolve_device_requirements(0);
+    detect_dependency_cycles();
+    open_listen_sockets();
+
+    /*
+     * Start services that never ran, e.g. added since boot, and go back to
+     * watching the sockets of idle lazy services. Anything stopped on
+     * request or waiting to respawn stays as it was.
+     */
+    for (int i = 0; i < service_count; i++) {
+        service_t *svc = services[i];
+        if (svc->state == SERVICE_STOPPED && svc->pending_deps == 0 &&
+            !svc->stop_requested && svc->respawn_timer.fd < 0 && (!svc->released || svc->lazy))
+            queue_ready(svc);
+    }
+    start_ready_services();
+
+    if (hdr.control_fd < 0)
+        setup_control_socket();
+    printf("Restored %d services\n", restored);
+    return 0;
+}
+
+/**
+ * Stop all running services in reverse dependency order
+ *
+ * Runs the event loop until the last service has exited, so shutdown
+ * takes no longer than the services need. Each service gets its own
+ * stop-timeout before SIGKILL.
+ */
+static void stop_all_services(void) {
+    printf("Stopping all services...\n");
+
+    /* Exits that raced with the shutdown request */
+    reap_children();
+    stopping = 1;
+
+    /* A service is stopped once every running service depending on it has exited */
+    for (int i = 0; i < service_count; i++) {
+        services[i]->running_dependents = 0;
+        services[i]->stop_done = services[i]->pid <= 0;
+    }
+    for (int i = 0; i < service_count; i++) {
+        service_t *svc = services[i];
+        if (svc->stop_done)
+            continue;
+        services_stopping++;
+        for (int d = 0; d < svc->dep_count; d++) {
+            if (svc->dep_idx[d] >= 0)
+                services[svc->dep_idx[d]]->running_dependents++;
+        }
+    }
+
+    /* Leaves of the dependency graph go first, independent branches in parallel */
+    for (int i = 0; i < service_count; i++) {
+        if (!services[i]->stop_done && services[i]->running_dependents == 0)
+            service_stop(services[i]);
+    }
+
+    while (services_stopping > 0 && dispatch_events() == 0)
+        ;
+
+    /* Kill what daemonized services left behind in their cgroups */
+    for (int i = 0; i < service_count; i++) {
+        if (services[i]->cgroup_fd >= 0 && services[i]->pid <= 0)
+            service_kill(services[i], SIGKILL);
+    }
+
+    /* Orphans re-parented to init */
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
+}
+
+/**
+ * Account for a service that has exited during shutdown
+ *
+ * Its dependencies are stopped as soon as their last running dependent
+ * is gone.
+ */
+static void shutdown_service_done(service_t *svc) {
+    if (svc->stop_done)
+        return;
+
+    svc->stop_done = 1;
+    services_stopping--;
+
+    for (int d = 0; d < svc->dep_count; d++) {
+        if (svc->dep_idx[d] < 0)
+            continue;
+        service_t *dep = services[svc->dep_idx[d]];
+        if (--dep->running_dependents == 0 && !dep->stop_done)
+            service_stop(dep);
+    }
+}
+
+/**
+ * Load a kernel to boot into with kexec
+ *
+ * release selects /boot/vmlinuz-<release> and, if present, the matching
+ * initrd; NULL means the running kernel. The kernel is loaded before
+ * shutdown starts, so a missing or unbootable image is reported to the
+ * caller while everything is still running. The current kernel command
+ * line is reused.
+ */
+static int kexec_load_kernel(const char *release, char *err, size_t errlen) {
+#ifdef SYS_kexec_file_load
+    struct utsname uts;
+    char kernel[256], initrd[256], cmdline[4096];
+
+    if (!release) {
+        uname(&uts);
+        release = uts.release;
+    }
+    if (strchr(release, '/')) {
+        snprintf(err, errlen, "invalid kernel release %s", release);
+        return -1;
+    }
+    snprintf(kernel, sizeof(kernel), "%s/vmlinuz-%.200s", KEXEC_BOOT_DIR, release);
+    snprintf(initrd, sizeof(initrd), "%s/initrd.img-%.200s", KEXEC_BOOT_DIR, release);
+
+    int kernel_fd = open(kernel, O_RDONLY | O_CLOEXEC);
+    if (kernel_fd < 0) {
+        snprintf(err, errlen, "cannot open %.160s: %s", kernel, strerror(errno));
+        return -1;
+    }
+    int initrd_fd = open(initrd, O_RDONLY | O_CLOEXEC);
+
+    /* The kernel wants the length including the terminator */
+    size_t len = 0;
+    int fd = open("/proc/cmdline", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, cmdline, sizeof(cmdline) - 1);
+        len = n > 0 ? (size_t)n : 0;
+        close(fd);
+    }
+    while (len > 0 && cmdline[len - 1] == '\n')
+        len--;
+    cmdline[len] = '\0';
+
+    long ret = syscall(SYS_kexec_file_load, kernel_fd, initrd_fd, len + 1, cmdline,
+                       initrd_fd < 0 ? KEXEC_FILE_NO_INITRAMFS : 0UL);
+    if (ret < 0)
+        snprintf(err, errlen, "cannot load %.160s: %s", kernel, strerror(errno));
+
+    close(kernel_fd);
+    if (initrd_fd >= 0)
+        close(initrd_fd);
+    return ret < 0 ? -1 : 0;
+#else
+    (void)release;
+    snprintf(err, errlen, "kexec is not supported on this architecture");
+    return -1;
+#endif
+}
+
+/**
+ * Terminate processes outside any service, e.g. login shells
+ *
+ * Every process left is a descendant of init, so once waitpid() reports
+ * no children there is nothing left to wait for.
+ */
+static void kill_remaining(void) {
+    kill(-1, SIGTERM);
+
+    for (int waited = 0; waited < REMAINING_TIMEOUT_MS; waited += 50) {
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+            ;
+        if (pid < 0 && errno == ECHILD)
+            return;
+        poll(NULL, 0, 50);
+    }
+
+    printf("Killing remaining processes\n");
+    kill(-1, SIGKILL);
+    while (waitpid(-1, NULL, 0) > 0)
+        ;
+}
+
+/* Undo the octal escapes /proc/self/mounts uses for blanks and backslashes */
+static void unescape_mount_path(char *s) {
+    char *out = s;
+
+    for (; *s; s++) {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' &&
+            s[3] >= '0' && s[3] <= '7') {
+            *out++ = (char)((s[1] - '0') * 64 + (s[2] - '0') * 8 + (s[3] - '0'));
+            s += 3;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+/**
+ * Unmount every filesystem, the most recently mounted first
+ *
+ * /proc/self/mounts lists mounts in the order they were made, so walking
+ * it backwards takes children before their parents. Passes repeat while
+ * they make progress, for mounts stacked out of order. Whatever is still
+ * busy, and the root filesystem, is remounted read-only.
+ */
+static void unmount_all(void) {
+    FILE *f = fopen("/proc/self/mounts", "r");
+    char **dirs = NULL;
+    int count = 0;
+    char line[1024];
+
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        char target[512];
+        if (sscanf(line, "%*s %511s", target) != 1)
+            continue;
+        unescape_mount_path(target);
+
+        char **grown = realloc(dirs, (count + 1) * sizeof(char *));
+        if (!grown)
+            break;
+        dirs = grown;
+        dirs[count] = strdup(target);
+        if (dirs[count])
+            count++;
+    }
+    fclose(f);
+
+    int progress = 1;
+    while (progress) {
+        progress = 0;
+        for (int i = count - 1; i >= 0; i--) {
+            if (!dirs[i] || strcmp(dirs[i], "/") == 0 || umount2(dirs[i], 0) < 0)
+                continue;
+            free(dirs[i]);
+            dirs[i] = NULL;
+            progress = 1;
+        }
+    }
+
+    for (int i = count - 1; i >= 0; i--) {
+        if (!dirs[i])
+            continue;
+        if (mount(NULL, dirs[i], NULL, MS_REMOUNT | MS_RDONLY, NULL) < 0 &&
+            strcmp(dirs[i], "/") == 0) {
+            fprintf(stderr, "Warning: Could not remount / read-only: %s\n", strerror(errno));
+        }
+        free(dirs[i]);
+    }
+    free(dirs);
+}
+
+/**
+ * Open the boot trace and flush the records buffered before /run existed
+ */
+static void trace_open(void) {
+    mkdir(RUN_DIR, 0755);
+
+    trace_fd = open(TRACE_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        perror("Failed to open boot trace");
+        return;
+    }
+
+    trace_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(trace_record_t);
+
+    if (write(trace_fd, &hdr, sizeof(hdr)) < 0 ||
+        write(trace_fd, trace_early, trace_early_len) < 0) {
+        perror("Failed to write boot trace");
+    }
+    trace_bytes = sizeof(hdr) + trace_early_len;
+}
+
+/**
+ * Append a timestamped event to the boot trace
+ *
+ * Safe to call from a forked child: it only formats on the stack and
+ * issues a single write(), which O_APPEND keeps atomic.
+ */
+static void trace_event(int type, int service, pid_t pid, int32_t arg, const char *text) {
+    char buf[sizeof(trace_record_t) + 72];
+    trace_record_t *rec = (trace_record_t *)buf;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    memset(buf, 0, sizeof(buf));
+    rec->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    rec->type = (uint16_t)type;
+    rec->service = service < 0 ? 0xffff : (uint16_t)service;
+    rec->arg = arg;
+    rec->pid = pid;
+
+    size_t len = 0;
+    if (text) {
+        len = strnlen(text, 63) + 1;
+        memcpy(buf + sizeof(*rec), text, len - 1);
+    }
+    rec->length = (uint16_t)((len + 7) & ~(size_t)7);
+
+    size_t total = sizeof(*rec) + rec->length;
+
+    if (trace_fd < 0) {
+        if (trace_early_len + total <= sizeof(trace_early)) {
+            memcpy(trace_early + trace_early_len, buf, total);
+            trace_early_len += total;
+        }
+        return;
+    }
+
+    /* Respawn loops must not fill /run */
+    if (trace_bytes + total > TRACE_MAX_BYTES)
+        return;
+    trace_bytes += total;
+
+    if (write(trace_fd, buf, total) < 0) {
+        /* Nothing useful to do; tracing is best effort */
+    }
+}
+
+/**
+ * Record the service table and dependency edges for the analyzer
+ */
+static void trace_services(int first) {
+    for (int i = first; i < service_count; i++) {
+        trace_event(TRACE_SERVICE, i, 0, 0, services[i]->name);
+        for (int d = 0; d < services[i]->dep_count; d++) {
+            if (services[i]->dep_idx[d] >= 0)
+                trace_event(TRACE_DEPENDS, i, 0, services[i]->dep_idx[d], NULL);
+        }
+    }
+}
+
+/* Per-service view of the trace used by the analyzer */
+typedef struct {
+    char name[64];
+    uint64_t fork_ns;
+    uint64_t exec_ns;
+    uint64_t ready_ns;
+    int deps[MAX_DEPS];
+    int dep_count;
+} trace_service_t;
+
+static int compare_latency(const void *a, const void *b) {
+    const trace_service_t *x = *(trace_service_t * const *)a;
+    const trace_service_t *y = *(trace_service_t * const *)b;
+    uint64_t lx = x->ready_ns - x->fork_ns;
+    uint64_t ly = y->ready_ns - y->fork_ns;
+    return (lx < ly) - (lx > ly);
+}
+
+static double ns_to_s(uint64_t ns) {
+    return (double)ns / 1e9;
+}
+
+/**
+ * Print per-service start latency and the critical chain from a trace
+ */
+static int analyze_trace(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Cannot open boot trace %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    trace_header_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != TRACE_VERSION || hdr.record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "%s is not an icenet-init boot trace\n", path);
+        fclose(f);
+        return 1;
+    }
+
+    trace_service_t *svcs = calloc(0x10000, sizeof(*svcs));
+    if (!svcs) {
+        fclose(f);
+        return 1;
+    }
+
+    uint64_t first_ns = 0;
+    int max_service = -1;
+    trace_record_t rec;
+    char text[256];
+
+    printf("Boot trace: %s\n\nPhases:\n", path);
+
+    /* Phases may overlap, e.g. fstab mounts run alongside service startup */
+    char phase_name[8][64];
+    uint64_t phase_begin[8];
+    int phase_count = 0;
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        text[0] = '\0';
+        if (rec.length > 0) {
+            if (rec.length >= sizeof(text) || fread(text, rec.length, 1, f) != 1)
+                break;
+            text[rec.length] = '\0';
+        }
+
+        if (first_ns == 0)
+            first_ns = rec.time_ns;
+
+        trace_service_t *ts = rec.service != 0xffff ? &svcs[rec.service] : NULL;
+        if (ts && (int)rec.service > max_service)
+            max_service = rec.service;
+
+        switch (rec.type) {
+            case TRACE_PHASE_BEGIN:
+                if (phase_count < 8) {
+                    snprintf(phase_name[phase_count], sizeof(phase_name[0]), "%s", text);
+                    phase_begin[phase_count++] = rec.time_ns;
+                }
+                break;
+            case TRACE_PHASE_END:
+                for (int p = phase_count - 1; p >= 0; p--) {
+                    if (strcmp(phase_name[p], text) != 0)
+                        continue;
+                    printf("  %-24s %8.3f ms  (at %.3fs)\n", text,
+                           (double)(rec.time_ns - phase_begin[p]) / 1e6,
+                           ns_to_s(rec.time_ns));
+                    phase_name[p][0] = '\0';
+                    break;
+                }
+                break;
+            case TRACE_SERVICE:
+                if (ts)
+                    snprintf(ts->name, sizeof(ts->name), "%s", text);
+                break;
+            case TRACE_DEPENDS:
+                if (ts && ts->dep_count < MAX_DEPS)
+                    ts->deps[ts->dep_count++] = rec.arg;
+                break;
+            case TRACE_FORK:
+                if (ts && ts->fork_ns == 0)
+                    ts->fork_ns = rec.time_ns;
+                break;
+            case TRACE_EXEC:
+                if (ts && ts->exec_ns == 0)
+                    ts->exec_ns = rec.time_ns;
+                break;
+            case TRACE_READY:
+                if (ts && ts->ready_ns == 0)
+                    ts->ready_ns = rec.time_ns;
+                break;
+        }
+    }
+    fclose(f);
+
+    /* Blame: slowest services first, by time from fork to ready */
+    trace_service_t **order = calloc((size_t)max_service + 1, sizeof(*order));
+    int count = 0;
+    trace_service_t *last = NULL;
+
+    for (int i = 0; i <= max_service; i++) {
+        trace_service_t *ts = &svcs[i];
+        if (ts->fork_ns == 0 || ts->ready_ns == 0)
+            continue;
+        if (order)
+            order[count++] = ts;
+        if (!last || ts->ready_ns > last->ready_ns)
+            last = ts;
+    }
+
+    if (order)
+        qsort(order, count, sizeof(*order), compare_latency);
+
+    printf("\nService start latency (fork to ready, slowest first):\n");
+    printf("  %11s %11s  %s\n", "total", "exec", "service");
+    for (int i = 0; i < count; i++) {
+        trace_service_t *ts = order[i];
+        printf("  %8.3f ms %8.3f ms  %s\n",
+               (double)(ts->ready_ns - ts->fork_ns) / 1e6,
+               ts->exec_ns ? (double)(ts->exec_ns - ts->fork_ns) / 1e6 : 0.0,
+               ts->name);
+    }
+
+    for (int i = 0; i <= max_service; i++) {
+        trace_service_t *ts = &svcs[i];
+        if (ts->name[0] && ts->fork_ns == 0)
+            printf("  %11s %11s  %s (never started)\n", "-", "-", ts->name);
+        else if (ts->fork_ns && ts->ready_ns == 0)
+            printf("  %11s %11s  %s (never ready)\n", "-", "-", ts->name);
+    }
+
+    /*
+     * Critical chain: from the last service to come up, repeatedly step to
+     * the dependency that became ready last, since that is what held the
+     * service back. A dependency that came up later, such as a lazy one
+     * whose dependents went ahead once its sockets were bound, did not hold
+     * it back and is skipped.
+     */
+    if (last) {
+        printf("\nCritical chain:\n");
+        trace_service_t *cur = last;
+        int depth = 0;
+        while (cur && depth <= max_service) {
+            printf("  %*s%s @%.3fs +%.3fs\n", depth * 2, "", cur->name,
+                   ns_to_s(cur->ready_ns - first_ns),
+                   ns_to_s(cur->ready_ns - cur->fork_ns));
+
+            trace_service_t *next = NULL;
+            for (int d = 0; d < cur->dep_count; d++) {
+                trace_service_t *dep = &svcs[cur->deps[d] & 0xffff];
+                if (dep->ready_ns && dep->ready_ns <= cur->ready_ns &&
+                    (!next || dep->ready_ns > next->ready_ns))
+                    next = dep;
+            }
+            cur = next;
+            depth++;
+        }
+
+        printf("\nLast service (%s) ready %.3fs after init started, %.3fs after boot\n",
+               last->name, ns_to_s(last->ready_ns - first_ns), ns_to_s(last->ready_ns));
+    } else {
+        printf("\nNo service became ready\n");
+    }
+
+    free(order);
+    free(svcs);
+    return 0;
 }
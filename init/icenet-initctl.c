@@ -0,0 +1,161 @@
+/**
+ * IceNet-Init Control Client
+ *
+ * Talks to a running icenet-init over its control socket.
+ * Usage:
+ *   icenet-initctl list
+ *   icenet-initctl status <service>
+ *   icenet-initctl start|stop|restart <service>
+ *   icenet-initctl log <service>
+ *   icenet-initctl reload
+ *   icenet-initctl reexec
+ *   icenet-initctl poweroff|reboot
+ *   icenet-initctl kexec [kernel-release]
+ *   icenet-initctl blame [trace-file]
+ *
+ * Copyright (c) 2025 IceNet-01
+ * Licensed under MIT
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Must match CONTROL_PATH in icenet-init.c */
+#define CONTROL_PATH "/run/icenet-init/control"
+#define INIT_PATH "/sbin/icenet-init"
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <command> [service]\n\n", prog);
+    fprintf(stderr, "Commands:\n");
+    fprintf(stderr, "  list              List services with state, PID and restarts\n");
+    fprintf(stderr, "  status <service>  Show detailed service status\n");
+    fprintf(stderr, "  start <service>   Start a service\n");
+    fprintf(stderr, "  stop <service>    Stop a service\n");
+    fprintf(stderr, "  restart <service> Restart a service\n");
+    fprintf(stderr, "  log <service>     Show a service's recent output\n");
+    fprintf(stderr, "  reload            Apply changed service files (done automatically on change)\n");
+    fprintf(stderr, "  reexec            Restart init itself, e.g. after an upgrade\n");
+    fprintf(stderr, "  poweroff          Stop all services and power off\n");
+    fprintf(stderr, "  reboot            Stop all services and reboot through the firmware\n");
+    fprintf(stderr, "  kexec [release]   Stop all services and boot straight into a kernel\n");
+    fprintf(stderr, "                    from /boot (default: the running one)\n");
+    fprintf(stderr, "  blame [file]      Show the boot trace analysis\n");
+}
+
+/**
+ * Send one request and copy the reply to stdout
+ *
+ * Returns 0 if init answered OK, 1 otherwise.
+ */
+static int send_request(const char *request) {
+    struct sockaddr_un sun;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, CONTROL_PATH);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        fprintf(stderr, "Cannot connect to icenet-init at %s: %s\n",
+                CONTROL_PATH, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    size_t len = strlen(request);
+    if (write(fd, request, len) != (ssize_t)len) {
+        perror("write");
+        close(fd);
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    /* The first line is the verdict, the rest is data */
+    char buf[4096];
+    ssize_t n;
+    int first = 1;
+    int ok = 0;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        char *data = buf;
+        size_t left = (size_t)n;
+
+        if (first) {
+            char *nl = memchr(buf, '\n', left);
+            size_t verdict = nl ? (size_t)(nl - buf) : left;
+
+            if (verdict >= 2 && strncmp(buf, "OK", 2) == 0) {
+                ok = 1;
+            } else {
+                fprintf(stderr, "icenet-init: %.*s\n",
+                        (int)(verdict > 4 ? verdict - 4 : 0), buf + 4);
+            }
+            first = 0;
+            data = nl ? nl + 1 : buf + left;
+            left -= (size_t)(data - buf);
+        }
+        fwrite(data, 1, left, stdout);
+    }
+
+    close(fd);
+    if (first)
+        fprintf(stderr, "icenet-init closed the connection without answering\n");
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || strcmp(argv[1], "help") == 0 || strcmp(argv[1], "--help") == 0) {
+        print_usage(argv[0]);
+        return argc < 2 ? 1 : 0;
+    }
+
+    const char *cmd = argv[1];
+
+    /* The trace is analyzed by init's own reader */
+    if (strcmp(cmd, "blame") == 0) {
+        execl(INIT_PATH, INIT_PATH, "--analyze", argc > 2 ? argv[2] : (char *)NULL,
+              (char *)NULL);
+        perror("Failed to run " INIT_PATH);
+        return 1;
+    }
+
+    int needs_service = strcmp(cmd, "status") == 0 || strcmp(cmd, "start") == 0 ||
+                        strcmp(cmd, "stop") == 0 || strcmp(cmd, "restart") == 0 ||
+                        strcmp(cmd, "log") == 0;
+
+    int optional_arg = strcmp(cmd, "kexec") == 0;
+
+    if (!needs_service && !optional_arg && strcmp(cmd, "list") != 0 &&
+        strcmp(cmd, "reload") != 0 && strcmp(cmd, "reexec") != 0 &&
+        strcmp(cmd, "poweroff") != 0 && strcmp(cmd, "reboot") != 0) {
+        fprintf(stderr, "Unknown command: %s\n", cmd);
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (needs_service && argc < 3) {
+        fprintf(stderr, "%s needs a service name\n", cmd);
+        return 1;
+    }
+
+    char request[256];
+    if (needs_service || (optional_arg && argc > 2))
+        snprintf(request, sizeof(request), "%s %.200s\n", cmd, argv[2]);
+    else
+        snprintf(request, sizeof(request), "%s\n", cmd);
+
+    if (strcmp(cmd, "list") == 0)
+        printf("%-24s %-9s %7s %5s\n", "SERVICE", "STATE", "PID", "RESTARTS");
+
+    return send_request(request);
+}
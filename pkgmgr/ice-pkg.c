@@ -12,33 +12,174 @@
  * Licensed under MIT
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <dirent.h>
 #include <curl/curl.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#define SHA256_ARM 1
+#endif
+
 #define VERSION "0.1.0"
 #define DB_PATH "/var/lib/ice-pkg/packages.db"
 #define CACHE_DIR "/var/cache/ice-pkg"
+#define INDEX_TEXT CACHE_DIR "/index.txt"
+#define INDEX_DB CACHE_DIR "/index.db"
 #define DEFAULT_REPO "https://repo.icenet-os.org/packages"
+#define MAX_HOST_CONNECTIONS 4  /* Per repository host; HTTP/2 multiplexes over them */
+#define MAX_DEPENDENCIES 32
+#define MAX_CONFLICTS 16
 
+/*
+ * Package index, one package per line:
+ *
+ *   name|version|arch|size|sha256|depends|description|conflicts
+ *
+ * size is the archive size in bytes and sha256 its hex digest. depends and
+ * conflicts are comma separated lists of package names, each optionally
+ * constrained by a version: "libc>=2.36", "openssl<3", "busybox=1.36.1".
+ * A name may be listed once per version; installing picks the highest
+ * version that every requirement accepts.
+ * conflicts is optional, so seven-field lines still parse; further fields
+ * are ignored.
+ */
 typedef struct {
     char name[128];
     char version[32];
     char arch[16];
     char description[256];
-    char *dependencies[32];
+    char *dependencies[MAX_DEPENDENCIES];
     int dep_count;
+    char *conflicts[MAX_CONFLICTS];
+    int conflict_count;
+    size_t size;                /* Archive, as listed in the index */
     size_t installed_size;
     char checksum[65];
 } package_t;
 
+/* Version constraint operators */
+enum {
+    CONSTRAINT_ANY,
+    CONSTRAINT_EQ,
+    CONSTRAINT_NE,
+    CONSTRAINT_LT,
+    CONSTRAINT_LE,
+    CONSTRAINT_GT,
+    CONSTRAINT_GE,
+};
+
+/*
+ * Compiled package index
+ *
+ * update compiles index.txt into index.db, which every other command maps
+ * read-only and uses in place. All offsets are relative to the start of
+ * the file. Names are found through a perfect hash: the name's hash picks
+ * a bucket, the bucket's seed is mixed into the hash to give a slot that
+ * no other name uses, so a lookup costs one hash and one string compare.
+ * Every version listed is kept: the records of a name are adjacent,
+ * highest version first, and the name table points at the first one.
+ * Dependencies and conflicts are stored as edges with their target name
+ * and constraint already resolved.
+ */
+#define PKGIDX_MAGIC "ICEPKIDX"
+#define PKGIDX_VERSION 3
+#define PKGIDX_NONE 0xffffffffu  /* Edge target that is not in the index */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t package_count;
+    int64_t source_mtime_sec;   /* index.txt it was compiled from */
+    int64_t source_mtime_nsec;
+    uint64_t source_size;
+    uint32_t records;           /* pkgidx_record_t[package_count] */
+    uint32_t edges;             /* pkgidx_edge_t[edge_count] */
+    uint32_t edge_count;
+    uint32_t seeds;             /* uint32_t[bucket_count] */
+    uint32_t bucket_count;
+    uint32_t slots;             /* uint32_t[slot_count]: record + 1, 0 if empty */
+    uint32_t slot_count;
+    uint32_t strings;           /* NUL terminated strings */
+    uint32_t strings_size;
+    uint32_t file_size;
+    uint32_t name_count;        /* Distinct names */
+} pkgidx_header_t;
+
+typedef struct {
+    uint64_t size;              /* Archive bytes */
+    uint32_t name;              /* String offsets */
+    uint32_t version;
+    uint32_t arch;
+    uint32_t checksum;
+    uint32_t description;
+    uint32_t deps;              /* Edge indices */
+    uint32_t conflicts;
+    uint32_t first;             /* Record of this name's highest version */
+    uint32_t versions;          /* Records with this name, from first on */
+    uint16_t dep_count;
+    uint16_t conflict_count;
+} pkgidx_record_t;
+
+typedef struct {
+    uint32_t target;            /* First record of the name, or PKGIDX_NONE */
+    uint32_t spec;              /* String: the entry as written, e.g. "libc>=2.36" */
+    uint32_t version;           /* String: the constraint's version */
+    uint32_t op;                /* CONSTRAINT_* */
+} pkgidx_edge_t;
+
+/* A compiled index, mapped from INDEX_DB or built in memory */
+typedef struct {
+    char *image;
+    size_t size;
+    int mapped;
+    const pkgidx_header_t *hdr;
+    const pkgidx_record_t *recs;
+    const pkgidx_edge_t *edges;
+    const uint32_t *seeds;
+    const uint32_t *slots;
+    uint32_t count;
+} index_t;
+
+/*
+ * Install plan: the packages to install, dependencies before dependents,
+ * with each package's dependencies that are part of the plan
+ */
+typedef struct {
+    package_t *pkgs;
+    int count;
+    int *deps;                  /* Plan positions */
+    int *dep_start;             /* pkgs[i] needs deps[dep_start[i]] up to deps[dep_start[i + 1]] */
+} plan_t;
+
+/* SHA-256 in progress; data is hashed in 64 byte blocks */
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;            /* Bytes hashed so far */
+    uint8_t block[64];
+    size_t used;                /* Bytes waiting in block */
+} sha256_t;
+
 /* Forward declarations */
 static void print_usage(const char *prog);
 static int cmd_install(int argc, char *argv[]);
@@ -47,8 +188,16 @@ static int cmd_update(int argc, char *argv[]);
 static int cmd_search(int argc, char *argv[]);
 static int cmd_list(int argc, char *argv[]);
 static int cmd_info(int argc, char *argv[]);
-static int download_package(const char *name, const char *version, char *dest);
-static int extract_package(const char *pkg_path, const char *dest);
+static int compile_index(const char *text_path, const char *db_path, index_t *index);
+static int load_index(index_t *index);
+static void free_index(index_t *index);
+static int index_lookup(const index_t *index, const char *name);
+static const char *index_string(const index_t *index, uint32_t off);
+static const pkgidx_edge_t *index_edges(const index_t *index, uint32_t first, uint32_t n);
+static int resolve_packages(const index_t *index, int argc, char *argv[], plan_t *plan);
+static void free_plan(plan_t *plan);
+static int install_packages(const plan_t *plan);
+static pid_t extract_package(const char *pkg_path, const char *dest);
 static int verify_checksum(const char *file, const char *expected);
 
 /**
@@ -99,7 +248,7 @@ static void print_usage(const char *prog) {
     printf("ice-pkg v%s - IceNet-OS Package Manager\n\n", VERSION);
     printf("Usage: %s <command> [options]\n\n", prog);
     printf("Commands:\n");
-    printf("  install, i <package>     Install a package\n");
+    printf("  install, i <package>...  Install packages and their dependencies\n");
     printf("  remove, r <package>      Remove a package\n");
     printf("  update, u               Update package database\n");
     printf("  search, s <query>        Search for packages\n");
@@ -114,7 +263,12 @@ static void print_usage(const char *prog) {
 }
 
 /**
- * Install a package
+ * Install packages
+ *
+ * The request is resolved against the index first, so missing packages,
+ * unsatisfiable versions and conflicts are reported before anything is
+ * downloaded. The plan is then fetched concurrently and each package is
+ * extracted once it and its dependencies are in place.
  */
 static int cmd_install(int argc, char *argv[]) {
     if (argc < 1) {
@@ -122,48 +276,29 @@ static int cmd_install(int argc, char *argv[]) {
         return 1;
     }
 
-    const char *pkg_name = argv[0];
-    printf("Installing package: %s\n", pkg_name);
-
-    /* Check if already installed */
-    char db_path[512];
-    snprintf(db_path, sizeof(db_path), "/var/lib/ice-pkg/%s.installed", pkg_name);
-
-    if (access(db_path, F_OK) == 0) {
-        printf("Package %s is already installed\n", pkg_name);
-        return 0;
-    }
-
-    /* Download package */
-    char pkg_path[512];
-    snprintf(pkg_path, sizeof(pkg_path), "%s/%s.tar.xz", CACHE_DIR, pkg_name);
-
-    printf("Downloading %s...\n", pkg_name);
-    if (download_package(pkg_name, "latest", pkg_path) != 0) {
-        fprintf(stderr, "Failed to download package\n");
-        return 1;
-    }
-
-    /* Verify checksum (if available) */
-    /* TODO: Implement checksum verification */
-
-    /* Extract package */
-    printf("Installing files...\n");
-    if (extract_package(pkg_path, "/") != 0) {
-        fprintf(stderr, "Failed to extract package\n");
+    index_t index;
+    if (load_index(&index) != 0)
         return 1;
-    }
 
-    /* Mark as installed */
-    FILE *f = fopen(db_path, "w");
-    if (f) {
-        fprintf(f, "name=%s\nversion=latest\ninstalled=%ld\n",
-                pkg_name, (long)time(NULL));
-        fclose(f);
+    plan_t plan;
+    int ret = 1;
+
+    if (resolve_packages(&index, argc, argv, &plan) == 0) {
+        if (plan.count == 0) {
+            printf("Nothing to install\n");
+            ret = 0;
+        } else {
+            printf("Installing %d package(s):", plan.count);
+            for (int i = 0; i < plan.count; i++)
+                printf(" %s-%s", plan.pkgs[i].name, plan.pkgs[i].version);
+            printf("\n");
+            ret = install_packages(&plan) ? 1 : 0;
+        }
+        free_plan(&plan);
     }
 
-    printf("Package %s installed successfully\n", pkg_name);
-    return 0;
+    free_index(&index);
+    return ret;
 }
 
 /**
@@ -220,9 +355,8 @@ static int cmd_update(int argc, char *argv[]) {
 
     printf("Updating package database...\n");
 
-    /* Download package index */
-    char index_path[512];
-    snprintf(index_path, sizeof(index_path), "%s/index.txt", CACHE_DIR);
+    /* Download package index; the old one stays until the new one is complete */
+    const char *index_path = INDEX_TEXT ".part";
 
     CURL *curl = curl_easy_init();
     if (!curl) {
@@ -246,16 +380,24 @@ static int cmd_update(int argc, char *argv[]) {
 
     CURLcode res = curl_easy_perform(curl);
 
-    fclose(f);
+    int closed = fclose(f) == 0;
     curl_easy_cleanup(curl);
 
-    if (res != CURLE_OK) {
+    if (res != CURLE_OK || !closed || rename(index_path, INDEX_TEXT) != 0) {
         fprintf(stderr, "Failed to download package index: %s\n",
-                curl_easy_strerror(res));
+                res != CURLE_OK ? curl_easy_strerror(res) : strerror(errno));
+        unlink(index_path);
         return 1;
     }
 
-    printf("Package database updated\n");
+    /* Compile it once here so every other command can map it */
+    index_t index;
+    if (compile_index(INDEX_TEXT, INDEX_DB, &index) != 0)
+        return 1;
+
+    printf("Package database updated: %u packages, %u versions\n",
+           index.hdr->name_count, index.count);
+    free_index(&index);
     return 0;
 }
 
@@ -271,27 +413,25 @@ static int cmd_search(int argc, char *argv[]) {
     const char *query = argv[0];
     printf("Searching for: %s\n\n", query);
 
-    /* Read package index */
-    char index_path[512];
-    snprintf(index_path, sizeof(index_path), "%s/index.txt", CACHE_DIR);
-
-    FILE *f = fopen(index_path, "r");
-    if (!f) {
-        fprintf(stderr, "Package index not found. Run 'ice-pkg update' first.\n");
+    index_t index;
+    if (load_index(&index) != 0)
         return 1;
-    }
 
-    char line[1024];
     int found = 0;
 
-    while (fgets(line, sizeof(line), f)) {
-        if (strstr(line, query)) {
-            printf("%s", line);
+    /* Highest version of each name only */
+    for (uint32_t i = 0; i < index.count; i += index.recs[i].versions) {
+        const pkgidx_record_t *rec = &index.recs[i];
+        const char *name = index_string(&index, rec->name);
+        const char *description = index_string(&index, rec->description);
+
+        if (strstr(name, query) || strstr(description, query)) {
+            printf("%-24s %-12s %s\n", name, index_string(&index, rec->version), description);
             found++;
         }
     }
 
-    fclose(f);
+    free_index(&index);
 
     if (found == 0) {
         printf("No packages found matching '%s'\n", query);
@@ -368,60 +508,1829 @@ static int cmd_info(int argc, char *argv[]) {
         printf("Status: Not installed\n");
     }
 
+    index_t index;
+    if (load_index(&index) != 0)
+        return 0;
+
+    int i = index_lookup(&index, pkg_name);
+    if (i < 0) {
+        printf("\nNot in the package index\n");
+    } else {
+        const pkgidx_record_t *rec = &index.recs[i];
+        const pkgidx_edge_t *deps = index_edges(&index, rec->deps, rec->dep_count);
+        const pkgidx_edge_t *conflicts = index_edges(&index, rec->conflicts, rec->conflict_count);
+
+        printf("\nVersion: %s\nArchitecture: %s\nSize: %llu\n",
+               index_string(&index, rec->version), index_string(&index, rec->arch),
+               (unsigned long long)rec->size);
+        if (rec->versions > 1) {
+            printf("Older versions:");
+            for (uint32_t k = (uint32_t)i + 1; k < rec->first + rec->versions; k++)
+                printf(" %s", index_string(&index, index.recs[k].version));
+            printf("\n");
+        }
+        printf("Depends:");
+        for (int j = 0; deps && j < rec->dep_count; j++)
+            printf(" %s", index_string(&index, deps[j].spec));
+        printf("\nConflicts:");
+        for (int j = 0; conflicts && j < rec->conflict_count; j++)
+            printf(" %s", index_string(&index, conflicts[j].spec));
+        printf("\nDescription: %s\n", index_string(&index, rec->description));
+    }
+
+    free_index(&index);
     return 0;
 }
 
 /**
- * Download a package from repository
+ * FNV-1a (64 bit), used for the index name tables
  */
-static int download_package(const char *name, const char *version, char *dest) {
-    CURL *curl = curl_easy_init();
-    if (!curl) {
+static uint64_t hash_name(const char *name) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Perfect hash slot of a name hash under a bucket's seed
+ */
+static uint32_t hash_slot(uint64_t h, uint32_t seed, uint32_t slot_count) {
+    h ^= seed * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)(h % slot_count);
+}
+
+static uint32_t hash_bucket(uint64_t h, uint32_t bucket_count) {
+    return (uint32_t)((h >> 32) % bucket_count);
+}
+
+/**
+ * Compare two version strings
+ *
+ * Versions are split into runs of digits and of letters, anything else
+ * separates them. Digit runs compare numerically and rank above letters;
+ * when one version runs out first the longer one is newer, so
+ * 1.10 > 1.9 and 1.0.1 > 1.0.
+ */
+static int version_compare(const char *a, const char *b) {
+    for (;;) {
+        while (*a && !isalnum((unsigned char)*a))
+            a++;
+        while (*b && !isalnum((unsigned char)*b))
+            b++;
+        if (!*a || !*b)
+            return (*a != '\0') - (*b != '\0');
+
+        int digit_a = isdigit((unsigned char)*a) != 0;
+        int digit_b = isdigit((unsigned char)*b) != 0;
+        if (digit_a != digit_b)
+            return digit_a ? 1 : -1;
+
+        const char *end_a = a, *end_b = b;
+        if (digit_a) {
+            while (*a == '0')
+                a++;
+            while (*b == '0')
+                b++;
+            for (end_a = a; isdigit((unsigned char)*end_a); end_a++)
+                ;
+            for (end_b = b; isdigit((unsigned char)*end_b); end_b++)
+                ;
+            if (end_a - a != end_b - b)
+                return end_a - a > end_b - b ? 1 : -1;
+        } else {
+            while (isalpha((unsigned char)*end_a))
+                end_a++;
+            while (isalpha((unsigned char)*end_b))
+                end_b++;
+        }
+
+        size_t len_a = (size_t)(end_a - a), len_b = (size_t)(end_b - b);
+        int cmp = strncmp(a, b, len_a < len_b ? len_a : len_b);
+        if (cmp != 0)
+            return cmp > 0 ? 1 : -1;
+        if (len_a != len_b)
+            return len_a > len_b ? 1 : -1;
+        a = end_a;
+        b = end_b;
+    }
+}
+
+/* A package reference from a depends or conflicts list, e.g. "libc>=2.36" */
+typedef struct {
+    char name[128];
+    int op;                     /* CONSTRAINT_* */
+    char version[32];
+} constraint_t;
+
+static int parse_constraint(const char *spec, constraint_t *c) {
+    static const char *const ops[] = { "", "=", "!=", "<", "<=", ">", ">=" };
+
+    while (isspace((unsigned char)*spec))
+        spec++;
+
+    size_t len = strcspn(spec, "<>=! \t");
+    if (len == 0 || len >= sizeof(c->name))
         return -1;
+    memcpy(c->name, spec, len);
+    c->name[len] = '\0';
+    spec += len;
+
+    while (isspace((unsigned char)*spec))
+        spec++;
+    len = strspn(spec, "<>=!");
+    c->op = -1;
+    for (int i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+        if (strlen(ops[i]) == len && strncmp(spec, ops[i], len) == 0)
+            c->op = i;
     }
+    if (c->op < 0)
+        return -1;
+    spec += len;
+
+    while (isspace((unsigned char)*spec))
+        spec++;
+    len = strcspn(spec, " \t");
+    if (len >= sizeof(c->version) || (len == 0) != (c->op == CONSTRAINT_ANY))
+        return -1;
+    memcpy(c->version, spec, len);
+    c->version[len] = '\0';
+    return 0;
+}
+
+static int constraint_allows(int op, const char *want, const char *version) {
+    if (op == CONSTRAINT_ANY)
+        return 1;
+
+    int cmp = version_compare(version, want);
+    switch (op) {
+    case CONSTRAINT_EQ:
+        return cmp == 0;
+    case CONSTRAINT_NE:
+        return cmp != 0;
+    case CONSTRAINT_LT:
+        return cmp < 0;
+    case CONSTRAINT_LE:
+        return cmp <= 0;
+    case CONSTRAINT_GT:
+        return cmp > 0;
+    default:
+        return cmp >= 0;
+    }
+}
+
+/**
+ * Split a comma separated list into strdup'ed entries
+ */
+static int split_list(char *list, char **entries, int max, const char *pkg) {
+    int count = 0;
+
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        while (isspace((unsigned char)*tok))
+            tok++;
+        if (*tok == '\0')
+            continue;
+        if (count == max) {
+            fprintf(stderr, "Warning: %s lists more than %d entries, ignoring %s\n",
+                    pkg, max, tok);
+            continue;
+        }
+        char *entry = strdup(tok);
+        if (!entry) {
+            fprintf(stderr, "Warning: %s: out of memory, ignoring %s\n", pkg, tok);
+            continue;
+        }
+        entries[count++] = entry;
+    }
+    return count;
+}
+
+/**
+ * Parse one index line in place
+ */
+static int parse_index_line(char *line, package_t *pkg) {
+    /* Split in place; empty fields are kept */
+    char *fields[8] = { 0 };
+    char *p = line;
+    for (int i = 0; i < 8 && p; i++) {
+        fields[i] = p;
+        p = strchr(p, '|');
+        if (p)
+            *p++ = '\0';
+    }
+    if (!fields[4] || fields[0][0] == '\0' || strlen(fields[0]) >= sizeof(pkg->name))
+        return -1;
+
+    memset(pkg, 0, sizeof(*pkg));
+    snprintf(pkg->name, sizeof(pkg->name), "%s", fields[0]);
+    snprintf(pkg->version, sizeof(pkg->version), "%s", fields[1]);
+    snprintf(pkg->arch, sizeof(pkg->arch), "%s", fields[2]);
+    pkg->size = (size_t)strtoull(fields[3], NULL, 10);
+    snprintf(pkg->checksum, sizeof(pkg->checksum), "%s", fields[4]);
+    if (fields[5])
+        pkg->dep_count = split_list(fields[5], pkg->dependencies, MAX_DEPENDENCIES, pkg->name);
+    if (fields[6])
+        snprintf(pkg->description, sizeof(pkg->description), "%s", fields[6]);
+    if (fields[7])
+        pkg->conflict_count = split_list(fields[7], pkg->conflicts, MAX_CONFLICTS, pkg->name);
+    return 0;
+}
+
+static void free_package(package_t *pkg) {
+    for (int i = 0; i < pkg->dep_count; i++)
+        free(pkg->dependencies[i]);
+    for (int i = 0; i < pkg->conflict_count; i++)
+        free(pkg->conflicts[i]);
+    pkg->dep_count = 0;
+    pkg->conflict_count = 0;
+}
+
+/* Growable byte buffer for building the index image */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+} buffer_t;
+
+static int buffer_append(buffer_t *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->len + len)
+            cap *= 2;
+        char *p = realloc(b->data, cap);
+        if (!p) {
+            b->failed = 1;
+            return -1;
+        }
+        b->data = p;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
 
-    FILE *f = fopen(dest, "wb");
+static uint32_t add_string(buffer_t *strings, const char *s) {
+    uint32_t off = (uint32_t)strings->len;
+    buffer_append(strings, s, strlen(s) + 1);
+    return off;
+}
+
+/* Bounds checked accessors for the compiled index */
+static const char *index_string(const index_t *index, uint32_t off) {
+    if (off >= index->hdr->strings_size)
+        return "";
+    return index->image + index->hdr->strings + off;
+}
+
+static const pkgidx_edge_t *index_edges(const index_t *index, uint32_t first, uint32_t n) {
+    if (first > index->hdr->edge_count || n > index->hdr->edge_count - first)
+        return NULL;
+    return index->edges + first;
+}
+
+/**
+ * Check an index image and point the accessors into it
+ *
+ * Takes ownership of image: it is unmapped or freed on failure and by
+ * free_index().
+ */
+static int index_open(index_t *index, char *image, size_t size, int mapped) {
+    const pkgidx_header_t *hdr = (const pkgidx_header_t *)image;
+
+    memset(index, 0, sizeof(*index));
+
+    int valid = size >= sizeof(*hdr) &&
+        memcmp(hdr->magic, PKGIDX_MAGIC, sizeof(hdr->magic)) == 0 &&
+        hdr->version == PKGIDX_VERSION && hdr->file_size == size &&
+        hdr->records <= size && hdr->records % 8 == 0 &&
+        hdr->package_count <= (size - hdr->records) / sizeof(pkgidx_record_t) &&
+        hdr->edges <= size && hdr->edges % sizeof(uint32_t) == 0 &&
+        hdr->edge_count <= (size - hdr->edges) / sizeof(pkgidx_edge_t) &&
+        hdr->seeds <= size && hdr->seeds % sizeof(uint32_t) == 0 &&
+        hdr->bucket_count <= (size - hdr->seeds) / sizeof(uint32_t) &&
+        hdr->slots <= size && hdr->slots % sizeof(uint32_t) == 0 &&
+        hdr->slot_count <= (size - hdr->slots) / sizeof(uint32_t) &&
+        hdr->bucket_count > 0 && hdr->slot_count > 0 &&
+        hdr->strings <= size && hdr->strings_size <= size - hdr->strings &&
+        hdr->strings_size > 0 && image[hdr->strings + hdr->strings_size - 1] == '\0';
+
+    /* The resolver walks a name's versions, so every group must be in range */
+    const pkgidx_record_t *recs = (const pkgidx_record_t *)(image + hdr->records);
+    for (uint32_t i = 0; valid && i < hdr->package_count; i++) {
+        valid = recs[i].first <= i && recs[i].versions > i - recs[i].first &&
+                recs[i].versions <= hdr->package_count - recs[i].first;
+    }
+
+    if (!valid) {
+        if (mapped)
+            munmap(image, size);
+        else
+            free(image);
+        return -1;
+    }
+
+    index->image = image;
+    index->size = size;
+    index->mapped = mapped;
+    index->hdr = hdr;
+    index->recs = recs;
+    index->edges = (const pkgidx_edge_t *)(image + hdr->edges);
+    index->seeds = (const uint32_t *)(image + hdr->seeds);
+    index->slots = (const uint32_t *)(image + hdr->slots);
+    index->count = hdr->package_count;
+    return 0;
+}
+
+static void free_index(index_t *index) {
+    if (index->mapped)
+        munmap(index->image, index->size);
+    else
+        free(index->image);
+    memset(index, 0, sizeof(*index));
+}
+
+/**
+ * Find a package in the index by name
+ *
+ * Returns its record number, or -1.
+ */
+static int index_lookup(const index_t *index, const char *name) {
+    const pkgidx_header_t *hdr = index->hdr;
+
+    if (index->count == 0)
+        return -1;
+
+    uint64_t h = hash_name(name);
+    uint32_t seed = index->seeds[hash_bucket(h, hdr->bucket_count)];
+    uint32_t r = index->slots[hash_slot(h, seed, hdr->slot_count)];
+
+    if (r == 0 || r > index->count || strcmp(index_string(index, index->recs[r - 1].name), name))
+        return -1;
+    return (int)r - 1;
+}
+
+/* Packages being compiled, for compare_packages() */
+static const package_t *sort_packages;
+
+/* By name, then highest version first, then in index order */
+static int compare_packages(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    int cmp = strcmp(sort_packages[x].name, sort_packages[y].name);
+    if (cmp == 0)
+        cmp = version_compare(sort_packages[y].version, sort_packages[x].version);
+    if (cmp == 0)
+        cmp = x < y ? -1 : x > y;
+    return cmp;
+}
+
+static int compare_desc(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/**
+ * Choose a seed for every bucket so that all names land in distinct slots
+ *
+ * Buckets are placed largest first, while the table is still empty; with
+ * about four names per bucket and the table 90% full this needs a handful
+ * of tries per bucket.
+ */
+static int build_perfect_hash(const uint64_t *hashes, uint32_t count, uint32_t bucket_count,
+                              uint32_t slot_count, uint32_t *seeds, uint32_t *slots) {
+    uint32_t *start = calloc((size_t)bucket_count + 1, sizeof(uint32_t));
+    uint32_t *members = malloc(((size_t)count + 1) * sizeof(uint32_t));
+    uint64_t *order = malloc((size_t)bucket_count * sizeof(uint64_t));
+    int ret = -1;
+
+    if (!start || !members || !order)
+        goto out;
+
+    /* Names grouped by bucket */
+    for (uint32_t i = 0; i < count; i++)
+        start[hash_bucket(hashes[i], bucket_count) + 1]++;
+    for (uint32_t b = 0; b < bucket_count; b++)
+        start[b + 1] += start[b];
+    uint32_t *fill = malloc(((size_t)bucket_count + 1) * sizeof(uint32_t));
+    if (!fill)
+        goto out;
+    memcpy(fill, start, ((size_t)bucket_count + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++)
+        members[fill[hash_bucket(hashes[i], bucket_count)]++] = i;
+    free(fill);
+
+    /* Largest buckets first: size in the high word, sorted descending */
+    for (uint32_t b = 0; b < bucket_count; b++)
+        order[b] = (uint64_t)(start[b + 1] - start[b]) << 32 | b;
+    qsort(order, bucket_count, sizeof(uint64_t), compare_desc);
+
+    memset(slots, 0, (size_t)slot_count * sizeof(uint32_t));
+    memset(seeds, 0, (size_t)bucket_count * sizeof(uint32_t));
+
+    for (uint32_t o = 0; o < bucket_count; o++) {
+        uint32_t b = (uint32_t)order[o];
+        uint32_t first = start[b], last = start[b + 1];
+        uint32_t seed;
+
+        if (first == last)
+            break;
+
+        for (seed = 0; seed < (1u << 20); seed++) {
+            uint32_t placed = first;
+            for (; placed < last; placed++) {
+                uint32_t s = hash_slot(hashes[members[placed]], seed, slot_count);
+                if (slots[s])
+                    break;
+                slots[s] = members[placed] + 1;
+            }
+            if (placed == last)
+                break;
+
+            /* Collision: take back this bucket's names and try the next seed */
+            while (placed-- > first)
+                slots[hash_slot(hashes[members[placed]], seed, slot_count)] = 0;
+        }
+        if (seed == (1u << 20))
+            goto out;
+        seeds[b] = seed;
+    }
+    ret = 0;
+
+out:
+    free(start);
+    free(members);
+    free(order);
+    return ret;
+}
+
+/**
+ * Compile the text index into a binary index
+ *
+ * The image is written atomically to db_path when that is possible, and
+ * is returned in index either way, so a user who cannot write the cache
+ * still gets a working index.
+ */
+static int compile_index(const char *text_path, const char *db_path, index_t *index) {
+    FILE *f = fopen(text_path, "r");
     if (!f) {
-        curl_easy_cleanup(curl);
+        fprintf(stderr, "Package index not found. Run 'ice-pkg update' first.\n");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fileno(f), &st) < 0) {
+        fclose(f);
+        return -1;
+    }
+
+    package_t *pkgs = NULL;
+    uint32_t count = 0, capacity = 0;
+    char line[4096];
+    package_t pkg;
+    int ret = -1;
+
+    uint64_t *hashes = NULL;
+    uint32_t *firsts = NULL, *seeds = NULL, *slots = NULL;
+    pkgidx_record_t *recs = NULL;
+    buffer_t edges = { 0 }, strings = { 0 };
+
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '\0' || line[0] == '#' || parse_index_line(line, &pkg) != 0)
+            continue;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            package_t *grown = realloc(pkgs, (size_t)capacity * sizeof(package_t));
+            if (!grown) {
+                free_package(&pkg);
+                break;
+            }
+            pkgs = grown;
+        }
+        pkgs[count++] = pkg;
+    }
+    int read_all = !ferror(f) && feof(f);
+    fclose(f);
+
+    /* Every version of a name together, highest first; exact duplicates are dropped */
+    uint32_t *order = malloc(((size_t)count + 1) * sizeof(uint32_t));
+    package_t *sorted = malloc(((size_t)count + 1) * sizeof(package_t));
+    uint32_t kept = 0, names = 0;
+
+    if (!read_all || !order || !sorted) {
+        fprintf(stderr, "Failed to read %s\n", text_path);
+        free(order);
+        free(sorted);
+        goto out;
+    }
+    for (uint32_t i = 0; i < count; i++)
+        order[i] = i;
+    sort_packages = pkgs;
+    qsort(order, count, sizeof(uint32_t), compare_packages);
+
+    for (uint32_t i = 0; i < count; i++) {
+        package_t *p = &pkgs[order[i]];
+        if (kept > 0 && strcmp(sorted[kept - 1].name, p->name) == 0 &&
+            version_compare(sorted[kept - 1].version, p->version) == 0) {
+            free_package(p);
+            continue;
+        }
+        if (kept == 0 || strcmp(sorted[kept - 1].name, p->name) != 0)
+            names++;
+        sorted[kept++] = *p;
+    }
+    free(order);
+    free(pkgs);
+    pkgs = sorted;
+    count = kept;
+
+    /* Name tables sized for the names: 4 per bucket, slots 90% full */
+    uint32_t bucket_count = names / 4 + 1;
+    uint32_t slot_count = names + names / 9 + 1;
+    hashes = malloc(((size_t)names + 1) * sizeof(uint64_t));
+    firsts = malloc(((size_t)names + 1) * sizeof(uint32_t));
+    seeds = malloc((size_t)bucket_count * sizeof(uint32_t));
+    slots = calloc(slot_count, sizeof(uint32_t));
+    recs = calloc((size_t)count + 1, sizeof(pkgidx_record_t));
+
+    if (!hashes || !firsts || !seeds || !slots || !recs) {
+        fprintf(stderr, "Out of memory compiling the package index\n");
+        goto out;
+    }
+
+    /* slots serves as a plain open addressed table until the perfect hash is built */
+    for (uint32_t i = 0, g = 0; i < count; i++) {
+        if (i > 0 && strcmp(pkgs[i].name, pkgs[recs[i - 1].first].name) == 0) {
+            recs[i].first = recs[i - 1].first;
+            continue;
+        }
+        uint64_t h = hash_name(pkgs[i].name);
+        recs[i].first = i;
+        hashes[g] = h;
+        firsts[g++] = i;
+
+        uint32_t s = (uint32_t)(h % slot_count);
+        while (slots[s])
+            s = (s + 1) % slot_count;
+        slots[s] = i + 1;
+    }
+    for (uint32_t i = count; i-- > 0;)
+        recs[i].versions = i + 1 < count && recs[i + 1].first == recs[i].first ?
+                           recs[i + 1].versions : i + 1 - recs[i].first;
+
+    /* Records, with every depends and conflicts entry resolved to an edge */
+    add_string(&strings, "");
+    for (uint32_t i = 0; i < count; i++) {
+        package_t *p = &pkgs[i];
+        pkgidx_record_t *rec = &recs[i];
+
+        rec->size = p->size;
+        rec->name = add_string(&strings, p->name);
+        rec->version = add_string(&strings, p->version);
+        rec->arch = add_string(&strings, p->arch);
+        rec->checksum = add_string(&strings, p->checksum);
+        rec->description = add_string(&strings, p->description);
+
+        for (int list = 0; list < 2; list++) {
+            char **entries = list ? p->conflicts : p->dependencies;
+            int n = list ? p->conflict_count : p->dep_count;
+            uint32_t first = (uint32_t)(edges.len / sizeof(pkgidx_edge_t));
+            uint16_t added = 0;
+
+            for (int j = 0; j < n; j++) {
+                constraint_t c;
+                if (parse_constraint(entries[j], &c) != 0) {
+                    fprintf(stderr, "Warning: %s: ignoring invalid entry '%s'\n",
+                            p->name, entries[j]);
+                    continue;
+                }
+
+                pkgidx_edge_t edge = { PKGIDX_NONE, 0, 0, (uint32_t)c.op };
+                uint32_t s = (uint32_t)(hash_name(c.name) % slot_count);
+                for (; slots[s]; s = (s + 1) % slot_count) {
+                    if (strcmp(pkgs[slots[s] - 1].name, c.name) == 0) {
+                        edge.target = slots[s] - 1;
+                        break;
+                    }
+                }
+                edge.spec = add_string(&strings, entries[j]);
+                edge.version = add_string(&strings, c.version);
+                buffer_append(&edges, &edge, sizeof(edge));
+                added++;
+            }
+
+            if (list) {
+                rec->conflicts = first;
+                rec->conflict_count = added;
+            } else {
+                rec->deps = first;
+                rec->dep_count = added;
+            }
+        }
+    }
+
+    if (strings.failed || edges.failed || strings.len > UINT32_MAX / 2) {
+        fprintf(stderr, "Package index too large\n");
+        goto out;
+    }
+
+    if (build_perfect_hash(hashes, names, bucket_count, slot_count, seeds, slots) != 0) {
+        fprintf(stderr, "Failed to build the package name index\n");
+        goto out;
+    }
+    for (uint32_t s = 0; s < slot_count; s++) {
+        if (slots[s])
+            slots[s] = firsts[slots[s] - 1] + 1;
+    }
+
+    /* Assemble the image: header, records, edges, seeds, slots, strings */
+    pkgidx_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PKGIDX_MAGIC, sizeof(hdr.magic));
+    hdr.version = PKGIDX_VERSION;
+    hdr.package_count = count;
+    hdr.source_mtime_sec = st.st_mtim.tv_sec;
+    hdr.source_mtime_nsec = st.st_mtim.tv_nsec;
+    hdr.source_size = (uint64_t)st.st_size;
+    hdr.records = sizeof(hdr);
+    hdr.edges = hdr.records + count * (uint32_t)sizeof(pkgidx_record_t);
+    hdr.edge_count = (uint32_t)(edges.len / sizeof(pkgidx_edge_t));
+    hdr.seeds = hdr.edges + (uint32_t)edges.len;
+    hdr.bucket_count = bucket_count;
+    hdr.slots = hdr.seeds + bucket_count * (uint32_t)sizeof(uint32_t);
+    hdr.slot_count = slot_count;
+    hdr.strings = hdr.slots + slot_count * (uint32_t)sizeof(uint32_t);
+    hdr.strings_size = (uint32_t)strings.len;
+    hdr.file_size = hdr.strings + hdr.strings_size;
+    hdr.name_count = names;
+
+    buffer_t image = { 0 };
+    buffer_append(&image, &hdr, sizeof(hdr));
+    buffer_append(&image, recs, count * sizeof(pkgidx_record_t));
+    if (edges.len)
+        buffer_append(&image, edges.data, edges.len);
+    buffer_append(&image, seeds, bucket_count * sizeof(uint32_t));
+    buffer_append(&image, slots, slot_count * sizeof(uint32_t));
+    buffer_append(&image, strings.data, strings.len);
+    if (image.failed) {
+        fprintf(stderr, "Out of memory compiling the package index\n");
+        free(image.data);
+        goto out;
+    }
+
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", db_path);
+
+    FILE *out = fopen(tmp_path, "wb");
+    if (out) {
+        int ok = fwrite(image.data, image.len, 1, out) == 1;
+        if (fclose(out) != 0 || !ok || rename(tmp_path, db_path) != 0) {
+            fprintf(stderr, "Failed to write %s: %s\n", db_path, strerror(errno));
+            unlink(tmp_path);
+        }
+    }
+
+    ret = index_open(index, image.data, image.len, 0);
+
+out:
+    for (uint32_t i = 0; i < count; i++)
+        free_package(&pkgs[i]);
+    free(pkgs);
+    free(hashes);
+    free(firsts);
+    free(seeds);
+    free(slots);
+    free(recs);
+    free(edges.data);
+    free(strings.data);
+    return ret;
+}
+
+/**
+ * Map the compiled index
+ *
+ * A missing, malformed or stale index.db (older than index.txt) is
+ * recompiled first.
+ */
+static int load_index(index_t *index) {
+    struct stat st;
+
+    if (stat(INDEX_TEXT, &st) < 0) {
+        fprintf(stderr, "Package index not found. Run 'ice-pkg update' first.\n");
+        return -1;
+    }
+
+    int fd = open(INDEX_DB, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        struct stat dst;
+        void *map = MAP_FAILED;
+
+        if (fstat(fd, &dst) == 0 && dst.st_size > 0)
+            map = mmap(NULL, (size_t)dst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (map != MAP_FAILED && index_open(index, map, (size_t)dst.st_size, 1) == 0) {
+            const pkgidx_header_t *hdr = index->hdr;
+            if (hdr->source_mtime_sec == st.st_mtim.tv_sec &&
+                hdr->source_mtime_nsec == st.st_mtim.tv_nsec &&
+                hdr->source_size == (uint64_t)st.st_size)
+                return 0;
+            free_index(index);
+        }
+    }
+
+    return compile_index(INDEX_TEXT, INDEX_DB, index);
+}
+
+/**
+ * Copy what installing needs out of an index record
+ */
+static void index_package(const index_t *index, int i, package_t *pkg) {
+    const pkgidx_record_t *rec = &index->recs[i];
+
+    memset(pkg, 0, sizeof(*pkg));
+    snprintf(pkg->name, sizeof(pkg->name), "%s", index_string(index, rec->name));
+    snprintf(pkg->version, sizeof(pkg->version), "%s", index_string(index, rec->version));
+    snprintf(pkg->arch, sizeof(pkg->arch), "%s", index_string(index, rec->arch));
+    snprintf(pkg->checksum, sizeof(pkg->checksum), "%s", index_string(index, rec->checksum));
+    snprintf(pkg->description, sizeof(pkg->description), "%s",
+             index_string(index, rec->description));
+    pkg->size = (size_t)rec->size;
+}
+
+static const char *index_name(const index_t *index, int i) {
+    return index_string(index, index->recs[i].name);
+}
+
+/*
+ * Dependency resolution
+ *
+ * A walk over the dependency graph. The first requirement on a name picks
+ * its highest version that satisfies it, unless the installed version
+ * already does. When a later requirement rules out a version picked
+ * earlier, that version is banned and the walk starts over, so every name
+ * settles on the highest version all its requirements accept. Each
+ * restart bans one more record, so this ends. Only the final walk reports,
+ * and it collects every problem before giving up so one run shows
+ * everything that blocks the install.
+ */
+#define RESOLVE_PLANNED     0x01
+#define RESOLVE_INSTALLED   0x02    /* On a name's first record */
+#define RESOLVE_VERSION     0x04    /* Installed version read */
+#define RESOLVE_VISITING    0x08    /* On the ordering DFS stack */
+#define RESOLVE_ORDERED     0x10
+#define RESOLVE_BANNED      0x20    /* Ruled out by a requirement */
+
+typedef struct {
+    const index_t *index;
+    uint8_t *state;             /* RESOLVE_* per index entry */
+    char (*installed)[32];      /* Installed version, valid with RESOLVE_VERSION */
+    int *queue;                 /* Planned packages in discovery order */
+    int queued;
+    int *edge_from;             /* Dependencies between planned packages */
+    int *edge_to;
+    int edges;
+    int edge_capacity;
+    int errors;
+    int restart;                /* A picked version was banned */
+    int report;                 /* Print problems; only on the final walk */
+} resolver_t;
+
+static void resolver_error(resolver_t *r, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void resolver_error(resolver_t *r, const char *fmt, ...) {
+    va_list ap;
+
+    r->errors++;
+    if (!r->report)
+        return;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * Find the planned version of the name whose first record is i, or -1
+ */
+static int resolver_planned(const resolver_t *r, int i) {
+    const pkgidx_record_t *rec = &r->index->recs[i];
+    for (uint32_t k = rec->first; k < rec->first + rec->versions; k++) {
+        if (r->state[k] & RESOLVE_PLANNED)
+            return (int)k;
+    }
+    return -1;
+}
+
+/**
+ * Pick the highest version of a name that is not banned and satisfies a
+ * constraint, or -1
+ */
+static int resolver_pick(const resolver_t *r, int i, int op, const char *want) {
+    const pkgidx_record_t *rec = &r->index->recs[i];
+    for (uint32_t k = rec->first; k < rec->first + rec->versions; k++) {
+        if (!(r->state[k] & RESOLVE_BANNED) &&
+            constraint_allows(op, want, index_string(r->index, r->index->recs[k].version)))
+            return (int)k;
+    }
+    return -1;
+}
+
+/**
+ * Check whether a package is installed, reading its version on first use
+ */
+static int resolver_installed(resolver_t *r, int i) {
+    if (!(r->state[i] & RESOLVE_INSTALLED))
+        return 0;
+    if (r->state[i] & RESOLVE_VERSION)
+        return 1;
+    r->state[i] |= RESOLVE_VERSION;
+    r->installed[i][0] = '\0';
+
+    char db_path[512];
+    snprintf(db_path, sizeof(db_path), "/var/lib/ice-pkg/%s.installed",
+             index_name(r->index, i));
+
+    FILE *f = fopen(db_path, "r");
+    if (!f)
+        return 1;
+
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "version=", 8) == 0) {
+            line[strcspn(line, "\n")] = 0;
+            snprintf(r->installed[i], sizeof(r->installed[i]), "%.31s", line + 8);
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+static int resolver_add_edge(resolver_t *r, int from, int to) {
+    if (r->edges == r->edge_capacity) {
+        int capacity = r->edge_capacity ? r->edge_capacity * 2 : 256;
+        int *from_list = realloc(r->edge_from, (size_t)capacity * sizeof(int));
+        if (!from_list)
+            return -1;
+        r->edge_from = from_list;
+        int *to_list = realloc(r->edge_to, (size_t)capacity * sizeof(int));
+        if (!to_list)
+            return -1;
+        r->edge_to = to_list;
+        r->edge_capacity = capacity;
+    }
+    r->edge_from[r->edges] = from;
+    r->edge_to[r->edges] = to;
+    r->edges++;
+    return 0;
+}
+
+/**
+ * Check one requirement on package i and plan it
+ *
+ * from is the requiring package, or -1 for a package named on the
+ * command line; i is the first record of the name, or -1 if the index has
+ * no such package.
+ */
+static void resolver_require(resolver_t *r, int from, const char *spec, int i, int op,
+                             const char *want) {
+    const index_t *index = r->index;
+    const char *who = from >= 0 ? index_name(index, from) : NULL;
+
+    if (i < 0) {
+        if (who)
+            resolver_error(r, "Error: %s requires %s, which is not in the index\n", who, spec);
+        else
+            resolver_error(r, "Error: Package %s not found in the index\n", spec);
+        return;
+    }
+
+    i = (int)index->recs[i].first;
+    const pkgidx_record_t *rec = &index->recs[i];
+    const char *name = index_string(index, rec->name);
+    int k = resolver_planned(r, i);
+
+    if (k < 0 && resolver_installed(r, i)) {
+        if (constraint_allows(op, want, r->installed[i])) {
+            if (!who && r->report)
+                printf("Package %s is already installed\n", name);
+            return;
+        }
+        resolver_error(r, "Error: %s%s %s, but %s %s is installed\n",
+                       who ? who : "", who ? " requires" : "Requested", spec,
+                       name, r->installed[i]);
+        return;
+    }
+
+    if (k >= 0 && !constraint_allows(op, want, index_string(index, index->recs[k].version))) {
+        /* Picked for an earlier requirement: start over without it */
+        r->state[k] |= RESOLVE_BANNED;
+        r->restart = 1;
+        return;
+    }
+
+    if (k < 0) {
+        k = resolver_pick(r, i, op, want);
+        if (k < 0) {
+            if (rec->versions == 1)
+                resolver_error(r, "Error: %s%s %s, but the index has %s %s\n",
+                               who ? who : "", who ? " requires" : "Requested", spec,
+                               name, index_string(index, rec->version));
+            else
+                resolver_error(r, "Error: %s%s %s, but no version of %s in the index "
+                               "fits every requirement\n",
+                               who ? who : "", who ? " requires" : "Requested", spec, name);
+            return;
+        }
+        if (strlen(index_string(index, index->recs[k].checksum)) != 64) {
+            resolver_error(r, "Error: Package %s %s has no valid checksum in the index\n",
+                           name, index_string(index, index->recs[k].version));
+            return;
+        }
+    }
+
+    if (from >= 0 && resolver_add_edge(r, from, k) != 0) {
+        resolver_error(r, "Error: Out of memory resolving dependencies\n");
+        return;
+    }
+    if (!(r->state[k] & RESOLVE_PLANNED)) {
+        r->state[k] |= RESOLVE_PLANNED;
+        r->queue[r->queued++] = k;
+    }
+}
+
+/**
+ * Report a conflict entry of package i that matches a planned or
+ * installed package
+ */
+static void resolver_conflicts(resolver_t *r, int i, int planned_only) {
+    const index_t *index = r->index;
+    const pkgidx_record_t *rec = &index->recs[i];
+    const pkgidx_edge_t *edges = index_edges(index, rec->conflicts, rec->conflict_count);
+
+    for (int j = 0; edges && j < rec->conflict_count; j++) {
+        const pkgidx_edge_t *e = &edges[j];
+        int k = e->target < index->count ? (int)index->recs[e->target].first : -1;
+        const char *want = index_string(index, e->version);
+
+        if (k < 0 || k == (int)rec->first)
+            continue;
+
+        int planned = resolver_planned(r, k);
+        if (planned >= 0) {
+            const char *version = index_string(index, index->recs[planned].version);
+            if (constraint_allows((int)e->op, want, version)) {
+                resolver_error(r, "Error: %s conflicts with %s %s, both would be installed\n",
+                               index_name(index, i), index_name(index, k), version);
+            }
+        } else if (!planned_only && resolver_installed(r, k) &&
+                   constraint_allows((int)e->op, want, r->installed[k])) {
+            resolver_error(r, "Error: %s conflicts with the installed %s %s\n",
+                           index_name(index, i), index_name(index, k), r->installed[k]);
+        }
+    }
+}
+
+/**
+ * The record of an installed name's version, or its first record if the
+ * index no longer lists that version
+ */
+static int resolver_installed_record(resolver_t *r, int i) {
+    const pkgidx_record_t *rec = &r->index->recs[i];
+    resolver_installed(r, i);
+    for (uint32_t k = rec->first; k < rec->first + rec->versions; k++) {
+        if (version_compare(index_string(r->index, r->index->recs[k].version),
+                            r->installed[i]) == 0)
+            return (int)k;
+    }
+    return i;
+}
+
+/**
+ * Append package root to the plan after its planned dependencies
+ *
+ * Depth first with an explicit stack of (package, next dependency) pairs,
+ * as dependency chains can be as long as the index.
+ */
+static void resolver_order(resolver_t *r, const int *start, const int *deps, int root,
+                           int *stack, int *order, int *count) {
+    int depth = 1;
+
+    if (r->state[root] & RESOLVE_ORDERED)
+        return;
+    r->state[root] |= RESOLVE_VISITING;
+    stack[0] = root;
+    stack[1] = start[root];
+
+    while (depth > 0) {
+        int *frame = &stack[2 * (depth - 1)];
+        int i = frame[0];
+
+        if (frame[1] < start[i + 1]) {
+            int dep = deps[frame[1]++];
+
+            if (r->state[dep] & RESOLVE_ORDERED)
+                continue;
+            if (r->state[dep] & RESOLVE_VISITING) {
+                resolver_error(r, "Error: Dependency cycle through %s\n",
+                               index_name(r->index, dep));
+                continue;
+            }
+            r->state[dep] |= RESOLVE_VISITING;
+            stack[2 * depth] = dep;
+            stack[2 * depth + 1] = start[dep];
+            depth++;
+            continue;
+        }
+
+        r->state[i] &= (uint8_t)~RESOLVE_VISITING;
+        r->state[i] |= RESOLVE_ORDERED;
+        order[(*count)++] = i;
+        depth--;
+    }
+}
+
+/**
+ * Plan the requested packages and their dependencies from scratch
+ *
+ * Stops early, with restart set, when a version picked earlier in the
+ * walk has been banned.
+ */
+static void resolver_walk(resolver_t *r, int argc, char *argv[]) {
+    const index_t *index = r->index;
+    int n = (int)index->count;
+
+    for (int i = 0; i < n; i++)
+        r->state[i] &= RESOLVE_INSTALLED | RESOLVE_VERSION | RESOLVE_BANNED;
+    r->queued = 0;
+    r->edges = 0;
+    r->errors = 0;
+    r->restart = 0;
+
+    /* Transitive closure, breadth first, over the precomputed edges */
+    for (int i = 0; i < argc && !r->restart; i++) {
+        constraint_t c;
+        if (parse_constraint(argv[i], &c) != 0) {
+            resolver_error(r, "Error: invalid package reference '%s'\n", argv[i]);
+            continue;
+        }
+        int target = index_lookup(index, c.name);
+        resolver_require(r, -1, target < 0 ? c.name : argv[i], target, c.op, c.version);
+    }
+    for (int q = 0; q < r->queued && !r->restart; q++) {
+        const pkgidx_record_t *rec = &index->recs[r->queue[q]];
+        const pkgidx_edge_t *edges = index_edges(index, rec->deps, rec->dep_count);
+
+        for (int j = 0; edges && j < rec->dep_count; j++) {
+            const pkgidx_edge_t *e = &edges[j];
+            resolver_require(r, r->queue[q], index_string(index, e->spec),
+                             e->target < index->count ? (int)e->target : -1,
+                             (int)e->op, index_string(index, e->version));
+        }
+    }
+    if (r->restart)
+        return;
+
+    /* Conflicts in both directions, including those of installed packages */
+    for (int i = 0; i < n; i++) {
+        if (r->state[i] & RESOLVE_PLANNED)
+            resolver_conflicts(r, i, 0);
+        else if ((r->state[i] & RESOLVE_INSTALLED) && resolver_planned(r, i) < 0)
+            resolver_conflicts(r, resolver_installed_record(r, i), 1);
+    }
+}
+
+/**
+ * Resolve the requested packages into an install plan
+ *
+ * Computes the transitive closure of their dependencies, leaving out what
+ * is already installed in a suitable version, checks every version
+ * constraint and conflict, and orders the result so each package follows
+ * its dependencies. Nothing is planned if any check fails.
+ */
+static int resolve_packages(const index_t *index, int argc, char *argv[], plan_t *plan) {
+    resolver_t r;
+    int n = (int)index->count;
+
+    memset(&r, 0, sizeof(r));
+    memset(plan, 0, sizeof(*plan));
+    r.index = index;
+    r.state = calloc((size_t)n + 1, 1);
+    r.installed = malloc(((size_t)n + 1) * sizeof(*r.installed));
+    r.queue = malloc(((size_t)n + 1) * sizeof(int));
+
+    int *start = calloc((size_t)n + 2, sizeof(int));
+    int *deps = NULL;
+    int *order = NULL;
+    int *stack = NULL;
+    int count = 0;
+
+    if (!r.state || !r.installed || !r.queue || !start) {
+        fprintf(stderr, "Error: Out of memory resolving dependencies\n");
+        r.errors++;
+        goto out;
+    }
+
+    /* What is installed, from one scan of the database */
+    DIR *dir = opendir("/var/lib/ice-pkg");
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            char *dot = strstr(entry->d_name, ".installed");
+            if (!dot || dot[10] != '\0')
+                continue;
+            *dot = '\0';
+            int i = index_lookup(index, entry->d_name);
+            if (i >= 0)
+                r.state[i] |= RESOLVE_INSTALLED;
+        }
+        closedir(dir);
+    }
+
+    /* Quiet walks until no picked version is ruled out, then one that reports */
+    do
+        resolver_walk(&r, argc, argv);
+    while (r.restart);
+    r.report = 1;
+    resolver_walk(&r, argc, argv);
+
+    if (r.errors)
+        goto out;
+
+    /* Dependency lists per package, then a depth first topological order */
+    deps = malloc(((size_t)r.edges + 1) * sizeof(int));
+    order = malloc(((size_t)r.queued + 1) * sizeof(int));
+    stack = malloc(((size_t)r.queued + 1) * 2 * sizeof(int));
+    if (!deps || !order || !stack) {
+        fprintf(stderr, "Error: Out of memory resolving dependencies\n");
+        r.errors++;
+        goto out;
+    }
+    for (int e = 0; e < r.edges; e++)
+        start[r.edge_from[e] + 2]++;
+    for (int i = 0; i < n; i++)
+        start[i + 2] += start[i + 1];
+    for (int e = 0; e < r.edges; e++)
+        deps[start[r.edge_from[e] + 1]++] = r.edge_to[e];
+
+    for (int q = 0; q < r.queued; q++)
+        resolver_order(&r, start, deps, r.queue[q], stack, order, &count);
+    if (r.errors)
+        goto out;
+
+    /* Plan positions replace index positions */
+    plan->pkgs = malloc(((size_t)count + 1) * sizeof(*plan->pkgs));
+    plan->dep_start = malloc(((size_t)count + 1) * sizeof(int));
+    plan->deps = malloc(((size_t)r.edges + 1) * sizeof(int));
+    int *pos_of = calloc((size_t)n + 1, sizeof(int));
+    if (!plan->pkgs || !plan->dep_start || !plan->deps || !pos_of) {
+        fprintf(stderr, "Error: Out of memory resolving dependencies\n");
+        free(pos_of);
+        r.errors++;
+        goto out;
+    }
+    for (int p = 0; p < count; p++)
+        pos_of[order[p]] = p;
+
+    int edges = 0;
+    for (int p = 0; p < count; p++) {
+        int i = order[p];
+        index_package(index, i, &plan->pkgs[p]);
+        plan->dep_start[p] = edges;
+        for (int j = start[i]; j < start[i + 1]; j++) {
+            int dep = pos_of[deps[j]];
+            int duplicate = 0;
+            for (int k = plan->dep_start[p]; k < edges; k++)
+                duplicate |= plan->deps[k] == dep;
+            if (!duplicate)
+                plan->deps[edges++] = dep;
+        }
+    }
+    plan->dep_start[count] = edges;
+    plan->count = count;
+    free(pos_of);
+
+out:
+    if (r.errors) {
+        fprintf(stderr, "Nothing was installed: %d problem(s) found\n", r.errors);
+        free_plan(plan);
+    }
+    free(r.state);
+    free(r.installed);
+    free(r.queue);
+    free(r.edge_from);
+    free(r.edge_to);
+    free(start);
+    free(deps);
+    free(order);
+    free(stack);
+    return r.errors ? -1 : 0;
+}
+
+static void free_plan(plan_t *plan) {
+    free(plan->pkgs);
+    free(plan->deps);
+    free(plan->dep_start);
+    memset(plan, 0, sizeof(*plan));
+}
+
+/*
+ * SHA-256 (FIPS 180-4)
+ *
+ * The block function is chosen once at runtime: the SHA extensions on
+ * x86, the ARMv8 crypto extensions on arm64, portable C otherwise.
+ */
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_portable(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    while (blocks--) {
+        uint32_t w[64];
+
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 |
+                   (uint32_t)data[i * 4 + 2] << 8 | (uint32_t)data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+            uint32_t s0 = ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += 64;
+    }
+}
+
+#ifdef SHA256_X86
+/*
+ * The SHA extensions keep the state as ABEF and CDGH and run two rounds
+ * per instruction; the message schedule is four words per register.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (blocks--) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i w[4];
+
+        for (int t = 0; t < 16; t++) {
+            if (t < 4) {
+                w[t] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + t * 16)),
+                                        bswap);
+            } else {
+                /* w[t % 4] still holds the words of group t - 4 */
+                __m128i x = _mm_sha256msg1_epu32(w[t % 4], w[(t + 1) % 4]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(w[(t + 3) % 4], w[(t + 2) % 4], 4));
+                w[t % 4] = _mm_sha256msg2_epu32(x, w[(t + 3) % 4]);
+            }
+
+            __m128i msg = _mm_add_epi32(w[t % 4],
+                                        _mm_loadu_si128((const __m128i *)&sha256_k[t * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static int sha256_cpu_has_shani(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+        return 0;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (ebx & (1u << 29)) != 0;
+}
+#endif
+
+#ifdef SHA256_ARM
+__attribute__((target("arch=armv8-a+crypto")))
+static void sha256_blocks_armv8(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+
+    while (blocks--) {
+        uint32x4_t abcd = state0, efgh = state1;
+        uint32x4_t w[4];
+
+        for (int t = 0; t < 16; t++) {
+            if (t < 4) {
+                w[t] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + t * 16)));
+            } else {
+                /* w[t % 4] still holds the words of group t - 4 */
+                w[t % 4] = vsha256su1q_u32(vsha256su0q_u32(w[t % 4], w[(t + 1) % 4]),
+                                           w[(t + 2) % 4], w[(t + 3) % 4]);
+            }
+
+            uint32x4_t wk = vaddq_u32(w[t % 4], vld1q_u32(&sha256_k[t * 4]));
+            uint32x4_t prev = state0;
+            state0 = vsha256hq_u32(state0, state1, wk);
+            state1 = vsha256h2q_u32(state1, prev, wk);
+        }
+
+        state0 = vaddq_u32(state0, abcd);
+        state1 = vaddq_u32(state1, efgh);
+        data += 64;
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+#endif
+
+static void (*sha256_blocks)(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+static void sha256_init(sha256_t *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    if (!sha256_blocks) {
+        sha256_blocks = sha256_blocks_portable;
+#ifdef SHA256_X86
+        if (sha256_cpu_has_shani())
+            sha256_blocks = sha256_blocks_shani;
+#endif
+#if defined(SHA256_ARM) && defined(HWCAP_SHA2)
+        if (getauxval(AT_HWCAP) & HWCAP_SHA2)
+            sha256_blocks = sha256_blocks_armv8;
+#endif
+    }
+
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void sha256_update(sha256_t *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    ctx->length += len;
+    if (ctx->used > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        len -= take;
+        if (ctx->used < 64)
+            return;
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->used = 0;
+    }
+
+    /* Whole blocks are hashed straight from the caller's buffer */
+    if (len >= 64) {
+        sha256_blocks(ctx->state, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(ctx->block, p, len);
+    ctx->used = len;
+}
+
+/**
+ * Finish the hash and write it as 64 lowercase hex digits plus NUL
+ */
+static void sha256_final(sha256_t *ctx, char hex[65]) {
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_len = (ctx->used < 56 ? 56 : 120) - ctx->used;
+
+    for (int i = 0; i < 8; i++)
+        pad[pad_len + i] = (uint8_t)(bits >> (56 - i * 8));
+    sha256_update(ctx, pad, pad_len + 8);
+
+    for (int i = 0; i < 32; i++)
+        snprintf(hex + i * 2, 3, "%02x", (ctx->state[i / 4] >> (24 - (i % 4) * 8)) & 0xff);
+}
+
+/* Where a package is on its way through install_packages() */
+enum {
+    PKG_DOWNLOADING,
+    PKG_VERIFIED,               /* Archive in the cache, waiting for its dependencies */
+    PKG_EXTRACTING,
+    PKG_INSTALLED,
+    PKG_FAILED,
+};
+
+/* One package being installed: its download, hashed as it is written, then extraction */
+typedef struct {
+    const package_t *pkg;
+    char path[512];             /* Verified archive in the cache */
+    char part[520];             /* Download in progress */
+    CURL *curl;
+    FILE *file;
+    sha256_t hash;
+    size_t expected;            /* Archive size from the index, 0 if unknown */
+    size_t received;
+    int size_mismatch;
+    int state;                  /* PKG_* */
+    pid_t extract_pid;          /* tar while PKG_EXTRACTING */
+} download_t;
+
+/**
+ * curl write callback: hash and store each chunk as it arrives
+ *
+ * Returning short makes curl abort the transfer, which is done as soon as
+ * the size announced by the server or the bytes received exceed what the
+ * index lists.
+ */
+static size_t download_write(char *data, size_t size, size_t nmemb, void *userdata) {
+    download_t *dl = userdata;
+    size_t len = size * nmemb;
+
+    if (dl->expected > 0) {
+        curl_off_t announced = -1;
+        if (dl->received == 0 &&
+            curl_easy_getinfo(dl->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                              &announced) == CURLE_OK &&
+            announced >= 0 && (size_t)announced != dl->expected) {
+            dl->size_mismatch = 1;
+            return 0;
+        }
+        if (dl->received + len > dl->expected) {
+            dl->size_mismatch = 1;
+            return 0;
+        }
+    }
+
+    if (fwrite(data, 1, len, dl->file) != len)
+        return 0;
+    sha256_update(&dl->hash, data, len);
+    dl->received += len;
+    return len;
+}
+
+/**
+ * Queue a package download on the multi handle
+ *
+ * The archive is written to dl->part; download_finish() moves it to
+ * dl->path once it is verified.
+ */
+static int download_start(CURLM *multi, download_t *dl) {
+    const package_t *pkg = dl->pkg;
+
+    dl->curl = curl_easy_init();
+    if (!dl->curl)
+        return -1;
+
+    dl->file = fopen(dl->part, "wb");
+    if (!dl->file) {
+        curl_easy_cleanup(dl->curl);
+        dl->curl = NULL;
         return -1;
     }
+    sha256_init(&dl->hash);
+    dl->expected = pkg->size;
+    dl->received = 0;
+    dl->size_mismatch = 0;
 
     /* Construct URL */
     char url[512];
-    const char *arch = "x86_64"; /* TODO: Detect architecture */
     snprintf(url, sizeof(url), "%s/%s/%s-%s-%s.tar.xz",
-             DEFAULT_REPO, arch, name, version, arch);
+             DEFAULT_REPO, pkg->arch, pkg->name, pkg->version, pkg->arch);
+
+    curl_easy_setopt(dl->curl, CURLOPT_URL, url);
+    curl_easy_setopt(dl->curl, CURLOPT_PRIVATE, dl);
+    curl_easy_setopt(dl->curl, CURLOPT_WRITEFUNCTION, download_write);
+    curl_easy_setopt(dl->curl, CURLOPT_WRITEDATA, dl);
+    curl_easy_setopt(dl->curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(dl->curl, CURLOPT_FAILONERROR, 1L);
+
+    /* Prefer waiting for a multiplexed HTTP/2 stream over opening a new connection */
+    curl_easy_setopt(dl->curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(dl->curl, CURLOPT_PIPEWAIT, 1L);
+
+    if (curl_multi_add_handle(multi, dl->curl) != CURLM_OK) {
+        fclose(dl->file);
+        unlink(dl->part);
+        curl_easy_cleanup(dl->curl);
+        dl->curl = NULL;
+        return -1;
+    }
+    return 0;
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+/**
+ * Complete a finished download
+ *
+ * The archive is only renamed into the cache once its size and SHA-256
+ * match the index; otherwise the partial file is removed.
+ */
+static int download_finish(CURLM *multi, download_t *dl, CURLcode res) {
+    const package_t *pkg = dl->pkg;
+
+    curl_multi_remove_handle(multi, dl->curl);
+    curl_easy_cleanup(dl->curl);
+    dl->curl = NULL;
+
+    int ok = fclose(dl->file) == 0 && res == CURLE_OK;
+    dl->file = NULL;
+
+    if (dl->size_mismatch) {
+        fprintf(stderr, "Download of %s aborted: size differs from the index (%zu bytes)\n",
+                pkg->name, pkg->size);
+        ok = 0;
+    } else if (res != CURLE_OK) {
+        fprintf(stderr, "Download of %s failed: %s\n", pkg->name, curl_easy_strerror(res));
+    } else if (ok) {
+        char digest[65];
+        sha256_final(&dl->hash, digest);
+        if (strcasecmp(digest, pkg->checksum) != 0) {
+            fprintf(stderr, "Checksum mismatch for %s: expected %s, got %s\n",
+                    pkg->name, pkg->checksum, digest);
+            ok = 0;
+        }
+    }
 
-    CURLcode res = curl_easy_perform(curl);
+    if (!ok || rename(dl->part, dl->path) != 0) {
+        unlink(dl->part);
+        return -1;
+    }
+    return 0;
+}
 
-    fclose(f);
-    curl_easy_cleanup(curl);
+/**
+ * Record a package as installed
+ */
+static void mark_installed(const package_t *pkg) {
+    char db_path[512];
+    snprintf(db_path, sizeof(db_path), "/var/lib/ice-pkg/%s.installed", pkg->name);
 
-    return (res == CURLE_OK) ? 0 : -1;
+    FILE *f = fopen(db_path, "w");
+    if (f) {
+        fprintf(f, "name=%s\nversion=%s\nsha256=%s\ninstalled=%ld\n",
+                pkg->name, pkg->version, pkg->checksum, (long)time(NULL));
+        fclose(f);
+    }
 }
 
 /**
- * Extract package to destination
+ * Start tar for every verified package whose dependencies are installed
+ *
+ * The plan lists dependencies first, so a failure propagates to all
+ * dependents in a single pass.
  */
-static int extract_package(const char *pkg_path, const char *dest) {
-    char cmd[1024];
-    snprintf(cmd, sizeof(cmd), "tar -xJf %s -C %s", pkg_path, dest);
+static void start_extractions(const plan_t *plan, download_t *dls, int *extracting,
+                              int *failed) {
+    for (int p = 0; p < plan->count; p++) {
+        download_t *dl = &dls[p];
+        int ready = 1;
+
+        if (dl->state != PKG_VERIFIED)
+            continue;
+
+        for (int j = plan->dep_start[p]; j < plan->dep_start[p + 1]; j++) {
+            const download_t *dep = &dls[plan->deps[j]];
+            if (dep->state == PKG_FAILED) {
+                fprintf(stderr, "Skipping %s: dependency %s failed\n",
+                        dl->pkg->name, dep->pkg->name);
+                dl->state = PKG_FAILED;
+                (*failed)++;
+                break;
+            }
+            ready &= dep->state == PKG_INSTALLED;
+        }
+        if (dl->state != PKG_VERIFIED || !ready)
+            continue;
+
+        dl->extract_pid = extract_package(dl->path, "/");
+        if (dl->extract_pid > 0) {
+            dl->state = PKG_EXTRACTING;
+            (*extracting)++;
+        } else {
+            fprintf(stderr, "Failed to extract %s\n", dl->pkg->name);
+            dl->state = PKG_FAILED;
+            (*failed)++;
+        }
+    }
+}
+
+/**
+ * Download, verify and extract an install plan
+ *
+ * Every download shares one multi handle, so transfers to the repository
+ * reuse its connections and run as HTTP/2 streams where the server allows,
+ * with at most MAX_HOST_CONNECTIONS per host. A package's tar is started
+ * as soon as its own archive is verified and its dependencies are
+ * installed, while the rest still download.
+ *
+ * Returns the number of packages that failed.
+ */
+static int install_packages(const plan_t *plan) {
+    int count = plan->count;
+    download_t *dls = calloc((size_t)count, sizeof(download_t));
+    CURLM *multi = curl_multi_init();
+    int failed = 0;
+    int extracting = 0;
+
+    if (!dls || !multi) {
+        fprintf(stderr, "Failed to initialize downloads\n");
+        free(dls);
+        if (multi)
+            curl_multi_cleanup(multi);
+        return count;
+    }
+
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)MAX_HOST_CONNECTIONS);
+
+    for (int i = 0; i < count; i++) {
+        download_t *dl = &dls[i];
+        const package_t *pkg = &plan->pkgs[i];
+
+        dl->pkg = pkg;
+        dl->extract_pid = -1;
+        snprintf(dl->path, sizeof(dl->path), "%s/%s.tar.xz", CACHE_DIR, pkg->name);
+        snprintf(dl->part, sizeof(dl->part), "%s.part", dl->path);
 
-    int ret = system(cmd);
-    return (ret == 0) ? 0 : -1;
+        /* A verified copy in the cache needs no download */
+        if (access(dl->path, F_OK) == 0 && verify_checksum(dl->path, pkg->checksum) == 0) {
+            printf("Using cached %s\n", dl->path);
+            dl->state = PKG_VERIFIED;
+            continue;
+        }
+
+        printf("Downloading %s %s...\n", pkg->name, pkg->version);
+        dl->state = PKG_DOWNLOADING;
+        if (download_start(multi, dl) != 0) {
+            fprintf(stderr, "Failed to start download of %s\n", pkg->name);
+            dl->state = PKG_FAILED;
+            failed++;
+        }
+    }
+    start_extractions(plan, dls, &extracting, &failed);
+
+    int running = 1;
+
+    while (running > 0 || extracting > 0) {
+        if (curl_multi_perform(multi, &running) != CURLM_OK)
+            running = 0;
+
+        CURLMsg *msg;
+        int left;
+        int progress = 0;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            download_t *dl = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&dl);
+            if (download_finish(multi, dl, msg->data.result) == 0) {
+                dl->state = PKG_VERIFIED;
+            } else {
+                dl->state = PKG_FAILED;
+                failed++;
+            }
+            progress = 1;
+        }
+
+        /* Reap finished extractions */
+        int status;
+        pid_t pid;
+        while (extracting > 0 && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < count; i++) {
+                if (dls[i].state != PKG_EXTRACTING || dls[i].extract_pid != pid)
+                    continue;
+
+                extracting--;
+                if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                    mark_installed(dls[i].pkg);
+                    printf("Package %s installed successfully\n", dls[i].pkg->name);
+                    dls[i].state = PKG_INSTALLED;
+                } else {
+                    fprintf(stderr, "Failed to extract %s\n", dls[i].pkg->name);
+                    dls[i].state = PKG_FAILED;
+                    failed++;
+                }
+                progress = 1;
+                break;
+            }
+        }
+
+        if (progress)
+            start_extractions(plan, dls, &extracting, &failed);
+
+        /* tar exits are polled, so wake up often while any is running */
+        if (running > 0 || extracting > 0)
+            curl_multi_poll(multi, NULL, 0, extracting > 0 ? 50 : 1000, NULL);
+    }
+
+    /* Transfers abandoned after a multi handle error */
+    for (int i = 0; i < count; i++) {
+        if (dls[i].curl) {
+            download_finish(multi, &dls[i], CURLE_ABORTED_BY_CALLBACK);
+            failed++;
+        }
+    }
+
+    curl_multi_cleanup(multi);
+    free(dls);
+    return failed;
+}
+
+/**
+ * Start extracting a package to destination
+ *
+ * Returns the pid of the tar process, or -1.
+ */
+static pid_t extract_package(const char *pkg_path, const char *dest) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("tar", "tar", "-xJf", pkg_path, "-C", dest, (char *)NULL);
+        _exit(127);
+    }
+    return pid;
 }
 
 /**
  * Verify package checksum
+ *
+ * Used for archives already in the cache; fresh downloads are hashed as
+ * they arrive. Returns 0 if the file's SHA-256 matches.
  */
 static int verify_checksum(const char *file, const char *expected) {
-    /* TODO: Implement SHA256 checksum verification */
-    (void)file;
-    (void)expected;
-    return 0;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    sha256_t ctx;
+    char buf[65536];
+    ssize_t n;
+
+    sha256_init(&ctx);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        sha256_update(&ctx, buf, (size_t)n);
+    close(fd);
+    if (n < 0)
+        return -1;
+
+    char digest[65];
+    sha256_final(&ctx, digest);
+    return strcasecmp(digest, expected) == 0 ? 0 : -1;
 }